@@ -2,6 +2,7 @@
 #define _CONFIG_H
 
 #include "Arduino.h"
+#include "portable_configs.h"  // The settings the host benches share
 
 
 /*--------------- BOARD_VERSIOIN_SETTING ---------------*/
@@ -67,6 +68,8 @@
 
 #define RF_FREQUENCY 433000000  // Hz  center frequency
 #define TX_OUTPUT_POWER 22      // dBm tx output power
+#define TX_TIMEOUT_VALUE 3000   // ms, SX126x-Arduino gives up a TX after
+#define RX_TIMEOUT_VALUE 0      // continuous receive
 #define LORA_BANDWIDTH \
     4  // bandwidth=125khz  0:250kHZ,1:125kHZ,2:62kHZ,3:20kHZ.... look for radio
 // line 392
@@ -84,6 +87,35 @@
 #define LORA_PAYLOADLENGTH \
     0  // 0: variable receive length
        // 1..255 payloadlength
+
+#define LORA_RX_QUEUE_LEN 16     // packets, the oldest is dropped when full
+#define LORA_STATE_TIMEOUT 500   // ms, over the airtime for CAD/TX done
+#define LORA_CAD_BACKOFF_MIN 10  // ms, random wait after channel busy
+#define LORA_CAD_BACKOFF_MAX 50  // ms
+
+// TDMA, a data slot holds one LORA_PACKET_SIZE frame at 125 kHz, 4/5.
+// Off, CAD wins below capacity, tdma_bench at 5 Hz telemetry: command max
+// 294 ms with CAD, 1255 ms with TDMA. Only past it, 10 Hz, does TDMA bound
+// the command max, 1255 ms against 2346 ms, and it still carries less.
+// #define USE_LORA_TDMA
+#if LORA_SPREADING_FACTOR <= 7
+#define LORA_TDMA_SLOT 130  // ms
+#elif LORA_SPREADING_FACTOR == 8
+#define LORA_TDMA_SLOT 230
+#elif LORA_SPREADING_FACTOR == 9
+#define LORA_TDMA_SLOT 410
+#elif LORA_SPREADING_FACTOR == 10
+#define LORA_TDMA_SLOT 720
+#elif LORA_SPREADING_FACTOR == 11
+#define LORA_TDMA_SLOT 1600
+#else
+#define LORA_TDMA_SLOT 2850
+#endif
+#define LORA_TDMA_BEACON (LORA_TDMA_SLOT / 3)  // ms, beacon slot
+#define LORA_TDMA_GUARD 5                     // ms, drift and IRQ latency
+#define LORA_TDMA_DOWNLINK 4                  // vehicle slots per frame
+#define LORA_TDMA_UPLINK 1                    // ground slots per frame
+#define LORA_TDMA_SYNC_LOSS 4  // frames without beacon before using CAD
 #endif
 
 #ifdef USE_DUAL_SYSTEM_WATCHDOG
@@ -162,6 +194,50 @@
 #define WIFI_PASSWARD "Pioneer1"  // default passward
 #define WIFI_HOST_NAME "nckuisp"  // default host name
 #endif
+#define WIFI_ASSET_TABLE_LEN 16  // web files cached at startup
+#define WIFI_WS_MAX_CLIENTS 4    // websocket clients served at once
+#define WIFI_WS_TELEMETRY_LEN 4  // telemetry frames queued per client
+#define WIFI_WS_COMMAND_LEN 8    // command responses queued per client
+#define WIFI_WS_DROP_POLICY WS_DROP_OLDEST  // full telemetry queue policy
+
+/*-------------------- System events --------------------*/
+#define SYSTEM_EVENT_QUEUE_LEN 16  // events from Tickers, a power of two
+
+/*---------------------- Dual core ----------------------*/
+/* Core of each task of core.cpp. With USE_DUAL_CORE the sensor, flight *
+ * and command tasks run pinned to FLIGHT_CORE, comms, file writes and  *
+ * OTA to COMMS_CORE, a single core runs them all in one loop.          */
+#define FLIGHT_CORE 1  // The Arduino loop core of the ESP32
+#define COMMS_CORE 0   // The WiFi stack core of the ESP32
+#ifdef V2_ESP32
+#define USE_DUAL_CORE
+#define FLIGHT_TASK_PRIORITY 5    // Above async_tcp (3) and the loop (1)
+#define COMMS_TASK_PRIORITY 2
+#define CORE_TASK_STACK 8192      // bytes, each pinned task
+#define OUTPUT_QUEUE_LEN 16       // lines to the comms core, a power of two
+#define COMMAND_QUEUE_LEN 4       // lines to the flight core, a power of two
+#define COMMAND_LINE_LEN 128      // bytes of a queued command line
+#define COMMAND_TASK_PERIOD 2000  // us, with the sensor, the core sleeps
+#else
+#define COMMAND_TASK_PERIOD 0  // us, every loop pass
+#endif
+
+/*---------------------- Warm boot ----------------------*/
+/* A restart with the calibration in RTC memory skips the boot wait and *
+ * the baro calibration, and starts WiFi and OTA after SYSTEM_READY. A  *
+ * flight goes on in the phase saved last.                              */
+#define USE_WARM_BOOT
+#define WARM_BOOT_SAVE_PERIOD 100  // ms, the flight saved while OFFGROUND
+#define BOOT_WAIT 3000             // ms, setup() on a cold boot
+
+/*---------------------- Heap guard ---------------------*/
+/* The esp07s_heap_guard env defines USE_HEAP_GUARD, the allocations     *
+ * after SYSTEM_READY are then counted and shown by "stats". With the    *
+ * trap the first one aborts, for builds without USE_WIFI_COMMUNICATION, *
+ * the async web server allocates on every message.                     */
+// #define HEAP_GUARD_TRAP
+#define SERIAL_CMD_LEN 128   // bytes of a serial command line, reserved
+#define FLIGHT_LINE_LEN 192  // bytes of a flight log line, on the stack
 
 
 /*------------ Configuration for parachute --------------*/
@@ -240,8 +316,22 @@
 #endif
 
 /*------------------ Watchdog protection ----------------*/
+/* The two MCUs exchange a heartbeat frame over SPI, see heartbeat.h. The *
+ * primary is the SPI master, build the backup with DUAL_SYSTEM_BACKUP.   *
+ * The period and the timeout are in portable_configs.h.                  */
 #ifdef USE_DUAL_SYSTEM_WATCHDOG
-#define WATCH_SPI_TIMEOUT 100  // ms
+// #define DUAL_SYSTEM_BACKUP  // SPI slave, takes over on a lost primary
+#define HEARTBEAT_SPI_HZ 4000000
+#ifdef DUAL_SYSTEM_BACKUP
+#define HEARTBEAT_TASK_PERIOD (HEARTBEAT_PERIOD / 2)  // Polls the slave
+#else
+#define HEARTBEAT_TASK_PERIOD HEARTBEAT_PERIOD
+#endif
+#ifdef V2_ESP32
+#define PIN_PARTNER_SCK 14  // HSPI, SPI (VSPI) stays with SD and LoRa
+#define PIN_PARTNER_MISO 12
+#define PIN_PARTNER_MOSI 13
+#endif
 #endif
 
 enum ERROR_CODE {
@@ -261,9 +351,6 @@ enum INFO_CODE {
     INFO_LORA_INIT
 };
 
-#define LIFT_OFF_PROTECT_TIME 1000
-#define IMU_LIFT_OFF_DETECTION_G 2.5f
-
 #endif
 
 #ifdef ENGINE_LOADING_TEST
@@ -0,0 +1,53 @@
+#ifndef _PORTABLE_CONFIGS_H
+#define _PORTABLE_CONFIGS_H
+
+/* The settings of the libraries that also build on the host. No Arduino *
+ * here, configs.h includes it for the firmware and the libraries include *
+ * it themselves, so a bench runs with the values that fly.               */
+
+/*---------------------- Flight phase -------------------*/
+#define LIFT_OFF_PROTECT_TIME 1000
+#define IMU_LIFT_OFF_DETECTION_G 2.5f
+
+/* Flight state machine, guards on every sensor sample */
+#define FLIGHT_LIFTOFF_G IMU_LIFT_OFF_DETECTION_G
+#define FLIGHT_LIFTOFF_SAMPLES 3  // in a row above, a bump is one
+#define FLIGHT_BURNOUT_G 2.0f     // g, below is coasting, drag reads less
+#define FLIGHT_BURNOUT_SAMPLES 5
+#define FLIGHT_PROTECT_TIME LIFT_OFF_PROTECT_TIME
+#define FLIGHT_LANDED_HEIGHT 10  // m, with the speed below, landed
+#define FLIGHT_LANDED_SPEED -12  // m/s
+#define FLIGHT_REST_SPEED 1.0f   // m/s, within and below the height, landed
+#define FLIGHT_REST_SAMPLES 250
+
+/* Apogee vote, each vote sets after its hold in a row and clears after *
+ * the opposite holds as long                                           */
+#define APOGEE_VOTES 2                // of baro, inertial and peak
+#define APOGEE_BARO_SET 0.0f          // m/s, the sign change
+#define APOGEE_BARO_CLEAR 0.5f        // m/s
+#define APOGEE_BARO_HOLD 6            // baro samples, over a 40 ms spike
+#define APOGEE_INERTIAL_SET -1.0f     // m/s
+#define APOGEE_INERTIAL_CLEAR 1.0f    // m/s
+#define APOGEE_INERTIAL_HOLD 5        // IMU samples
+#define APOGEE_PEAK_DROP 2.0f         // m below the highest reading
+#define APOGEE_PEAK_HOLD 6            // baro samples
+#define APOGEE_ACC_UP(acc) ((acc).z)  // g, accelerometer axis nose up
+
+/*---------------------- Warm boot ----------------------*/
+#define WARM_BOOT_RTC_OFFSET 32  // 4 byte blocks, past the OTA command
+
+/*------------------ Watchdog protection ----------------*/
+#define HEARTBEAT_PERIOD 1000   // us, a transfer of the primary
+#define HEARTBEAT_TIMEOUT 6000  // us without a good frame, partner lost
+
+/*------------------- LoRa packet codec -----------------*/
+#define LORA_PACKET_SIZE 64    // bytes, radio frame payload
+#define LORA_STATE_KEYFRAME 8  // state packets per keyframe, deltas between
+
+/*----------------- ESP-NOW Communication ----------------*/
+#define ESPNOW_CMD_TIMEOUT 25      // ms, wait for ack before resend
+#define ESPNOW_CMD_MAX_RETRIES 5   // resend times before reporting failure
+#define ESPNOW_CMD_PENDING_LEN 4   // commands waiting for ack at once
+#define ESPNOW_CMD_MAX_LENGTH 200  // bytes of command text per frame
+
+#endif
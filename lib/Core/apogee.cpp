@@ -0,0 +1,68 @@
+#include "apogee.h"
+
+#include <string.h>
+
+#define G 9.80665f
+
+/* Count toward setting or clearing, a vote flips after hold in a row */
+static void vote(ApogeeVote &v, bool set, bool clear, uint8_t hold, uint32_t t)
+{
+    const bool toward = v.on ? clear : set;
+    v.hits = toward ? v.hits + 1 : 0;
+    if (v.hits < hold)
+        return;
+    v.on = !v.on;
+    v.hits = 0;
+    if (v.on)
+        v.since = t;
+}
+
+ApogeeDetector::ApogeeDetector()
+{
+    limits.votes = APOGEE_VOTES;
+    limits.baroSet = APOGEE_BARO_SET;
+    limits.baroClear = APOGEE_BARO_CLEAR;
+    limits.baroHold = APOGEE_BARO_HOLD;
+    limits.inertialSet = APOGEE_INERTIAL_SET;
+    limits.inertialClear = APOGEE_INERTIAL_CLEAR;
+    limits.inertialHold = APOGEE_INERTIAL_HOLD;
+    limits.peakDrop = APOGEE_PEAK_DROP;
+    limits.peakHold = APOGEE_PEAK_HOLD;
+    reset(0, 0);
+}
+
+void ApogeeDetector::reset(uint32_t t, float height)
+{
+    memset(&baro, 0, sizeof(baro));
+    memset(&inertial, 0, sizeof(inertial));
+    memset(&peak, 0, sizeof(peak));
+    last = t;
+    velocity = 0;
+    heightMax = height;
+    detected = false;
+    detectedAt = 0;
+}
+
+bool ApogeeDetector::update(const ApogeeInput &in)
+{
+    // Proper acceleration reads 1 g at rest, take it off
+    velocity += (in.accUp - 1) * G * ((in.t - last) / 1e6f);
+    last = in.t;
+    vote(inertial, velocity < limits.inertialSet,
+         velocity > limits.inertialClear, limits.inertialHold, in.t);
+
+    if (in.baroNew) {
+        vote(baro, in.baroSpeed < limits.baroSet,
+             in.baroSpeed > limits.baroClear, limits.baroHold, in.t);
+        if (in.height > heightMax)
+            heightMax = in.height;
+        const bool below = in.height < heightMax - limits.peakDrop;
+        vote(peak, below, !below, limits.peakHold, in.t);
+    }
+
+    if (detected || votes() < limits.votes)
+        return false;
+    detected = true;
+    detectedAt = in.t;
+    return true;
+}
@@ -0,0 +1,79 @@
+/*
+ * This library detects the apogee by a vote of three signals.
+ * Including
+ * 1. Baro, the differentiated altitude estimate falls below a speed
+ * 2. Inertial, the acceleration along the rocket integrated from lift
+ *    off falls below a speed
+ * 3. Peak, the altitude falls a distance below its highest reading,
+ *    the pressure minimum
+ * Each vote sets after its condition holds a number of samples in a row
+ * and clears after the opposite holds as long, the hysteresis. The
+ * apogee is the first sample with APOGEE_VOTES votes set. Run it on
+ * every IMU sample, the baro votes count baro samples only.
+ *
+ * Example:
+ *     ApogeeDetector apogee;
+ *     apogee.reset(liftoff_t, height);
+ *     for (;;) {
+ *         ApogeeInput in = {micros(), acc_up, height, speed, baro_new};
+ *         if (apogee.update(in))
+ *             deploy();
+ *     }
+ */
+
+#ifndef _APOGEE_H
+#define _APOGEE_H
+
+#include <stdint.h>
+
+#include "../../include/portable_configs.h"
+
+struct ApogeeInput {
+    uint32_t t;       // us
+    float accUp;      // g, along the rocket nose up, 1 at rest
+    float height;     // m
+    float baroSpeed;  // m/s, from the altitude estimate
+    bool baroNew;     // height and baroSpeed are a new baro sample
+};
+
+struct ApogeeLimits {
+    uint8_t votes;
+    float baroSet, baroClear;
+    uint8_t baroHold;
+    float inertialSet, inertialClear;
+    uint8_t inertialHold;
+    float peakDrop;
+    uint8_t peakHold;
+};
+
+struct ApogeeVote {
+    bool on;
+    uint8_t hits;    // Samples in a row toward the other state
+    uint32_t since;  // us, last set
+};
+
+class ApogeeDetector
+{
+private:
+    uint32_t last;  // us, previous sample
+
+public:
+    ApogeeLimits limits;
+    ApogeeVote baro, inertial, peak;
+    float velocity;   // m/s, integrated from the reset
+    float heightMax;  // m
+    bool detected;
+    uint32_t detectedAt;  // us
+
+    ApogeeDetector();
+
+    /* Start at lift off, at rest on the rail */
+    void reset(uint32_t t, float height);
+
+    /* Return true on the sample the apogee is detected, once */
+    bool update(const ApogeeInput &in);
+
+    uint8_t votes() const { return baro.on + inertial.on + peak.on; }
+};
+
+#endif
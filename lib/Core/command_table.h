@@ -0,0 +1,195 @@
+/*
+ * This library dispatches text commands from a static table.
+ * Including
+ * 1. A sorted table, looked up by binary search on the command name
+ * 2. Tokens as pointer and length into the command line, no copy
+ * 3. Typed argument parsing, integer, number, key and the rest of line
+ * Nothing is allocated on the way to the handler.
+ *
+ * The name is the leading run of letters and '_' ("count10" is "count"
+ * with 10), or the first word when it has none ("0"). Entries with
+ * CMD_EXACT match only when nothing follows the name.
+ *
+ * Example:
+ *     static CommandEntry<Robot, String> table[] = {
+ *         {"speed", CMD_ARGS, set_speed},  // "speed 10", "speed10"
+ *         {"stop", CMD_EXACT, stop},
+ *     };
+ *     CommandTable<Robot, String> commands(table, 2);  // Sorts the table
+ *     commands.dispatch(robot, "speed 10", reply);
+ */
+
+#ifndef _COMMAND_TABLE_H
+#define _COMMAND_TABLE_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+enum CMD_MATCH { CMD_EXACT, CMD_ARGS };
+enum CMD_RESULT { CMD_UNKNOWN, CMD_DONE, CMD_KEEP };
+
+/* Slice of the command line */
+struct CmdToken {
+    const char *str;
+    uint8_t len;
+
+    bool operator==(const char *s) const
+    {
+        return strncmp(str, s, len) == 0 && s[len] == 0;
+    }
+};
+
+/* Cursor over the arguments after the command name */
+class CmdArgs
+{
+private:
+    const char *cur;
+
+    static bool isName(char c)
+    {
+        return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
+    }
+
+    void skipSpaces()
+    {
+        while (*cur == ' ')
+            cur++;
+    }
+
+public:
+    CmdArgs(const char *line) : cur(line) {}
+
+    /* Split the command name off the line, return false if empty. */
+    static bool name(const char *line, CmdToken &t, CmdArgs &args)
+    {
+        const char *p = line;
+        while (isName(*p))
+            p++;
+        if (p == line) {
+            while (*p && *p != ' ')
+                p++;
+        }
+        t.str = line;
+        t.len = p - line;
+        args.cur = p;
+        return t.len != 0;
+    }
+
+    /* The next run of letters and '_', e.g. a sub command. */
+    bool key(CmdToken &t)
+    {
+        skipSpaces();
+        t.str = cur;
+        while (isName(*cur))
+            cur++;
+        t.len = cur - t.str;
+        return t.len != 0;
+    }
+
+    bool integer(long &v)
+    {
+        char *end;
+        v = strtol(cur, &end, 10);
+        if (end == cur)
+            return false;
+        cur = end;
+        return true;
+    }
+
+    bool number(double &v)
+    {
+        char *end;
+        v = strtod(cur, &end);
+        if (end == cur)
+            return false;
+        cur = end;
+        return true;
+    }
+
+    /* What is left, as it is */
+    const char *raw() const { return cur; }
+
+    /* What is left without the leading spaces, e.g. a file name */
+    const char *rest()
+    {
+        skipSpaces();
+        return cur;
+    }
+
+    bool empty()
+    {
+        skipSpaces();
+        return *cur == 0;
+    }
+};
+
+template <typename Ctx, typename Reply>
+struct CommandEntry {
+    const char *name;
+    CMD_MATCH match;
+    /* Write the answer into reply, return true to be called again with *
+     * the same command (the file is read in chunks).                   */
+    bool (*run)(Ctx &ctx, CmdArgs &args, Reply &reply);
+};
+
+template <typename Ctx, typename Reply>
+class CommandTable
+{
+private:
+    CommandEntry<Ctx, Reply> *entries;
+    uint8_t count;
+
+    static int compareEntries(const void *a, const void *b)
+    {
+        return strcmp(((const CommandEntry<Ctx, Reply> *) a)->name,
+                      ((const CommandEntry<Ctx, Reply> *) b)->name);
+    }
+
+    /* strcmp of the token against a name */
+    static int compareToken(const CmdToken &t, const char *name)
+    {
+        const int c = strncmp(t.str, name, t.len);
+        if (c)
+            return c;
+        return name[t.len] ? -1 : 0;
+    }
+
+public:
+    /* Sort the table in place once, so it can be written in any order. */
+    CommandTable(CommandEntry<Ctx, Reply> *_entries, uint8_t _count)
+        : entries(_entries), count(_count)
+    {
+        qsort(entries, count, sizeof(entries[0]), compareEntries);
+    }
+
+    const CommandEntry<Ctx, Reply> *find(const CmdToken &t) const
+    {
+        int lo = 0, hi = count - 1;
+        while (lo <= hi) {
+            const int mid = (lo + hi) / 2;
+            const int c = compareToken(t, entries[mid].name);
+            if (!c)
+                return &entries[mid];
+            if (c < 0)
+                hi = mid - 1;
+            else
+                lo = mid + 1;
+        }
+        return NULL;
+    }
+
+    CMD_RESULT dispatch(Ctx &ctx, const char *line, Reply &reply) const
+    {
+        CmdToken t;
+        CmdArgs args(line);
+        if (!CmdArgs::name(line, t, args))
+            return CMD_UNKNOWN;
+        const CommandEntry<Ctx, Reply> *e = find(t);
+        if (!e || (e->match == CMD_EXACT && !args.empty()))
+            return CMD_UNKNOWN;
+        return e->run(ctx, args, reply) ? CMD_KEEP : CMD_DONE;
+    }
+};
+
+#endif
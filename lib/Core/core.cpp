@@ -1,17 +1,373 @@
 #include "core.h"
 #include <Arduino.h>
+#ifdef USE_DUAL_CORE
+#include <esp_timer.h>
+#endif
+
+#ifdef USE_DUAL_SYSTEM_WATCHDOG
+#include <SPI.h>
+#ifdef DUAL_SYSTEM_BACKUP
+#ifndef ESP32
+#error "DUAL_SYSTEM_BACKUP needs the SPI slave driver of the ESP32"
+#endif
+#include <driver/spi_slave.h>
+#endif
+#endif
+
+/* Tasks of the main loop, what System::loop() used to run in sequence. *
+ * Sensors, flight and the events (parachute from the Tickers) go        *
+ * first, comms and OTA fill the rest. With two cores each runs on the   *
+ * core of its table entry, see startCores().                            */
+#ifdef USE_WIFI_COMMUNICATION
+static void comms_task(void *ctx)
+{
+    System *sys = (System *) ctx;
+    if (sys->bootPending)
+        return;
+    sys->comms.loop();  // Loop for the wifi opertation
+    // Read and react to the command from comms or debugger
+    if (sys->comms.message != "") {
+        // Substring 4 char to cut out the board prefix of message
+        sys->submit(sys->comms.message.substring(4).c_str(), CMD_WIFI);
+#ifdef USE_DUAL_CORE
+        sys->comms.message = "";  // Queued, the response does not clear it
+#endif
+    }
+}
+
+// Reserved by init(), a line within SERIAL_CMD_LEN never reallocates
+static String serial_cmd = "";
+
+static void serial_task(void *ctx)
+{
+    System *sys = (System *) ctx;
+    static bool keep = false;
+    if (Serial.available() || serial_cmd != "") {
+        int c = Serial.read();
+        if (c <= 0 || c >= 0xfe) {
+        } else if (c != '\n' && !keep) {
+            Serial.print((char) c);
+            serial_cmd += (char) c;
+        } else {
+#ifdef GROUND_STATION
+#ifdef USE_ESPNOW_COMMUNICATION
+            // Commands go through the acknowledged channel
+            sendESPNOWCommand(serial_cmd.c_str());
+#else
+            serial_cmd += "\n";
+            sys->comms.wifi_broadcast(String("[") + sys->rocket.btype + "] " +
+                                      serial_cmd);
+#endif
+#else
+            keep = sys->submit(serial_cmd.c_str(), CMD_SERIAL);
+#endif
+            if (!keep)
+                serial_cmd = "";
+        }
+    }
+}
+#endif
+
+static void command_task(void *ctx)
+{
+    System *sys = (System *) ctx;
+#ifdef USE_DUAL_CORE
+    // Commands write files and comms, never during a comms pass, and the
+    // flight core never waits for one, the events keep for the next run
+    if (xSemaphoreTake(sys->ioLock, 0) != pdTRUE)
+        return;
+#endif
+    sys->handleEvents();
+    sys->runCommands();
+#ifdef USE_ESPNOW_COMMUNICATION
+    char *esp_now_msg = fetchESPNOWMessage();
+    if (esp_now_msg) {
+#ifdef GROUND_STATION
+        Serial.println(">>>");
+        Serial.println(esp_now_msg);
+        Serial.println("<<<");
+#else
+        Serial.printf("Fetch: %s\n", esp_now_msg);
+        esp_now_msg[strlen(esp_now_msg) - 1] = 0;
+        sys->command(esp_now_msg + 4, CMD_BOTH);
+#endif
+        clearESPNOWMessage();
+    }
+#ifndef GROUND_STATION
+    const char *esp_now_cmd = fetchESPNOWCommand();
+    if (esp_now_cmd) {
+        // A kept command stays fetched, and is acked once it is done
+        const CMD_RESULT result = sys->command(esp_now_cmd, CMD_BOTH);
+        if (result == CMD_UNKNOWN)
+            ackESPNOWCommand(COMMAND_REJECTED);
+        else if (result == CMD_DONE)
+            ackESPNOWCommand(COMMAND_EXECUTED);
+    }
+#endif
+#endif
+#ifdef USE_DUAL_CORE
+    xSemaphoreGive(sys->ioLock);
+#endif
+}
+
+static void sensor_task(void *ctx)
+{
+    System *sys = (System *) ctx;
+    sys->sensor.update();
+    sys->track();
+}
+
+#ifdef ONBOARD_AVIONICS
+static void flight_task(void *ctx)
+{
+    ((System *) ctx)->flight();
+}
+#endif
+
+#ifdef USE_DUAL_SYSTEM_WATCHDOG
+static void heartbeat_task(void *ctx)
+{
+    ((System *) ctx)->beat();
+}
+#endif
+
+#ifdef USE_WIFI_COMMUNICATION
+#ifdef ENGINE_LOADING_TEST
+static void loading_test_task(void *ctx)
+{
+    System *sys = (System *) ctx;
+    sys->loading_test(&sys->comms.message);
+}
+#endif
+
+static void ota_task(void *ctx)
+{
+    if (!((System *) ctx)->bootPending)
+        ArduinoOTA.handle();
+}
+
+// WiFi and OTA of a warm boot, once the flight tasks run
+static void boot_task(void *ctx)
+{
+    ((System *) ctx)->finishBoot();
+}
+#endif
+
+#ifdef USE_DUAL_CORE
+// The lines of the flight core, to the file and comms
+static void output_task(void *ctx)
+{
+    System *sys = (System *) ctx;
+    OutputLine line;
+    while (sys->outputs.poll(line))
+        sys->output(line.sinks, line.text);
+}
+#endif
+
+#ifdef USE_GPS_NEO6M
+static void gps_task(void *ctx)
+{
+    if (imu.gpsSerial.available()) {
+        char m = (char) imu.gpsSerial.read();
+        if (m != '\n')
+            imu.gpsCode += m;
+        else {
+            ((System *) ctx)->comms.wifi_broadcast(imu.gpsCode);
+            imu.gpsCode = "";
+        }
+    }
+}
+#endif
+
+#ifdef DE_SPIN_CONTROL
+static void despin_task(void *ctx)
+{
+    System *sys = (System *) ctx;
+    sys->deSpinControl(sys->PID_ON);
+}
+#endif
 
+// name, function, period us, priority, budget us, core
+static SchedulerTask tasks[] = {
+    {"sensor", sensor_task, 2000, 3, 1500, FLIGHT_CORE},
+#ifdef ONBOARD_AVIONICS
+    {"flight", flight_task, 2000, 3, 1000, FLIGHT_CORE},
+#endif
 #ifdef USE_DUAL_SYSTEM_WATCHDOG
-SYSTEM_STATE System::state = SYSTEM_UP;
+    {"heartbeat", heartbeat_task, HEARTBEAT_TASK_PERIOD, 3, 200, FLIGHT_CORE},
+#endif
+    {"command", command_task, COMMAND_TASK_PERIOD, 3, 5000, FLIGHT_CORE},
+#ifdef USE_WIFI_COMMUNICATION
+#ifdef ENGINE_LOADING_TEST
+    {"loadcell", loading_test_task, 0, 2, 15000, COMMS_CORE},
 #endif
+    {"serial", serial_task, 0, 1, 500, COMMS_CORE},
+    {"comms", comms_task, 2000, 1, 5000, COMMS_CORE},
+    {"ota", ota_task, 100000, 0, 5000, COMMS_CORE},
+    {"boot", boot_task, 100000, 0, 500000, COMMS_CORE},
+#endif
+#ifdef USE_DUAL_CORE
+    {"output", output_task, 0, 1, 5000, COMMS_CORE},
+#endif
+#ifdef USE_GPS_NEO6M
+    {"gps", gps_task, 0, 1, 500, COMMS_CORE},
+#endif
+#ifdef DE_SPIN_CONTROL
+    {"despin", despin_task, 10000, 3, 1000, FLIGHT_CORE},
+#endif
+};
+
+static uint32_t clock_us()
+{
+    return micros();
+}
+
+#ifdef USE_DUAL_SYSTEM_WATCHDOG
+/* The heartbeat link of beat(). The primary, SPI master, sends its frame *
+ * and reads the partner's in the same transfer. The backup keeps an     *
+ * answer queued in the slave driver and takes the frame of a completed  *
+ * transfer when it polls, twice a period.                               */
+static uint8_t partner_tx[HEARTBEAT_FRAME_LEN];
+static uint8_t partner_rx[HEARTBEAT_FRAME_LEN];
+
+#ifdef DUAL_SYSTEM_BACKUP
+static spi_slave_transaction_t partner_trans;
+static bool partner_queued = false;
+
+static void partner_begin()
+{
+    spi_bus_config_t bus = {};
+    bus.mosi_io_num = PIN_PARTNER_MOSI;
+    bus.miso_io_num = PIN_PARTNER_MISO;
+    bus.sclk_io_num = PIN_PARTNER_SCK;
+    bus.quadwp_io_num = -1;
+    bus.quadhd_io_num = -1;
+    spi_slave_interface_config_t slave = {};
+    slave.spics_io_num = PIN_SPI_CS_PARTNER;
+    slave.queue_size = 1;
+    slave.mode = 0;
+    spi_slave_initialize(HSPI_HOST, &bus, &slave, 0);  // No DMA, 16 bytes
+}
+
+/* The frame of a completed transfer into partner_rx, false if none */
+static bool partner_poll()
+{
+    spi_slave_transaction_t *done;
+    if (!partner_queued ||
+        spi_slave_get_trans_result(HSPI_HOST, &done, 0) != ESP_OK)
+        return false;
+    partner_queued = false;
+    return true;
+}
+
+/* partner_tx, the answer to the next transfer of the primary */
+static void partner_queue()
+{
+    partner_trans.length = HEARTBEAT_FRAME_LEN * 8;
+    partner_trans.tx_buffer = partner_tx;
+    partner_trans.rx_buffer = partner_rx;
+    partner_queued =
+        spi_slave_queue_trans(HSPI_HOST, &partner_trans, 0) == ESP_OK;
+}
+#else
+#ifdef ESP32
+static SPIClass partner_spi(HSPI);
+#else
+static SPIClass &partner_spi = SPI;
+#endif
+
+static void partner_begin()
+{
+#ifdef ESP32
+    partner_spi.begin(PIN_PARTNER_SCK, PIN_PARTNER_MISO, PIN_PARTNER_MOSI,
+                      PIN_SPI_CS_PARTNER);
+#else
+    partner_spi.begin();
+#endif
+}
+
+/* partner_tx out, the partner's frame into partner_rx */
+static void partner_transfer()
+{
+    memcpy(partner_rx, partner_tx, HEARTBEAT_FRAME_LEN);
+    partner_spi.beginTransaction(
+        SPISettings(HEARTBEAT_SPI_HZ, MSBFIRST, SPI_MODE0));
+    digitalWrite(PIN_SPI_CS_PARTNER, LOW);
+    partner_spi.transfer(partner_rx, HEARTBEAT_FRAME_LEN);
+    digitalWrite(PIN_SPI_CS_PARTNER, HIGH);
+    partner_spi.endTransaction();
+}
+#endif
+#endif
+
+#ifdef USE_DUAL_CORE
+/* The pinned loops of startCores(). The flight one blocks until its next *
+ * task is due, woken by a one shot timer finer than the 1 ms tick, and  *
+ * stamps a pass only when a task is due. The comms one holds ioLock     *
+ * over a pass and sleeps a tick after each, for the idle task.          */
+static TaskHandle_t flight_handle;
+static esp_timer_handle_t flight_wake;
+
+static void wake_flight(void *)
+{
+    xTaskNotifyGive(flight_handle);
+}
+
+static void flight_core(void *ctx)
+{
+    System *sys = (System *) ctx;
+    for (;;) {
+        const uint32_t wait = sys->scheduler.untilDue(FLIGHT_CORE);
+        if (wait) {
+            esp_timer_start_once(flight_wake, wait);
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+            continue;
+        }
+        sys->loopTimer.pass(ESP.getCycleCount());
+        sys->scheduler.run(FLIGHT_CORE);
+    }
+}
+
+static void comms_core(void *ctx)
+{
+    System *sys = (System *) ctx;
+    for (;;) {
+        xSemaphoreTake(sys->ioLock, portMAX_DELAY);
+        sys->scheduler.run(COMMS_CORE);
+        xSemaphoreGive(sys->ioLock);
+        vTaskDelay(1);
+    }
+}
+#endif
+
+/* Flight state machine transitions, from the sensor task */
+static void on_phase(void *ctx, FLIGHT_PHASE phase, uint32_t t)
+{
+    ((System *) ctx)->phaseChanged(phase, t);
+}
 
 System::System()
     : logger(),
       sensor(),
-      config()
+      config(),
 #ifdef USE_WIFI_COMMUNICATION
+      comms(),  // Initialize wifi communication object
+#endif
+      scheduler(tasks, sizeof(tasks) / sizeof(tasks[0]), clock_us),
+      eventLatency(),
+      flightFsm(on_phase, this)
+#ifdef USE_DUAL_SYSTEM_WATCHDOG
       ,
-      comms()  // Initialize wifi communication object
+#ifdef DUAL_SYSTEM_BACKUP
+      heartbeat(ROLE_BACKUP)
+#else
+      heartbeat(ROLE_PRIMARY)
+#endif
+#endif
+#ifdef DE_SPIN_CONTROL
+      ,
+      reactionWheel(&gy_input, &bldc_output, &gy_target, ki, kp, kd, P_ON_M,
+                    DIRECT)
 #endif
 {
 // Pin set up
@@ -65,13 +421,22 @@ void System::load_config()
     kd = config.config.kd;
     gy_target = config.config.gy_target;
     bldc_init = config.config.bldc_init;
-    reactionWheel->SetTunings(kp, ki, kd);
-    reactionWheel->SetOutputLimits(0, config.config.speed_limit);
+    reactionWheel.SetTunings(kp, ki, kd);
+    reactionWheel.SetOutputLimits(0, config.config.speed_limit);
 #endif
 }
 
 SYSTEM_STATE System::init(bool soft_init)
 {
+    // Allocations are free until ready, a soft init starts over
+    HeapGuard::disarm();
+#ifdef USE_WARM_BOOT
+    // Restarted with the calibration in RTC memory, the sensors first and
+    // the comms after SYSTEM_READY
+    const bool warm = soft_init && boot.load();
+#else
+    const bool warm = false;
+#endif
     rocket = {.state = ROCKET_READY,
               .fairingOpened = false,
               .ftype = F_SERVO,
@@ -92,19 +457,24 @@ SYSTEM_STATE System::init(bool soft_init)
 #endif
 
     // Setup logger
-    if (!logger.init()) {
+    const bool logger_ok = logger.init();
+    if (!logger_ok) {
         buzz(BUZ_NONE);
     }
 #ifdef USE_WIFI_COMMUNICATION
-    if (soft_init)
+    if (soft_init && !warm)
         comms.init();
 #endif
-    if (soft_init)
+    if (soft_init && !warm)
         OTA_init();
+    bootPending = warm;
     // logger.log_code(INFO_LOGGER_INIT, LEVEL_INFO);
 
     // Setup sensors
-    if (sensor.init() != ERROR_OK) {
+    if (warm)
+        restoreCalibration();
+    const bool sensor_ok = sensor.init(warm) == ERROR_OK;
+    if (!sensor_ok) {
         // logger.log_code(ERROR_SENSOR_INIT_FAILED, LEVEL_ERROR);
         // buzzer(BUZ_LEVEL0);
         String error_msg = String("[") + rocket.btype +
@@ -118,6 +488,7 @@ SYSTEM_STATE System::init(bool soft_init)
         Serial.println("Sensor initialized success");
         comms.wifi_broadcast(String("[") + rocket.btype +
                              "] Sensor initialized success\n");
+        saveCalibration(warm);
     }
     // // logger.log_info(INFO_IMU_INIT);
     // // logger.log_code(INFO_IMU_INIT, LEVEL_INFO);
@@ -164,20 +535,151 @@ SYSTEM_STATE System::init(bool soft_init)
     gy_input = 0;
     bldc_output = 0;
     gy_target = 0;
-    reactionWheel = new PID(&gy_input, &bldc_output, &gy_target, ki, kp, kd,
-                            P_ON_M, DIRECT);
+    // Rebuilt in place, a soft init allocates nothing
+    reactionWheel = PID(&gy_input, &bldc_output, &gy_target, ki, kp, kd,
+                        P_ON_M, DIRECT);
     PID_ON = false;
-    reactionWheel->SetMode(PID_ON);
+    reactionWheel.SetMode(PID_ON);
 #endif
 
     load_config();
 
+    for (uint8_t i = 0; i < sizeof(tasks) / sizeof(tasks[0]); i++)
+        tasks[i].ctx = this;
+    scheduler.start();
+    loopTimer.cyclesPerUs = ESP.getCpuFreqMHz();
+    loopTimer.reset();
+
+#ifdef USE_WIFI_COMMUNICATION
+    serial_cmd.reserve(SERIAL_CMD_LEN);
+#endif
+#ifdef USE_DUAL_SYSTEM_WATCHDOG
+    // The partner has a timeout from now to answer, a soft init with it
+    heartbeat.local.health = (logger_ok ? HEALTH_LOGGER : 0) |
+                             (sensor_ok ? HEALTH_IMU | HEALTH_BARO : 0);
+    heartbeat.local.lastEvent = HEARTBEAT_NO_EVENT;
+    heartbeat.local.fired = 0;
+    heartbeat.reset(micros());
+    followed = false;
+    takenOver = false;
+    if (soft_init)
+        partner_begin();
+#endif
+    if (warm && boot.record.rocketState == ROCKET_OFFGROUND)
+        resumeFlight();
+    if (soft_init) {
+        startCores();
+        Serial.printf("Ready in %lu ms, %s boot\n", millis(),
+                      warm ? "warm" : "cold");
+    }
+#ifdef HEAP_GUARD_TRAP
+    HeapGuard::arm(true);
+#else
+    HeapGuard::arm(false);
+#endif
     return SYSTEM_READY;
 }
 
+void System::restoreCalibration()
+{
+    const WarmBootRecord &r = boot.record;
+    fvec_t *bias[] = {&sensor.acc_bias, &sensor.gyro_bias, &sensor.mag_bias};
+    const float *in[] = {r.accBias, r.gyroBias, r.magBias};
+    for (uint8_t i = 0; i < 3; i++) {
+        bias[i]->x = in[i][0];
+        bias[i]->y = in[i][1];
+        bias[i]->z = in[i][2];
+    }
+    sensor.setPressure(r.groundPa);
+}
+
+void System::saveCalibration(bool warm)
+{
+#ifdef USE_WARM_BOOT
+    WarmBootRecord &r = boot.record;
+    if (warm) {
+        r.restarts++;
+    } else {
+        r.restarts = 0;
+#ifdef USE_PERIPHERAL_BMP280
+        r.groundPa = sensor.getPressure(Pa);
+#endif
+        const fvec_t *bias[] = {&sensor.acc_bias, &sensor.gyro_bias,
+                                &sensor.mag_bias};
+        float *out[] = {r.accBias, r.gyroBias, r.magBias};
+        for (uint8_t i = 0; i < 3; i++) {
+            out[i][0] = bias[i]->x;
+            out[i][1] = bias[i]->y;
+            out[i][2] = bias[i]->z;
+        }
+    }
+    boot.save();
+#endif
+}
+
+void System::saveFlight()
+{
+#ifdef USE_WARM_BOOT
+    WarmBootRecord &r = boot.record;
+    r.rocketState = rocket.state;
+    r.phase = flightFsm.phase;
+    r.fairingOpened = rocket.fairingOpened;
+    r.tPlus = rocket.state == ROCKET_OFFGROUND
+                  ? flightFsm.since(PHASE_BOOST, micros()) / 1000
+                  : 0;
+    boot.save();
+#endif
+}
+
+void System::resumeFlight()
+{
+    const WarmBootRecord &r = boot.record;
+    const uint32_t now = micros();
+    // What the launch command set up, the launch trigger left alone
+    rocket.state = ROCKET_OFFGROUND;
+    rocket.liftoff = r.phase >= PHASE_BOOST;
+    flightFsm.limits.release = release_t * 1000UL;
+    flightFsm.limits.stop = stop_t * 1000UL;
+    flightFsm.resume((FLIGHT_PHASE) r.phase, now, r.tPlus * 1000UL);
+    // The vote starts over from here, the inertial one from the baro
+    // speed, with the peak from the height now
+    float height = 0;
+#ifdef USE_PERIPHERAL_BMP280
+    height = sensor.getBmpAltitude();
+#endif
+    apogee.reset(now, height);
+#ifdef USE_PERIPHERAL_BMP280
+    apogee.velocity = sensor.velocity_estimate;
+#endif
+    logger.newFile(LEVEL_FLIGHT);
+    char line[48];
+    snprintf(line, sizeof(line), "# resumed,%s,%lu,restarts:%lu",
+             FlightFsm::name(flightFsm.phase), (unsigned long) r.tPlus,
+             (unsigned long) r.restarts);
+    logger.log(line, LEVEL_FLIGHT);
+    log.attach_ms(10, [this]() { post(EVENT_LOG); });
+    post(EVENT_STREAM_ON);
+    // The chute was due, open it again, the servo closed by init()
+    if (r.fairingOpened || r.phase >= PHASE_APOGEE)
+        post(EVENT_OPEN);
+}
+
+void System::finishBoot()
+{
+    if (!bootPending)
+        return;
+#ifdef USE_WIFI_COMMUNICATION
+    comms.init();
+#endif
+    OTA_init();
+    bootPending = false;
+    Serial.printf("Comms up at %lu ms\n", millis());
+}
+
 void System::OTA_init()
 {
     ArduinoOTA.onStart([]() {
+        WarmBoot().clear();  // The new firmware calibrates again
         String type;
         if (ArduinoOTA.getCommand() == U_FLASH) {
             type = "sketch";
@@ -215,96 +717,139 @@ void System::OTA_init()
 
 void System::loop()
 {
-#ifdef USE_WIFI_COMMUNICATION
-
-    comms.loop();  // Loop for the wifi opertation
-
-    static bool keep = false;
-    // Read and react to the command from comms or debugger
-    if (comms.message != "") {
-        // Substring 4 char to cut out the board prefix of message
-        command(comms.message.substring(4), CMD_WIFI);
-    }
-
-    static String serial_cmd = "";
-    if (Serial.available() || serial_cmd != "") {
-        int c = Serial.read();
-        if (c <= 0 || c >= 0xfe) {
-        } else if (c != '\n' && !keep) {
-            Serial.print((char) c);
-            serial_cmd += (char) c;
-        } else {
-#ifdef GROUND_STATION
-            serial_cmd += "\n";
-            comms.wifi_broadcast(String("[") + rocket.btype + "] " +
-                                 serial_cmd);
+#ifdef USE_DUAL_CORE
+    vTaskDelay(portMAX_DELAY);  // The loops of startCores() run the tasks
 #else
-            keep = command(serial_cmd, CMD_SERIAL);
+    loopTimer.pass(ESP.getCycleCount());
+    scheduler.run();
 #endif
-            if (!keep)
-                serial_cmd = "";
-        }
-    }
-    if (core_cmd != "") {
-        auto cmd = core_cmd;
-        command(core_cmd, CMD_BOTH);
-        if (cmd == core_cmd)
-            core_cmd = "";
-    }
-#ifdef USE_ESPNOW_COMMUNICATION
-    char *esp_now_msg = fetchESPNOWMessage();
-    if (esp_now_msg) {
-#ifdef GROUND_STATION
-        Serial.println(">>>");
-        Serial.println(esp_now_msg);
-        Serial.println("<<<");
-#else
-        Serial.printf("Fetch: %s\n", esp_now_msg);
-        esp_now_msg[strlen(esp_now_msg) - 1] = 0;
-        command(esp_now_msg + 4, CMD_BOTH);
-#endif
-        clearESPNOWMessage();
-    }
-#endif
-    // servo.write(180);
-
-    sensor.update();
-
-#ifdef ONBOARD_AVIONICS
-    flight();
-#endif
-
-    loading_test(&comms.message);
+}
 
-    ArduinoOTA.handle();
+void System::startCores()
+{
+#ifdef USE_DUAL_CORE
+    static bool started = false;
+    if (started)
+        return;
+    started = true;
+    ioLock = xSemaphoreCreateMutex();
+    esp_timer_create_args_t wake = {};
+    wake.callback = wake_flight;
+    wake.name = "flight wake";
+    esp_timer_create(&wake, &flight_wake);
+    xTaskCreatePinnedToCore(flight_core, "flight", CORE_TASK_STACK, this,
+                            FLIGHT_TASK_PRIORITY, &flight_handle,
+                            FLIGHT_CORE);
+    xTaskCreatePinnedToCore(comms_core, "comms", CORE_TASK_STACK, this,
+                            COMMS_TASK_PRIORITY, NULL, COMMS_CORE);
 #endif
+}
 
-    // ArduinoOTA.handle();
-
-#ifdef USE_GPS_NEO6M
-    if (imu.gpsSerial.available()) {
-        char m = (char) imu.gpsSerial.read();
-        if (m != '\n')
-            imu.gpsCode += m;
-        else {
-            comms.wifi_broadcast(imu.gpsCode);
-            imu.gpsCode = "";
-        }
+String System::timingStats(const char *prefix)
+{
+    char line[LOOP_STATS_LINE];
+    loopTimer.period.print(line, sizeof(line));
+    String msg = String(prefix) + "loop period: " + line + "\n";
+    for (uint8_t i = 0; i < scheduler.size(); i++) {
+        const SchedulerTask &t = scheduler.task(i);
+        t.time.print(line, sizeof(line));
+        msg += String(prefix) + t.name + ": " + line + "\n";
     }
+    eventLatency.print(line, sizeof(line));
+    msg += String(prefix) + "event latency: " + line +
+           " dropped:" + events.dropped + "\n";
+#ifdef USE_DUAL_CORE
+    msg += String(prefix) + "output queue: posted:" + outputs.posted +
+           " dropped:" + outputs.dropped + "\n";
 #endif
+    return msg;
+}
 
-#ifdef DE_SPIN_CONTROL
-    deSpinControl(PID_ON);
+String System::heapStats(const char *prefix)
+{
+    char line[HEAP_GUARD_LINE];
+    if (HeapGuard::armed())
+        HeapGuard::print(line, sizeof(line));
+    else
+        strcpy(line, "not counted");
+#ifdef ESP8266
+    const uint32_t block = ESP.getMaxFreeBlockSize();
+#else
+    const uint32_t block = ESP.getMaxAllocHeap();
 #endif
+    return String(prefix) + "heap: free:" + ESP.getFreeHeap() +
+           ",block:" + block + ",after ready " + line + "\n";
 }
 
 #ifdef USE_DUAL_SYSTEM_WATCHDOG
 WATCHDOG_STATE System::check_partner_state()
 {
-    if (millis() - command_update_time > WATCH_SPI_TIMEOUT)
+    // As of the last beat(), at most HEARTBEAT_TASK_PERIOD ago
+    if (heartbeat.link == LINK_LOST)
         return WATCHDOG_TIMEOUT;
     return WATCHDOG_OK;
 }
+
+void System::beat()
+{
+    const uint32_t now = micros();
+    HeartbeatState &l = heartbeat.local;
+    l.rocket = rocket.state;
+    l.phase = flightFsm.phase;
+    // From lift off as saveFlight(), 0 until the boost is entered
+    l.tPlus = rocket.state == ROCKET_OFFGROUND
+                  ? flightFsm.since(PHASE_BOOST, now) / 1000
+                  : 0;
+#ifdef USE_PERIPHERAL_BMP280
+    l.height = sensor.getBmpAltitude();
+#endif
+    if (rocket.fairingOpened)
+        l.fired |= PYRO_CHUTE;
+
+#ifdef DUAL_SYSTEM_BACKUP
+    if (partner_poll())
+        heartbeat.receive(partner_rx, now);
+    if (!partner_queued) {
+        heartbeat.encode(partner_tx);
+        partner_queue();
+    }
+    const HEARTBEAT_LINK link = heartbeat.check(now);
+    const HeartbeatState &p = heartbeat.partner;
+
+    // Lift off by the primary's launch, the flight state machine then
+    // runs on the own sensors, in step with the primary's
+    if (link == LINK_OK && !followed && p.rocket == ROCKET_OFFGROUND) {
+        followed = true;
+        rocket.state = ROCKET_PREFLIGHT;
+        submit("launch", CMD_SERIAL);
+    }
+    // A primary lost in flight leaves the pyros to the backup, those due
+    // by the later phase of the two and not fired by the primary yet
+    if (link == LINK_LOST && !takenOver && p.rocket == ROCKET_OFFGROUND) {
+        takenOver = true;
+        emit(OUT_LOG | OUT_SERIAL, "# takeover");
+    }
+    if (takenOver && !(l.fired & PYRO_CHUTE) &&
+        (heartbeat.takeover(flightFsm.phase) & PYRO_CHUTE)) {
+        l.fired |= PYRO_CHUTE;  // Posted once, fairingOpened follows
+        post(EVENT_OPEN);
+    }
+#else
+    heartbeat.encode(partner_tx);
+    partner_transfer();
+    heartbeat.receive(partner_rx, now);
+
+    // A lost backup gets a reset pulse of a beat, once a loss
+    static uint32_t resets = 0;
+    const bool pulse = heartbeat.check(now) == LINK_LOST &&
+                       heartbeat.lost != resets;
+    if (pulse) {
+        resets = heartbeat.lost;
+        emit(OUT_LOG | OUT_SERIAL, "# partner lost");
+    }
+    digitalWrite(PIN_PARTNER_RESET, pulse ? HIGH : LOW);
+#endif
+}
 #endif
 
 BUZZER_LEVEL System::buzz(BUZZER_LEVEL beep, int times /* = 0 */)
@@ -396,6 +941,7 @@ void System::fairing(int angle)
     trig(PIN_TRIGGER_2, on_off);
 #endif
     rocket.fairingOpened = on_off;
+    saveFlight();
 
     rocket.buzzState = buzz(BUZ_LEVEL4);
 }
@@ -425,276 +971,555 @@ void System::setServo(Servo *s, int angle)
 #endif
 }
 
-bool System::command(String cmd, CMD_TYPE type)
-{
-    String msg = "";
-    bool keep = false;
-
+/* Handlers of System::command(), one per command name, see the table *
+ * below. They are friends of System to reach its Tickers and limits.  */
+struct SystemCommands {
     // Fairing command
-    if (cmd == "open") {
-        fairing(openAngle);
+    static bool open(System &s, CmdArgs &, String &msg)
+    {
+        s.fairing(s.openAngle);
         msg = "open fairingOpened done";
-        if (rocket.state == ROCKET_OFFGROUND) {
-            logger.log("open", LEVEL_FLIGHT);
-            logger.f.close();
-            logger.appendFile(logger.file_ext);
+        if (s.rocket.state == ROCKET_OFFGROUND) {
+            s.logger.log("open", LEVEL_FLIGHT);
+            s.logger.f.close();
+            s.logger.appendFile(s.logger.file_ext);
         }
-    } else if (cmd == "close") {
-        fairing(closeAngle);
+        return false;
+    }
+
+    static bool close(System &s, CmdArgs &, String &msg)
+    {
+        s.fairing(s.closeAngle);
         msg = "close fairingOpened done";
-    } else if (cmd.substring(0, 11) == "set fairingOpened") {
-        // cmd:set fairingOpened (open angle) (close angle), ex: set
-        // fairingOpened 10 100
-        String degree = cmd.substring(12);
-        int open = degree.substring(0, degree.indexOf(' ')).toInt();
-        int close = degree.substring(degree.indexOf(' ')).toInt();
-        if (open > 180 || open < 0 || close > 180 || close < 0) {
+        return false;
+    }
+
+    // cmd:set fairingOpened (open angle) (close angle), ex: set
+    // fairingOpened 10 100
+    static bool set(System &s, CmdArgs &a, String &msg)
+    {
+        CmdToken key;
+        long open = 0, close = 0;
+        if (!a.key(key) || !(key == "fairingOpened"))
+            return false;
+        if (!a.integer(open) || !a.integer(close) || open > 180 || open < 0 ||
+            close > 180 || close < 0) {
             msg = "set fairingOpened failed : angle out of limit, must 0~180";
         } else {
-            setFairingLimit(close, open);
+            s.setFairingLimit(close, open);
             msg = "set fairingOpened done";
         }
-    } else if (cmd == "detach") {
-        servoOff();
+        return false;
+    }
+
+    static bool detach(System &s, CmdArgs &, String &msg)
+    {
+        s.servoOff();
         msg = "servo detached";
-    } else if (cmd.substring(0, 5) == "motor") {
+        return false;
+    }
+
 #ifdef PARACHUTE_SERVO
-        setServo(&servo, cmd.substring(6).toInt());
+    static bool motor(System &s, CmdArgs &a, String &msg)
+    {
+        long angle = 0;
+        a.integer(angle);
+        s.setServo(&s.servo, angle);
         msg = "set servo done";
-#endif
+        return false;
     }
+#endif
 
-    else if (cmd.substring(0, 5) == "count") {
-        count_down_time = cmd.substring(5).toInt();
-        msg = "count-down:" + String(count_down_time);
+    static bool count(System &s, CmdArgs &a, String &msg)
+    {
+        long time = 0;
+        a.integer(time);
+        s.count_down_time = time;
+        msg = "count-down:" + String(s.count_down_time);
+        return false;
     }
 
     // Preflight command
-    else if (cmd == "preLaunch" && rocket.state == ROCKET_READY) {
-#ifdef DE_SPIN_CONTROL
-        core_cmd = "bldc" + String(bldc_init);
-#endif
-        rocket.state = ROCKET_PREFLIGHT;
+    static bool preLaunch(System &s, CmdArgs &, String &msg)
+    {
+        if (s.rocket.state != ROCKET_READY)
+            return false;
+        s.rocket.state = ROCKET_PREFLIGHT;
 #ifdef USE_PERIPHERAL_BUZZER
-        buzzer.attach(0.5, [=]() {
+        s.buzzer.attach(0.5, [&s]() {
             static int counter = 0;
             counter++;
             digitalWrite(PIN_BUZZER, !digitalRead(PIN_BUZZER));
 
-            if (count_down_time < 3 || counter == 2 * count_down_time) {
-                buzzer.detach();
+            if (s.count_down_time < 3 || counter == 2 * s.count_down_time) {
+                s.buzzer.detach();
                 digitalWrite(PIN_BUZZER, 1);
-                buzzer.once(3, [=]() { rocket.buzzState = buzz(BUZ_NONE); });
+                s.buzzer.once(
+                    3, [&s]() { s.rocket.buzzState = s.buzz(BUZ_NONE); });
             }
         });
 #endif
         msg = "Start count down sequence.";
+#ifdef DE_SPIN_CONTROL
+        s.post(EVENT_MOTOR, s.bldc_init);
+#endif
+        return false;
     }
 
     // Launch command
-    else if (cmd == "launch" && rocket.state == ROCKET_PREFLIGHT) {
-        rocket.state = ROCKET_OFFGROUND;
-        logger.newFile(LEVEL_FLIGHT);
-        comms.wifi_broadcast(String("[") + rocket.btype + "] launch");
-        msg = logger.file_ext + " launch";
-
-        // fly_plan.once_ms(release_t, [=]() {
-        //     core_cmd = "open";
-        //     fly_plan.detach();
-        //     fly_plan.once_ms(stop_t, [=]() {
-        //         rocket.buzzState = buzz(BUZ_LEVEL3);
-        //         core_cmd = "stop";
-        //     });
-        // });
-        core_cmd = "stream";
-        log.attach_ms(10, [=]() { wait_log = true; });
+    static bool launch(System &s, CmdArgs &, String &msg)
+    {
+        if (s.rocket.state != ROCKET_PREFLIGHT)
+            return false;
+        s.rocket.state = ROCKET_OFFGROUND;
+        s.rocket.liftoff = false;
+        s.flightFsm.limits.release = s.release_t * 1000UL;
+        s.flightFsm.limits.stop = s.stop_t * 1000UL;
+        s.flightFsm.reset(micros());
+        s.logger.newFile(LEVEL_FLIGHT);
+        // Timing on the pad heads the flight log
+        String header = s.timingStats("# ") + s.heapStats("# ");
+        header.trim();
+        s.logger.log(header, LEVEL_FLIGHT);
+        s.comms.wifi_broadcast(String("[") + s.rocket.btype + "] launch");
+        msg = s.logger.file_ext + " launch";
+
+        s.log.attach_ms(10, [&s]() { s.post(EVENT_LOG); });
 
 #ifdef LAUNCH_TRIGGER
-        trig(PIN_TRIGGER_1, true);
+        s.trig(PIN_TRIGGER_1, true);
 #endif
+        s.post(EVENT_STREAM_ON);
+        s.saveFlight();
+        return false;
     }
 
     // Recording command
-    else if (cmd == "stop" && rocket.state == ROCKET_OFFGROUND) {
-        rocket.state = ROCKET_LANDED;
-        logger.f.close();
-        msg = "stop," + logger.file_ext + ": recording stopped";
+    static bool stop(System &s, CmdArgs &, String &msg)
+    {
+        if (s.rocket.state != ROCKET_OFFGROUND)
+            return false;
+        s.rocket.state = ROCKET_LANDED;
+        s.saveFlight();
+        s.logger.f.close();
+        msg = "stop," + s.logger.file_ext + ": recording stopped";
+
+        s.rocket.buzzState = s.buzz(BUZ_LEVEL3);
+        s.log.detach();
+        s.wait_log = false;
+        s.post(EVENT_MOTOR_OFF);
+        return false;
+    }
 
-        rocket.buzzState = buzz(BUZ_LEVEL3);
-        fly_plan.detach();
-        log.detach();
-        wait_log = false;
-        core_cmd = "0";
+    // Rising time
+    static bool rtime(System &s, CmdArgs &a, String &msg)
+    {
+        long time = 0;
+        a.integer(time);
+        s.release_t = time;
+        msg = String("Set release time to ") + s.release_t + "ms";
+        return false;
     }
 
-    // Time command
-    else if (cmd.substring(0, 5) == "rtime") {
-        // Rising time
-        release_t = cmd.substring(6).toInt();
-        msg = String("Set release time to ") + release_t + "ms";
-    } else if (cmd.substring(0, 5) == "stime") {
-        // Stop time
-        stop_t = cmd.substring(6).toInt();
-        msg = String("Set stop time to ") + stop_t + "ms";
+    // Stop time
+    static bool stime(System &s, CmdArgs &a, String &msg)
+    {
+        long time = 0;
+        a.integer(time);
+        s.stop_t = time;
+        msg = String("Set stop time to ") + s.stop_t + "ms";
+        return false;
     }
 
-    // Restart command
-    else if (cmd == "restart") {
+    // A cold boot, the ground is calibrated again
+    static bool restart(System &s, CmdArgs &, String &)
+    {
+        s.boot.clear();
         pinMode(16, OUTPUT);
         digitalWrite(16, 0);
+        return false;
     }
 
     //
     // File manipulation
     //
-    else if (cmd == "list") {  // List all file command
-        msg = "l," + logger.listFile();
+    static bool list(System &s, CmdArgs &, String &msg)
+    {
+        msg = "l," + s.logger.listFile();
+        return false;
     }
 
-    else if (cmd.substring(0, 4) == "read" &&
-             rocket.state != ROCKET_OFFGROUND) {  // Read specific file
+    // Read specific file, in chunks, the caller keeps the command
+    static bool read(System &s, CmdArgs &a, String &msg)
+    {
         static int pos = 0;
         static bool stream_active;
-        if (stream.active()) {
-            stream_active = stream.active();
-            core_cmd = "nostream";
+        bool keep = false;
+        if (s.rocket.state == ROCKET_OFFGROUND)
+            return false;
+        if (s.stream.active()) {
+            stream_active = s.stream.active();
+            s.post(EVENT_STREAM_OFF);
         } else {
-            msg = logger.readFile(cmd.substring(5), &pos);
+            msg = s.logger.readFile(a.rest(), &pos);
             if (pos == -1) {
                 keep = false;
                 pos = 0;
             } else
                 keep = true;
             if (!keep && stream_active)
-                core_cmd = "stream";
+                s.post(EVENT_STREAM_ON);
         }
+        return keep;
     }
 
-    else if (cmd.substring(0, 6) == "delete") {  // Delete specific file
-        msg = cmd.substring(7) + ":" + logger.deleteFile(cmd.substring(7))
-                  ? "File deleted"
-                  : "Delete failed";
-    } else if (cmd == "clear") {  // Delete all the logged data
-        msg = logger.clearDataFile();
-    } else if (cmd == "info") {  // Info check command
-        msg = logger.fsInfo();
-    } else if (cmd == "space") {  // Show the remaining space
-        msg = logger.remainSpace();
-    } else if (cmd == "format") {  // Format the filesystem
-        msg = logger.formatFS() ? "Formatted" : "Format failed";
+    static bool remove(System &s, CmdArgs &a, String &msg)
+    {
+        const char *name = a.rest();
+        msg = String(name) + ":" +
+              (s.logger.deleteFile(name) ? "File deleted" : "Delete failed");
+        return false;
     }
 
-    else if (cmd.substring(0, 4) == "buzz") {
-        rocket.buzzState = buzz((BUZZER_LEVEL) cmd.substring(4).toInt());
-        msg = cmd;
+    // Delete all the logged data
+    static bool clear(System &s, CmdArgs &, String &msg)
+    {
+        msg = s.logger.clearDataFile();
+        return false;
     }
 
-    else if (cmd == "rocket") {
-        msg += "state: " + String(rocket.state) + '\n';
+    static bool info(System &s, CmdArgs &, String &msg)
+    {
+        msg = s.logger.fsInfo();
+        return false;
+    }
+
+    static bool space(System &s, CmdArgs &, String &msg)
+    {
+        msg = s.logger.remainSpace();
+        return false;
+    }
+
+    static bool format(System &s, CmdArgs &, String &msg)
+    {
+        msg = s.logger.formatFS() ? "Formatted" : "Format failed";
+        return false;
+    }
+
+    static bool buzz(System &s, CmdArgs &a, String &msg)
+    {
+        long level = 0;
+        msg = String("buzz") + a.raw();
+        a.integer(level);
+        s.rocket.buzzState = s.buzz((BUZZER_LEVEL) level);
+        return false;
+    }
+
+    static bool rocket(System &s, CmdArgs &, String &msg)
+    {
+        msg += "state: " + String(s.rocket.state) + '\n';
         msg += "fairingOpened: " +
-               String(rocket.fairingOpened ? "open" : "closed") + "\n";
+               String(s.rocket.fairingOpened ? "open" : "closed") + "\n";
         msg += "fairingOpened type: " +
-               String((rocket.ftype == F_TRIGGER) ? "trigger" : "servo") + "\n";
-        msg += "comms state: " + String(rocket.cState) + "\n";
-        msg += "release at " + String(release_t) + "ms\n";
-        msg += "stop at " + String(stop_t) + "ms\n";
+               String((s.rocket.ftype == F_TRIGGER) ? "trigger" : "servo") +
+               "\n";
+        msg += "comms state: " + String(s.rocket.cState) + "\n";
+        msg += "phase: " + String(FlightFsm::name(s.flightFsm.phase)) + "\n";
+        msg += "apogee votes: baro " + String(s.apogee.baro.on) +
+               ",inertial " + s.apogee.inertial.on + ",peak " +
+               s.apogee.peak.on + "\n";
+        msg += "release at " + String(s.release_t) + "ms\n";
+        msg += "stop at " + String(s.stop_t) + "ms\n";
+        return false;
     }
 
-    else if (cmd == "connected") {
-        buzz(BUZ_LEVEL4, 2);
-        comms.message = "";
-    } else if (cmd == "disconnected") {
-        buzz(BUZ_LEVEL4, 4);
-        comms.message = "";
+    // Websocket queue statistics
+    static bool wsstats(System &s, CmdArgs &, String &msg)
+    {
+        msg = s.comms.wsStats();
+        return false;
     }
 
-    else if (cmd.substring(0, 5) == "print") {
-        msg = cmd.substring(5);
-    } else if (cmd == "nostream") {
-        stream.detach();
-        wait_stream = false;
+    // Scheduler run time of each task, "tasks reset" to clear
+    static bool tasks(System &s, CmdArgs &a, String &msg)
+    {
+        CmdToken key;
+        if (a.key(key)) {
+            if (key == "reset" && a.empty()) {
+                s.scheduler.resetStats();
+                msg = "Task statistics reset";
+            }
+            return false;
+        }
+        if (!a.empty())
+            return false;
+        msg = String("passes:") + s.scheduler.passes[0];
+#ifdef USE_DUAL_CORE
+        msg += String(",") + s.scheduler.passes[1];  // Core 0, core 1
+#endif
+        msg += "\n";
+        for (uint8_t i = 0; i < s.scheduler.size(); i++) {
+            const SchedulerTask &t = s.scheduler.task(i);
+            msg += String(t.name) + ": runs:" + t.runs + ",avg:" +
+                   (t.runs ? (uint32_t) (t.timeTotal / t.runs) : 0) +
+                   "us,max:" + t.timeMax + "us,late max:" + t.lateMax +
+                   "us,overrun:" + t.overruns + ",skipped:" + t.skipped + "\n";
+        }
+        return false;
+    }
+
+    // Loop period and run time histograms in us, "stats reset" to clear
+    static bool stats(System &s, CmdArgs &a, String &msg)
+    {
+        CmdToken key;
+        if (a.key(key)) {
+            if (key == "reset" && a.empty()) {
+                s.loopTimer.reset();
+                s.eventLatency.reset();
+                s.scheduler.resetStats();
+                msg = "Timing statistics reset";
+            }
+            return false;
+        }
+        if (a.empty())
+            msg = s.timingStats("") + s.heapStats("");
+        return false;
+    }
+
+#ifdef USE_LORA_COMMUNICATION
+    // LoRa airtime and packet rates, "lorastats reset" to clear
+    static bool lorastats(System &, CmdArgs &a, String &msg)
+    {
+        CmdToken key;
+        if (a.key(key)) {
+            if (key == "reset" && a.empty()) {
+                lora.resetStats();
+                msg = "LoRa statistics reset";
+            }
+            return false;
+        }
+        if (a.empty())
+            msg = lora.stats();
+        return false;
+    }
+#endif
+
+    static bool connected(System &s, CmdArgs &, String &)
+    {
+        s.buzz(BUZ_LEVEL4, 2);
+        s.comms.message = "";
+        return false;
+    }
+
+    static bool disconnected(System &s, CmdArgs &, String &)
+    {
+        s.buzz(BUZ_LEVEL4, 4);
+        s.comms.message = "";
+        return false;
+    }
+
+    static bool print(System &, CmdArgs &a, String &msg)
+    {
+        msg = a.raw();
+        return false;
+    }
+
+    static bool nostream(System &s, CmdArgs &, String &msg)
+    {
+        s.stream.detach();
+        s.wait_stream = false;
         msg = "nostream";
-    } else if (cmd == "stream") {
-        if (!stream.active())
-            stream.attach_ms(100, [=]() { wait_stream = true; });
+        return false;
+    }
+
+    static bool stream(System &s, CmdArgs &, String &msg)
+    {
+        if (!s.stream.active())
+            s.stream.attach_ms(100, [&s]() { s.post(EVENT_STREAM); });
         msg = "stream";
+        return false;
     }
 
     // soft initialization (initialize without disconnect wifi)
-    else if (cmd == "init") {
-        init(false);
+    static bool init(System &s, CmdArgs &, String &msg)
+    {
+        s.init(false);
         msg = "soft init";
-    } else if (cmd.substring(0, 6) == "config") {
+        return false;
+    }
+
+    // cmd:config set (key)(value), ex: config set kp0.5
+    static bool config(System &s, CmdArgs &a, String &msg)
+    {
+        CmdToken key;
         msg = "";
-        if (cmd.substring(7, 10) == "set") {
-            if (cmd.substring(11, 16) == "rtime")
-                config.config.rtime = cmd.substring(16).toInt();
-            else if (cmd.substring(11, 16) == "stime")
-                config.config.stime = cmd.substring(16).toInt();
-            else if (cmd.substring(11, 13) == "kp")
-                config.config.kp = cmd.substring(13).toDouble();
-            else if (cmd.substring(11, 13) == "ki")
-                config.config.ki = cmd.substring(13).toDouble();
-            else if (cmd.substring(11, 13) == "kd")
-                config.config.kd = cmd.substring(13).toDouble();
-            else if (cmd.substring(11, 20) == "bldc_init")
-                config.config.bldc_init = cmd.substring(20).toDouble();
-            else if (cmd.substring(11, 20) == "gy_target")
-                config.config.gy_target = cmd.substring(20).toDouble();
-            else if (cmd.substring(11, 22) == "speed_limit")
-                config.config.speed_limit = cmd.substring(22).toInt();
-            config.write();
+        if (a.key(key) && key == "set") {
+            Config &c = s.config;
+            long i = 0;
+            double d = 0;
+            a.key(key);
+            if (key == "rtime" && a.integer(i))
+                c.config.rtime = i;
+            else if (key == "stime" && a.integer(i))
+                c.config.stime = i;
+            else if (key == "kp" && a.number(d))
+                c.config.kp = d;
+            else if (key == "ki" && a.number(d))
+                c.config.ki = d;
+            else if (key == "kd" && a.number(d))
+                c.config.kd = d;
+            else if (key == "bldc_init" && a.number(d))
+                c.config.bldc_init = d;
+            else if (key == "gy_target" && a.number(d))
+                c.config.gy_target = d;
+            else if (key == "speed_limit" && a.integer(i))
+                c.config.speed_limit = i;
+            c.write();
             msg += "Writing...\n";
         }
-        load_config();
+        s.load_config();
 #ifdef DE_SPIN_CONTROL
-        msg += String("Config:\n") + "rtime:" + (int) release_t + "\n" +
-               "stime:" + (int) stop_t + "\n" +
-               "PID:" + String(PID_ON ? "ON" : "OFF") + ",kp:" + kp +
-               ",ki:" + ki + ",kd:" + kd + "\ninput:" + gy_input +
-               ",output:" + bldc_output + ",target:" + gy_target +
-               "\nbldc_init:" + bldc_init +
-               "\nspeed_limit:" + config.config.speed_limit;
+        msg += String("Config:\n") + "rtime:" + (int) s.release_t + "\n" +
+               "stime:" + (int) s.stop_t + "\n" +
+               "PID:" + String(s.PID_ON ? "ON" : "OFF") + ",kp:" + s.kp +
+               ",ki:" + s.ki + ",kd:" + s.kd + "\ninput:" + s.gy_input +
+               ",output:" + s.bldc_output + ",target:" + s.gy_target +
+               "\nbldc_init:" + s.bldc_init +
+               "\nspeed_limit:" + s.config.config.speed_limit;
 #endif
+        return false;
     }
+
 #ifdef DE_SPIN_CONTROL
-    // Set kp gain
-    else if (cmd.substring(0, 2) == "kp") {
-        kp = cmd.substring(2).toDouble();
-        reactionWheel->SetTunings(kp, ki, kd);
-    }
-    // Set ki gain
-    else if (cmd.substring(0, 2) == "ki") {
-        ki = cmd.substring(2).toDouble();
-        reactionWheel->SetTunings(kp, ki, kd);
-    }
-    // Set kd gain
-    else if (cmd.substring(0, 2) == "kd") {
-        kd = cmd.substring(2).toDouble();
-        reactionWheel->SetTunings(kp, ki, kd);
-    } else if (cmd.substring(0, 9) == "bldc_init") {
-        bldc_init = cmd.substring(9).toDouble();
+    // Set kp, ki or kd gain
+    static bool gain(System &s, CmdArgs &a, double &k)
+    {
+        double v = 0;
+        a.number(v);
+        k = v;
+        s.reactionWheel.SetTunings(s.kp, s.ki, s.kd);
+        return false;
+    }
+
+    static bool kp(System &s, CmdArgs &a, String &)
+    {
+        return gain(s, a, s.kp);
+    }
+
+    static bool ki(System &s, CmdArgs &a, String &)
+    {
+        return gain(s, a, s.ki);
+    }
+
+    static bool kd(System &s, CmdArgs &a, String &)
+    {
+        return gain(s, a, s.kd);
     }
+
+    static bool bldc_init(System &s, CmdArgs &a, String &)
+    {
+        double v = 0;
+        a.number(v);
+        s.bldc_init = v;
+        return false;
+    }
+
     // Turn on/off pid control
-    else if (cmd == "pid off") {
-        PID_ON = false;
-    } else if (cmd == "pid on") {
-        PID_ON = true;
+    static bool pid(System &s, CmdArgs &a, String &)
+    {
+        CmdToken key;
+        if (a.key(key) && a.empty()) {
+            if (key == "on")
+                s.PID_ON = true;
+            else if (key == "off")
+                s.PID_ON = false;
+        }
+        return false;
     }
 
-    else if (cmd.substring(0, 4) == "bldc") {
-        if (PID_ON) {
+    static bool bldc(System &s, CmdArgs &a, String &msg)
+    {
+        long speed = 0;
+        if (s.PID_ON) {
             msg = "Unable to change motor speed while pid is on.";
         } else {
-            bldc.write(cmd.substring(4).toInt());
+            a.integer(speed);
+            s.bldc.write(speed);
         }
+        return false;
     }
 
-    else if (cmd == "0") {
-        PID_ON = false;
-        bldc.write(0);
+    static bool zero(System &s, CmdArgs &, String &)
+    {
+        s.PID_ON = false;
+        s.bldc.write(0);
+        return false;
     }
+#endif
+};
+
+/* Every command, sorted by name when the table is built. CMD_EXACT ones *
+ * ignore a line with anything after the name.                            */
+static CommandEntry<System, String> command_entries[] = {
+    {"open", CMD_EXACT, SystemCommands::open},
+    {"close", CMD_EXACT, SystemCommands::close},
+    {"set", CMD_ARGS, SystemCommands::set},
+    {"detach", CMD_EXACT, SystemCommands::detach},
+#ifdef PARACHUTE_SERVO
+    {"motor", CMD_ARGS, SystemCommands::motor},
+#endif
+    {"count", CMD_ARGS, SystemCommands::count},
+    {"preLaunch", CMD_EXACT, SystemCommands::preLaunch},
+    {"launch", CMD_EXACT, SystemCommands::launch},
+    {"stop", CMD_EXACT, SystemCommands::stop},
+    {"rtime", CMD_ARGS, SystemCommands::rtime},
+    {"stime", CMD_ARGS, SystemCommands::stime},
+    {"restart", CMD_EXACT, SystemCommands::restart},
+    {"list", CMD_EXACT, SystemCommands::list},
+    {"read", CMD_ARGS, SystemCommands::read},
+    {"delete", CMD_ARGS, SystemCommands::remove},
+    {"clear", CMD_EXACT, SystemCommands::clear},
+    {"info", CMD_EXACT, SystemCommands::info},
+    {"space", CMD_EXACT, SystemCommands::space},
+    {"format", CMD_EXACT, SystemCommands::format},
+    {"buzz", CMD_ARGS, SystemCommands::buzz},
+    {"rocket", CMD_EXACT, SystemCommands::rocket},
+    {"wsstats", CMD_EXACT, SystemCommands::wsstats},
+    {"tasks", CMD_ARGS, SystemCommands::tasks},
+    {"stats", CMD_ARGS, SystemCommands::stats},
+#ifdef USE_LORA_COMMUNICATION
+    {"lorastats", CMD_ARGS, SystemCommands::lorastats},
+#endif
+    {"connected", CMD_EXACT, SystemCommands::connected},
+    {"disconnected", CMD_EXACT, SystemCommands::disconnected},
+    {"print", CMD_ARGS, SystemCommands::print},
+    {"nostream", CMD_EXACT, SystemCommands::nostream},
+    {"stream", CMD_EXACT, SystemCommands::stream},
+    {"init", CMD_EXACT, SystemCommands::init},
+    {"config", CMD_ARGS, SystemCommands::config},
+#ifdef DE_SPIN_CONTROL
+    {"kp", CMD_ARGS, SystemCommands::kp},
+    {"ki", CMD_ARGS, SystemCommands::ki},
+    {"kd", CMD_ARGS, SystemCommands::kd},
+    {"bldc_init", CMD_ARGS, SystemCommands::bldc_init},
+    {"pid", CMD_ARGS, SystemCommands::pid},
+    {"bldc", CMD_ARGS, SystemCommands::bldc},
+    {"0", CMD_EXACT, SystemCommands::zero},
+#endif
+};
 
+static CommandTable<System, String> commands(
+    command_entries, sizeof(command_entries) / sizeof(command_entries[0]));
+
+CMD_RESULT System::command(const char *cmd, CMD_TYPE type)
+{
+    String msg = "";
+    const CMD_RESULT result = commands.dispatch(*this, cmd, msg);
+    const bool keep = result == CMD_KEEP;
+#ifdef USE_DUAL_CORE
+    const bool clean = false;  // comms_task cleared the line it queued
+#else
+    const bool clean = !keep;
 #endif
 
     // Print out msg through serial or wifi
@@ -704,64 +1529,142 @@ bool System::command(String cmd, CMD_TYPE type)
             Serial.print(msg);
         if (type == CMD_WIFI)
             comms.wifi_broadcast(String("[") + rocket.btype + "] " + msg,
-                                 !keep);
+                                 clean);
         if (type == CMD_BOTH)
             comms.wifi_broadcast(String("[") + rocket.btype + "] " + msg,
                                  false);
     }
 
-    return keep;
+    return result;
+}
+
+bool System::submit(const char *cmd, CMD_TYPE type)
+{
+#ifdef USE_DUAL_CORE
+    CommandLine line;
+    line.type = type;
+    strncpy(line.text, cmd, sizeof(line.text) - 1);
+    line.text[sizeof(line.text) - 1] = 0;
+    if (!commandLines.post(line))
+        Serial.println("command dropped, queue full");
+    return false;  // runCommands() repeats a kept line itself
+#else
+    return command(cmd, type) == CMD_KEEP;
+#endif
+}
+
+void System::runCommands()
+{
+#ifdef USE_DUAL_CORE
+    static CommandLine line;
+    static bool keep = false;
+    if (keep || commandLines.poll(line))
+        keep = command(line.text, (CMD_TYPE) line.type) == CMD_KEEP;
+#endif
+}
+
+void System::output(uint8_t sinks, const char *text)
+{
+    uint8_t data[53] = {0};  // The binary record, not filled yet
+    if (sinks & OUT_LOG)
+        logger.log(text, LEVEL_FLIGHT);
+    if (sinks & OUT_DATA)
+        logger.log_data(data, sizeof(data), LEVEL_FLIGHT);
+    if (sinks & OUT_STREAM)
+        comms.wifi_broadcast(text, false, WS_TELEMETRY);
+    if (sinks & OUT_SERIAL)
+        Serial.println(text);
+    if (sinks & OUT_BROADCAST)
+        comms.wifi_broadcast(text);
+}
+
+void System::emit(uint8_t sinks, const char *text)
+{
+#ifdef USE_DUAL_CORE
+    OutputLine line;
+    line.sinks = sinks;
+    strncpy(line.text, text, sizeof(line.text) - 1);
+    line.text[sizeof(line.text) - 1] = 0;
+    outputs.post(line);  // Counted as dropped when full
+#else
+    output(sinks, text);
+#endif
+}
+
+bool System::post(SYSTEM_EVENT type, int32_t arg)
+{
+    const SystemEvent e = {(uint8_t) type, arg, micros()};
+    return events.post(e);
 }
 
+void System::handleEvents()
+{
+    SystemEvent e;
+    while (events.poll(e)) {
+        eventLatency.add(micros() - e.posted);
+#ifdef USE_DUAL_SYSTEM_WATCHDOG
+        heartbeat.local.lastEvent = e.type;
+#endif
+        switch (e.type) {
+        case EVENT_OPEN:
+            command("open", CMD_BOTH);
+            break;
+        case EVENT_STOP:
+            command("stop", CMD_BOTH);
+            break;
+        case EVENT_LOG:
+            wait_log = true;
+            break;
+        case EVENT_STREAM:
+            wait_stream = true;
+            break;
+        case EVENT_STREAM_ON:
+            command("stream", CMD_BOTH);
+            break;
+        case EVENT_STREAM_OFF:
+            command("nostream", CMD_BOTH);
+            break;
+#ifdef DE_SPIN_CONTROL
+        case EVENT_PID_ON:
+            PID_ON = true;
+            break;
+        case EVENT_MOTOR:
+            if (!PID_ON)
+                bldc.write(e.arg);
+            break;
+        case EVENT_MOTOR_OFF:
+            command("0", CMD_BOTH);
+            break;
+#endif
+        default:
+            break;
+        }
+    }
+}
 
 void System::flight()
 {
     float height = 0, speed = 0, height_est = 0;
-    uint8_t data[53];
-    String data_str;
+    char data_str[FLIGHT_LINE_LEN];  // On the stack, not a String per pass
     char data_head;
 #ifdef USE_PERIPHERAL_BMP280
     height = sensor.getBmpAltitude();
     height_est = sensor.getPressure(0);
     speed = sensor.velocity_estimate;
 #endif
-    static unsigned long T_start = -1;
     unsigned long T_plus;
     if (rocket.state == ROCKET_OFFGROUND) {
-        if (!rocket.liftoff) {
-            float ACC = sqrt(pow(sensor.acc.x, 2) + pow(sensor.acc.y, 2) +
-                             pow(sensor.acc.z, 2));
-            Serial.println(ACC);
-            if (ACC > IMU_LIFT_OFF_DETECTION_G) {
-                Serial.println("Lift off");
-                comms.wifi_broadcast("Lift off");
-                rocket.liftoff = true;
-                fly_plan.once_ms(release_t, [=]() {
-                    core_cmd = "open";
-                    fly_plan.detach();
-                    fly_plan.once_ms(stop_t, [=]() {
-                        rocket.buzzState = buzz(BUZ_LEVEL3);
-                        core_cmd = "stop";
-                    });
-                });
-
-                react_wheel.once_ms(PID_ON_TIME, [=]() {
-                    PID_ON = true;
-                });
-            }
-        }
-
-        if (T_start == -1)
-            T_start = millis();
-        unsigned long T_now = millis();
-        T_plus = T_now - T_start;
+        // Lift off, apogee and landing are found by track() on each sample
+        T_plus = flightFsm.since(PHASE_PAD, micros()) / 1000;
         data_head = 'f';
-
-        if (sensor.pose == ROCKET_FALLING && !rocket.fairingOpened &&
-            T_plus > LIFT_OFF_PROTECT_TIME && rocket.liftoff) {
-            // fairingOpened(openAngle);
-            core_cmd = "open";
+#ifdef USE_WARM_BOOT
+        // Where a restart in flight goes on from
+        static uint32_t saved = 0;
+        if (millis() - saved >= WARM_BOOT_SAVE_PERIOD) {
+            saved = millis();
+            saveFlight();
         }
+#endif
 
 #ifdef PARACHUTE_TRIGGER_2
         if (rocket.fairingOpened) {
@@ -776,35 +1679,75 @@ void System::flight()
         T_plus = 0;
     }
 
-    if (rocket.state == ROCKET_LANDED) {
-        T_start = -1;
-    }
-
     if (wait_log || wait_stream) {
         comms.dB = 0;
-        data_str = String(data_head) + ',' + T_plus + ',' + height + ',' +
-                   height_est + ',' + speed + ',' + sensor.acc.x + ',' +
-                   sensor.acc.y + ',' + sensor.acc.z + ',' + sensor.gyro.x +
-                   ',' + sensor.gyro.y + ',' + sensor.gyro.z + ',' +
-                   sensor.mag.x + ',' + sensor.mag.y + ',' +
-                   sensor.mag.z + /*','
-+ sensor.gps.x + sensor.gps.y + ',' + sensor.gps.z + ',' +
-comms.dB +*/
-                   '\n';
-    }
-    if (wait_log) {
-        logger.log(data_str, LEVEL_FLIGHT);
-        logger.log_data(data, sizeof(data), LEVEL_FLIGHT);
-        wait_log = false;
-    }
-    if (wait_stream) {
-        comms.wifi_broadcast(data_str, false);
+        // The fields and 2 decimals of the String sum it replaces
+        snprintf(data_str, sizeof(data_str),
+                 "%c,%lu,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f,"
+                 "%.2f,%.2f\n",
+                 data_head, T_plus, height, height_est, speed, sensor.acc.x,
+                 sensor.acc.y, sensor.acc.z, sensor.gyro.x, sensor.gyro.y,
+                 sensor.gyro.z, sensor.mag.x, sensor.mag.y, sensor.mag.z);
+        /* sensor.gps.x, sensor.gps.y, sensor.gps.z, comms.dB */
         // comms.webSocket.broadcastBIN(data, sizeof(data));
+        emit((wait_log ? OUT_LOG | OUT_DATA : 0) |
+                 (wait_stream ? OUT_STREAM : 0),
+             data_str);
+        wait_log = false;
         wait_stream = false;
     }
+}
+
+void System::track()
+{
+    if (rocket.state != ROCKET_OFFGROUND)
+        return;
+    static float baro_last = 0;
+    FlightSample s = {micros(), 0, 0, 0, false};
+    s.acc = sqrt(sensor.acc.x * sensor.acc.x + sensor.acc.y * sensor.acc.y +
+                 sensor.acc.z * sensor.acc.z);
+#ifdef USE_PERIPHERAL_BMP280
+    s.height = sensor.getBmpAltitude();
+    s.speed = sensor.velocity_estimate;
+#endif
+
+    // The vote runs from lift off on every IMU sample
+    if (flightFsm.visitedPhase(PHASE_BOOST)) {
+        const ApogeeInput in = {s.t, APOGEE_ACC_UP(sensor.acc), s.height,
+                                s.speed, s.height != baro_last};
+        apogee.update(in);
+    }
+    baro_last = s.height;
+    s.apogee = apogee.detected;
 
-    if (speed < -12 && height < 10) {
-        core_cmd = "stop";
+    if (flightFsm.update(s) && flightFsm.phase == PHASE_BOOST)
+        apogee.reset(s.t, s.height);
+}
+
+void System::phaseChanged(FLIGHT_PHASE phase, uint32_t t)
+{
+    char line[48];
+    snprintf(line, sizeof(line), "# %s,%lu,votes:%u", FlightFsm::name(phase),
+             (unsigned long) t, (unsigned) apogee.votes());
+    emit(OUT_LOG, line);
+    saveFlight();
+    switch (phase) {
+    case PHASE_BOOST:
+        emit(OUT_SERIAL | OUT_BROADCAST, "Lift off");
+        rocket.liftoff = true;
+        react_wheel.once_ms(PID_ON_TIME, [=]() { post(EVENT_PID_ON); });
+        break;
+    case PHASE_APOGEE:
+        // A backup opens after a takeover only, from beat()
+#ifndef DUAL_SYSTEM_BACKUP
+        post(EVENT_OPEN);
+#endif
+        break;
+    case PHASE_LANDED:
+        post(EVENT_STOP);
+        break;
+    default:
+        break;
     }
 }
 
@@ -825,7 +1768,7 @@ void System::loading_test(String *command)
         if (loadcell.is_ready()) {
             String reading = String(loadcell.get_units(1));
             String time = String(millis() - start_t);
-            comms.wifi_broadcast(time + "," + reading);
+            comms.wifi_broadcast(time + "," + reading, true, WS_TELEMETRY);
             logger.log(time + "," + reading, LEVEL_FLIGHT);
             Serial.println(reading);
         }
@@ -844,15 +1787,15 @@ void System::loading_test(String *command)
 void System::deSpinControl(bool ON)
 {
     if (ON) {
-        reactionWheel->SetMode(ON);
+        reactionWheel.SetMode(ON);
         gy_input = (double) sensor.getGyro().y;
-        reactionWheel->Compute();
+        reactionWheel.Compute();
         float output = bldc_init + bldc_output;
         output = output > 180 ? 180 : output;
         output = output < 0 ? 0 : output;
         bldc.write((int) round(output));
     } else {
-        reactionWheel->SetMode(0);
+        reactionWheel.SetMode(0);
     }
 }
 #endif
\ No newline at end of file
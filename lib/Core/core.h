@@ -17,6 +17,15 @@
 #include <logger.h>
 #include <sensors.h>
 #include "../../include/configs.h"
+#include "command_table.h"
+#include "event_queue.h"
+#include "apogee.h"
+#include "flight_fsm.h"
+#include "heap_guard.h"
+#include "heartbeat.h"
+#include "loop_stats.h"
+#include "scheduler.h"
+#include "warm_boot.h"
 
 
 #include <ArduinoOTA.h>
@@ -26,6 +35,10 @@
 #include <HX711.h>
 #endif
 
+#ifdef USE_LORA_COMMUNICATION
+#include <Lora.h>
+#endif
+
 #ifdef DE_SPIN_CONTROL
 #include <PID_v1.h>
 #endif
@@ -41,8 +54,41 @@ enum ROCKET_STATE {
     ROCKET_LANDED
 };
 enum FAIRING_TYPE { F_SERVO, F_TRIGGER };
+enum SYSTEM_EVENT {
+    EVENT_OPEN,        // Deploy the parachute
+    EVENT_STOP,        // Stop recording
+    EVENT_LOG,         // Log tick
+    EVENT_STREAM,      // Stream tick
+    EVENT_STREAM_ON,
+    EVENT_STREAM_OFF,
+    EVENT_PID_ON,      // Start the de-spin control
+    EVENT_MOTOR,       // arg: bldc speed, ignored while pid is on
+    EVENT_MOTOR_OFF    // Pid off and bldc stopped
+};
+enum OUTPUT_SINK {
+    OUT_LOG = 1,        // Flight log file
+    OUT_DATA = 2,       // Binary log record
+    OUT_STREAM = 4,     // Websocket telemetry
+    OUT_SERIAL = 8,
+    OUT_BROADCAST = 16  // Websocket and ESP-NOW text
+};
 enum COMMS_STATE { WIFI_DISCONNECTED, WIFI_CONNECTED };
 enum BOARD_TYPE { G_STATION, G_IGNITOR, O_AVIONICS };
+typedef struct {
+    uint8_t type;  // SYSTEM_EVENT
+    int32_t arg;
+    uint32_t posted;  // us
+} SystemEvent;
+#ifdef USE_DUAL_CORE
+typedef struct {
+    uint8_t sinks;  // OUTPUT_SINK bits
+    char text[FLIGHT_LINE_LEN];
+} OutputLine;
+typedef struct {
+    uint8_t type;  // CMD_TYPE
+    char text[COMMAND_LINE_LEN];
+} CommandLine;
+#endif
 typedef struct rocket_status {
     ROCKET_STATE state;
     bool fairingOpened;
@@ -67,12 +113,13 @@ enum WATCHDOG_STATE { WATCHDOG_OK = 0, WATCHDOG_TIMEOUT };
 
 class System
 {
+    friend struct SystemCommands;
+
 private:
     unsigned long last_update_time;
     volatile SPI_MASTER sd_master;
 
     Ticker buzzer;
-    Ticker fly_plan;
     Ticker log;
     Ticker stream;
     Ticker count_down;
@@ -95,6 +142,14 @@ private:
 
     void OTA_init();
     void load_config();
+    /* Calibration of the last boot from RTC memory, into the sensors */
+    void restoreCalibration();
+    /* Store the calibration for the next warm boot */
+    void saveCalibration(bool warm);
+    /* Store the rocket state and flight phase for the next warm boot */
+    void saveFlight();
+    /* Go on with the flight of the record after a warm boot in flight */
+    void resumeFlight();
 
 #ifdef ENGINE_LOADING_TEST
     HX711 loadcell;
@@ -112,7 +167,24 @@ public:
 #ifdef USE_WIFI_COMMUNICATION
     wifiServer comms;
 #endif
-    String core_cmd;
+    Scheduler scheduler;
+    LoopTimer loopTimer;
+    EventQueue<SystemEvent, SYSTEM_EVENT_QUEUE_LEN> events;
+    LoopHistogram eventLatency;  // us, post to handle
+    FlightFsm flightFsm;
+    ApogeeDetector apogee;
+    WarmBoot boot;
+    bool bootPending = false;  // WiFi and OTA left for finishBoot()
+#ifdef USE_DUAL_CORE
+    EventQueue<OutputLine, OUTPUT_QUEUE_LEN> outputs;  // To the comms core
+    EventQueue<CommandLine, COMMAND_QUEUE_LEN> commandLines;  // To flight
+    SemaphoreHandle_t ioLock;  // Held by a comms pass and command_task
+#endif
+#ifdef USE_DUAL_SYSTEM_WATCHDOG
+    Heartbeat heartbeat;
+    bool followed = false;   // Launched by the partner's heartbeat
+    bool takenOver = false;  // Flying on after the partner was lost
+#endif
 
     System();
 
@@ -121,22 +193,35 @@ public:
      * 2. logger
      */
     SYSTEM_STATE init(bool soft_init = true);
+    /* Start WiFi and OTA left by a warm boot, from the loop */
+    void finishBoot();
 
     /* For WiFi communication */
 #ifdef DE_SPIN_CONTROL
-    PID *reactionWheel;
     double gy_input, bldc_output, gy_target, bldc_init = 50;
     double kp = 0.4, ki = 0.8, kd = 0;
+    PID reactionWheel;  // After its inputs and gains, built from them
     Servo bldc;
     bool PID_ON;
 #endif
 
     void loop();
+    /* Pin the flight and comms loops to their cores, once, from init() */
+    void startCores();
+
+    /* Loop period, task run time and event latency histograms, a line *
+     * each                                                             */
+    String timingStats(const char *prefix);
+    /* Free heap, largest block and the allocations since SYSTEM_READY */
+    String heapStats(const char *prefix);
 
 
 /* Check if the partner mcu report normal */
 #ifdef USE_DUAL_SYSTEM_WATCHDOG
     WATCHDOG_STATE check_partner_state();
+    /* Exchange a heartbeat frame with the partner, a backup follows the *
+     * launch and takes over the pyros of a lost primary                 */
+    void beat();
 #endif
 
     BUZZER_LEVEL buzz(BUZZER_LEVEL beep, int times = 0);
@@ -146,8 +231,35 @@ public:
     void setFairingLimit(int close, int open);
     void setServo(Servo *s, int angle);
 
-    bool command(String cmd, CMD_TYPE type = CMD_SERIAL);
+    /* Run a command line. CMD_KEEP to be called again with the same  *
+     * line (a file read in chunks), CMD_UNKNOWN if no command took it. */
+    CMD_RESULT command(const char *cmd, CMD_TYPE type = CMD_SERIAL);
+
+    /* Queue an event for the loop, safe from Tickers and interrupts. *
+     * Return false if the queue is full.                             */
+    bool post(SYSTEM_EVENT type, int32_t arg = 0);
+    /* Handle the queued events, from the loop only */
+    void handleEvents();
+
+    CMD_RESULT command(const String &cmd, CMD_TYPE type = CMD_SERIAL)
+    {
+        return command(cmd.c_str(), type);
+    }
+    /* A command line from serial or comms, queued for the flight core or *
+     * run now on a single core. Return true on a CMD_KEEP of command().  */
+    bool submit(const char *cmd, CMD_TYPE type);
+    /* Run the command lines queued by submit(), from the flight core */
+    void runCommands();
+
+    /* Write a line to the sinks, from the comms core with two cores */
+    void output(uint8_t sinks, const char *text);
+    /* A line of the flight core, queued for output() on the comms core *
+     * or written now on a single core                                  */
+    void emit(uint8_t sinks, const char *text);
     void flight();
+    /* Run the flight state machine on the sample just read */
+    void track();
+    void phaseChanged(FLIGHT_PHASE phase, uint32_t t);
     void loading_test(String *command);
 
     void deSpinControl(bool ON);
@@ -0,0 +1,96 @@
+/*
+ * This library hands typed events from timers and interrupts to the loop.
+ * Including
+ * 1. A fixed ring of N events, N a power of two, nothing allocated
+ * 2. Lock-free post from any number of contexts, a slot is claimed by a
+ *    compare and swap and published by its sequence number (the bounded
+ *    queue of D. Vyukov)
+ * 3. Poll from the loop only, one consumer
+ * 4. Post, drop (queue full) and handle counts
+ * Every event posted is handled once, in order of posting, or counted as
+ * dropped. Nothing overwrites a pending event.
+ *
+ * Example:
+ *     EventQueue<SystemEvent, 16> events;
+ *     ticker.once_ms(100, []() { events.post(open_event); });  // Timer
+ *     SystemEvent e;
+ *     while (events.poll(e))  // Loop
+ *         handle(e);
+ */
+
+#ifndef _EVENT_QUEUE_H
+#define _EVENT_QUEUE_H
+
+#include <stdint.h>
+
+template <typename T, uint16_t N>
+class EventQueue
+{
+private:
+    struct Cell {
+        uint32_t seq;
+        T value;
+    };
+
+    Cell cells[N];
+    uint32_t head;  // Next slot to claim, shared by the producers
+    uint32_t tail;  // Next slot to poll, the consumer only
+
+public:
+    uint32_t posted, dropped, handled;
+
+    EventQueue() : head(0), tail(0), posted(0), dropped(0), handled(0)
+    {
+        static_assert(N && !(N & (N - 1)), "N must be a power of two");
+        for (uint16_t i = 0; i < N; i++)
+            cells[i].seq = i;
+    }
+
+    /* Safe from timers and interrupts, return false if full. */
+    bool post(const T &value)
+    {
+        uint32_t pos = __atomic_load_n(&head, __ATOMIC_RELAXED);
+        Cell *cell;
+        for (;;) {
+            cell = &cells[pos & (N - 1)];
+            const int32_t diff =
+                (int32_t) (__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) -
+                           pos);
+            if (diff == 0) {
+                if (__atomic_compare_exchange_n(&head, &pos, pos + 1, true,
+                                                __ATOMIC_RELAXED,
+                                                __ATOMIC_RELAXED))
+                    break;  // pos is ours
+            } else if (diff < 0) {
+                __atomic_add_fetch(&dropped, 1, __ATOMIC_RELAXED);
+                return false;  // A lap behind, full
+            } else {
+                pos = __atomic_load_n(&head, __ATOMIC_RELAXED);
+            }
+        }
+        cell->value = value;
+        __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+        __atomic_add_fetch(&posted, 1, __ATOMIC_RELAXED);
+        return true;
+    }
+
+    /* From the loop only, return false if empty. */
+    bool poll(T &value)
+    {
+        Cell *cell = &cells[tail & (N - 1)];
+        if (__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) != tail + 1)
+            return false;
+        value = cell->value;
+        __atomic_store_n(&cell->seq, tail + N, __ATOMIC_RELEASE);
+        tail++;
+        handled++;
+        return true;
+    }
+
+    uint16_t size() const
+    {
+        return (uint16_t) (__atomic_load_n(&head, __ATOMIC_RELAXED) - tail);
+    }
+};
+
+#endif
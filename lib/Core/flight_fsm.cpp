@@ -0,0 +1,139 @@
+#include "flight_fsm.h"
+
+#include <math.h>
+#include <string.h>
+
+static bool thrust(const FlightFsm &f, const FlightSample &s)
+{
+    return s.acc > f.limits.liftoffG;
+}
+
+static bool burnout(const FlightFsm &f, const FlightSample &s)
+{
+    return s.acc < f.limits.burnoutG;
+}
+
+// Voted, but not in the first moments of the flight
+static bool voted(const FlightFsm &f, const FlightSample &s)
+{
+    return s.apogee && f.since(PHASE_BOOST, s.t) > f.limits.protect;
+}
+
+// Apogee by time if the vote never came
+static bool release_due(const FlightFsm &f, const FlightSample &s)
+{
+    return f.limits.release && f.since(PHASE_BOOST, s.t) >= f.limits.release;
+}
+
+static bool always(const FlightFsm &, const FlightSample &)
+{
+    return true;
+}
+
+// Hitting the ground fast
+static bool touchdown(const FlightFsm &f, const FlightSample &s)
+{
+    return s.height < f.limits.landedHeight && s.speed < f.limits.landedSpeed;
+}
+
+// On the ground at rest, under the parachute
+static bool rest(const FlightFsm &f, const FlightSample &s)
+{
+    return s.height < f.limits.landedHeight &&
+           fabsf(s.speed) < f.limits.restSpeed;
+}
+
+static bool stop_due(const FlightFsm &f, const FlightSample &s)
+{
+    return f.limits.stop && f.since(PHASE_APOGEE, s.t) >= f.limits.stop;
+}
+
+// Checked in this order, the first to hold its samples wins
+static const FlightTransition transitions[] = {
+    {PHASE_PAD, PHASE_BOOST, FLIGHT_LIFTOFF_SAMPLES, thrust},
+    {PHASE_BOOST, PHASE_APOGEE, 1, voted},
+    {PHASE_BOOST, PHASE_APOGEE, 1, release_due},
+    {PHASE_BOOST, PHASE_COAST, FLIGHT_BURNOUT_SAMPLES, burnout},
+    {PHASE_COAST, PHASE_APOGEE, 1, voted},
+    {PHASE_COAST, PHASE_APOGEE, 1, release_due},
+    {PHASE_APOGEE, PHASE_DESCENT, 1, always},
+    {PHASE_DESCENT, PHASE_LANDED, 1, touchdown},
+    {PHASE_DESCENT, PHASE_LANDED, FLIGHT_REST_SAMPLES, rest},
+    {PHASE_DESCENT, PHASE_LANDED, 1, stop_due},
+};
+#define TRANSITIONS (sizeof(transitions) / sizeof(transitions[0]))
+
+static_assert(TRANSITIONS <= FLIGHT_MAX_TRANSITIONS,
+              "FLIGHT_MAX_TRANSITIONS too small");
+
+FlightFsm::FlightFsm(void (*_onPhase)(void *, FLIGHT_PHASE, uint32_t),
+                     void *_ctx)
+    : onPhase(_onPhase), ctx(_ctx)
+{
+    limits.liftoffG = FLIGHT_LIFTOFF_G;
+    limits.burnoutG = FLIGHT_BURNOUT_G;
+    limits.protect = FLIGHT_PROTECT_TIME * 1000UL;
+    limits.release = 0;
+    limits.stop = 0;
+    limits.landedHeight = FLIGHT_LANDED_HEIGHT;
+    limits.landedSpeed = FLIGHT_LANDED_SPEED;
+    limits.restSpeed = FLIGHT_REST_SPEED;
+    reset(0);
+}
+
+void FlightFsm::reset(uint32_t t)
+{
+    phase = PHASE_PAD;
+    memset(entered, 0, sizeof(entered));
+    memset(hits, 0, sizeof(hits));
+    entered[PHASE_PAD] = t;
+    visited = 1 << PHASE_PAD;
+}
+
+void FlightFsm::resume(FLIGHT_PHASE p, uint32_t t, uint32_t flown)
+{
+    reset(t - flown);
+    if (p == PHASE_PAD || p >= PHASE_COUNT)
+        return;
+    for (uint8_t q = PHASE_BOOST; q <= p; q++) {
+        entered[q] = q == PHASE_BOOST ? t - flown : t;
+        visited |= 1 << q;
+    }
+    phase = p;
+}
+
+bool FlightFsm::update(const FlightSample &s)
+{
+    for (uint8_t i = 0; i < TRANSITIONS; i++) {
+        const FlightTransition &tr = transitions[i];
+        if (tr.from != phase)
+            continue;
+        if (!tr.guard(*this, s)) {
+            hits[i] = 0;
+            continue;
+        }
+        if (++hits[i] < tr.samples)
+            continue;
+
+        phase = tr.to;
+        entered[phase] = s.t;
+        visited |= 1 << phase;
+        memset(hits, 0, sizeof(hits));
+        if (onPhase)
+            onPhase(ctx, phase, s.t);
+        return true;
+    }
+    return false;
+}
+
+uint32_t FlightFsm::since(FLIGHT_PHASE p, uint32_t t) const
+{
+    return visitedPhase(p) ? t - entered[p] : 0;
+}
+
+const char *FlightFsm::name(FLIGHT_PHASE p)
+{
+    static const char *const names[PHASE_COUNT] = {
+        "PAD", "BOOST", "COAST", "APOGEE", "DESCENT", "LANDED"};
+    return p < PHASE_COUNT ? names[p] : "?";
+}
@@ -0,0 +1,104 @@
+/*
+ * This library tracks the flight phase from the sensor samples.
+ * Including
+ * 1. The phases PAD, BOOST, COAST, APOGEE, DESCENT and LANDED
+ * 2. A table of transitions, each a guard on the sample that must hold
+ *    on a number of samples in a row
+ * 3. The time of every transition, in us of the sample that made it
+ * The guards run on every sample, so a transition is detected within
+ * its samples, not within a loop pass. The apogee itself is voted by
+ * ApogeeDetector (apogee.h), the sample carries the result.
+ *
+ * Example:
+ *     FlightFsm fsm(on_phase, ctx);
+ *     fsm.reset(micros());
+ *     for (;;) {
+ *         FlightSample s = {micros(), acc_g, height, speed, voted};
+ *         fsm.update(s);  // Calls on_phase(ctx, phase, s.t) on a change
+ *     }
+ */
+
+#ifndef _FLIGHT_FSM_H
+#define _FLIGHT_FSM_H
+
+#include <stdint.h>
+
+#include "../../include/portable_configs.h"
+
+#define FLIGHT_MAX_TRANSITIONS 12
+
+enum FLIGHT_PHASE {
+    PHASE_PAD,
+    PHASE_BOOST,
+    PHASE_COAST,
+    PHASE_APOGEE,
+    PHASE_DESCENT,
+    PHASE_LANDED,
+    PHASE_COUNT
+};
+
+struct FlightSample {
+    uint32_t t;    // us
+    float acc;     // g, norm of the acceleration
+    float height;  // m
+    float speed;   // m/s, up is positive
+    bool apogee;   // ApogeeDetector voted
+};
+
+/* Limits of the guards, FLIGHT_* of configs.h by default */
+struct FlightLimits {
+    float liftoffG;        // g, above is thrust
+    float burnoutG;        // g, below is coasting
+    uint32_t protect;      // us after lift off without apogee
+    uint32_t release;      // us after lift off, apogee at the latest
+    uint32_t stop;         // us after apogee, landed at the latest
+    float landedHeight;    // m, below with landedSpeed is landed
+    float landedSpeed;     // m/s
+    float restSpeed;       // m/s, below the height and within is landed
+};
+
+class FlightFsm;
+
+struct FlightTransition {
+    FLIGHT_PHASE from, to;
+    uint8_t samples;  // In a row with the guard true
+    bool (*guard)(const FlightFsm &fsm, const FlightSample &s);
+};
+
+class FlightFsm
+{
+private:
+    uint8_t hits[FLIGHT_MAX_TRANSITIONS];  // Samples in a row, per entry
+    uint8_t visited;                       // Bit of every phase entered
+    void (*onPhase)(void *ctx, FLIGHT_PHASE phase, uint32_t t);
+    void *ctx;
+
+public:
+    FLIGHT_PHASE phase;
+    uint32_t entered[PHASE_COUNT];  // us, sample time of each transition
+    FlightLimits limits;
+
+    /* release and stop are 0, no time limit, until set */
+    FlightFsm(void (*onPhase)(void *ctx, FLIGHT_PHASE phase, uint32_t t) = 0,
+              void *ctx = 0);
+
+    /* Back to PAD at t */
+    void reset(uint32_t t);
+
+    /* Go on in phase p at t after a restart, lift off flown us before. *
+     * The phases after BOOST count from t, their start was lost.       */
+    void resume(FLIGHT_PHASE p, uint32_t t, uint32_t flown);
+
+    /* Run the guards of the phase on a sample, return true on a change. *
+     * One transition per sample at most.                                */
+    bool update(const FlightSample &s);
+
+    /* us from entering phase p to t, 0 if not entered (COAST is skipped *
+     * if the apogee comes before burnout is seen)                       */
+    uint32_t since(FLIGHT_PHASE p, uint32_t t) const;
+    bool visitedPhase(FLIGHT_PHASE p) const { return (visited >> p) & 1; }
+
+    static const char *name(FLIGHT_PHASE p);
+};
+
+#endif
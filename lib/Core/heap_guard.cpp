@@ -0,0 +1,100 @@
+#include "heap_guard.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static volatile bool guard_armed = false;
+static volatile bool guard_trap = false;
+static HeapGuardStats guard;
+
+void HeapGuard::arm(bool trap)
+{
+#ifdef USE_HEAP_GUARD
+    memset(&guard, 0, sizeof(guard));
+    guard_trap = trap;
+    guard_armed = true;
+#else
+    (void) trap;  // malloc is not wrapped, nothing would be seen
+#endif
+}
+
+void HeapGuard::disarm()
+{
+    guard_armed = false;
+    guard_trap = false;
+}
+
+bool HeapGuard::armed()
+{
+    return guard_armed;
+}
+
+HeapGuardStats HeapGuard::stats()
+{
+    return guard;
+}
+
+int HeapGuard::print(char *buf, size_t len)
+{
+    const HeapGuardStats s = guard;
+    return snprintf(buf, len, "allocs:%u,bytes:%u,frees:%u,last:%u@%p",
+                    (unsigned) s.allocs, (unsigned) s.bytes,
+                    (unsigned) s.frees, (unsigned) s.lastSize, s.lastCaller);
+}
+
+void HeapGuard::allocated(size_t size, void *caller)
+{
+    if (!guard_armed)
+        return;
+    __atomic_fetch_add(&guard.allocs, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&guard.bytes, (uint32_t) size, __ATOMIC_RELAXED);
+    guard.lastSize = size;
+    guard.lastCaller = caller;
+    if (guard_trap)
+        abort();
+}
+
+void HeapGuard::freed()
+{
+    if (guard_armed)
+        __atomic_fetch_add(&guard.frees, 1, __ATOMIC_RELAXED);
+}
+
+#ifdef USE_HEAP_GUARD
+/* -Wl,--wrap=malloc sends every call of malloc here, __real_malloc is *
+ * the allocator itself                                                */
+extern "C" {
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *p, size_t size);
+void __real_free(void *p);
+
+void *__wrap_malloc(size_t size)
+{
+    HeapGuard::allocated(size, __builtin_return_address(0));
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t n, size_t size)
+{
+    HeapGuard::allocated(n * size, __builtin_return_address(0));
+    return __real_calloc(n, size);
+}
+
+// A realloc may move the block, it counts as an allocation
+void *__wrap_realloc(void *p, size_t size)
+{
+    if (size)
+        HeapGuard::allocated(size, __builtin_return_address(0));
+    return __real_realloc(p, size);
+}
+
+void __wrap_free(void *p)
+{
+    if (p)
+        HeapGuard::freed();
+    __real_free(p);
+}
+}
+#endif
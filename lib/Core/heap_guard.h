@@ -0,0 +1,60 @@
+/*
+ * This library watches the heap once the system is ready.
+ * Including
+ * 1. malloc, calloc, realloc and free linked through the guard with
+ *    -Wl,--wrap, so String, new and the libraries are all seen
+ * 2. The count and bytes of the allocations after arm(), the size and
+ *    caller of the last one
+ * 3. A trap, abort() on the first allocation after arm(), the crash dump
+ *    then shows where it came from
+ * Built with USE_HEAP_GUARD and the wrap flags (the esp07s_heap_guard
+ * env), without them the guard counts nothing and arm() does nothing.
+ *
+ * Example:
+ *     HeapGuard::disarm();
+ *     init();            // Reserve everything here
+ *     HeapGuard::arm(false);
+ *     ...
+ *     char line[HEAP_GUARD_LINE];
+ *     HeapGuard::print(line, sizeof(line));
+ */
+
+#ifndef _HEAP_GUARD_H
+#define _HEAP_GUARD_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef ARDUINO
+#include "../../include/configs.h"
+#endif
+
+#define HEAP_GUARD_LINE 96
+
+struct HeapGuardStats {
+    uint32_t allocs;    // After arm()
+    uint32_t bytes;     // Asked for after arm()
+    uint32_t frees;     // After arm()
+    uint32_t lastSize;  // bytes
+    void *lastCaller;   // Return address in the caller of malloc
+};
+
+class HeapGuard
+{
+public:
+    /* Count from now on, abort() on an allocation if trap */
+    static void arm(bool trap);
+    static void disarm();
+    static bool armed();
+
+    static HeapGuardStats stats();
+
+    /* "allocs:N,bytes:N,frees:N,last:N@0xADDR", return the length */
+    static int print(char *buf, size_t len);
+
+    /* Called by the wraps */
+    static void allocated(size_t size, void *caller);
+    static void freed();
+};
+
+#endif
@@ -0,0 +1,99 @@
+#include "heartbeat.h"
+
+#include <string.h>
+
+/* Frame: sync, seq, role, rocket, phase, last event, health, fired, *
+ * t plus (4, little endian), height (2), spare, CRC-8 of the rest   */
+#define CRC_AT (HEARTBEAT_FRAME_LEN - 1)
+
+Heartbeat::Heartbeat(HEARTBEAT_ROLE role)
+    : seqOut(0), seqIn(0), lastGood(0), good(0), bad(0), stale(0), lost(0)
+{
+    memset(&local, 0, sizeof(local));
+    memset(&partner, 0, sizeof(partner));
+    local.role = role;
+    local.lastEvent = HEARTBEAT_NO_EVENT;
+    partner.lastEvent = HEARTBEAT_NO_EVENT;
+    link = LINK_WAIT;
+}
+
+void Heartbeat::reset(uint32_t now)
+{
+    link = LINK_WAIT;
+    lastGood = now;
+}
+
+void Heartbeat::encode(uint8_t *f)
+{
+    const uint16_t height = (uint16_t) local.height;
+    f[0] = HEARTBEAT_SYNC;
+    f[1] = seqOut++;
+    f[2] = local.role;
+    f[3] = local.rocket;
+    f[4] = local.phase;
+    f[5] = local.lastEvent;
+    f[6] = local.health;
+    f[7] = local.fired;
+    for (uint8_t i = 0; i < 4; i++)
+        f[8 + i] = local.tPlus >> (8 * i);
+    f[12] = height;
+    f[13] = height >> 8;
+    f[14] = 0;
+    f[CRC_AT] = crc8(f, CRC_AT);
+}
+
+bool Heartbeat::receive(const uint8_t *f, uint32_t now)
+{
+    if (f[0] != HEARTBEAT_SYNC || f[CRC_AT] != crc8(f, CRC_AT)) {
+        bad++;
+        return false;
+    }
+    // The same frame again, the partner stopped but its SPI did not
+    if (link != LINK_WAIT && f[1] == seqIn) {
+        stale++;
+        return false;
+    }
+    seqIn = f[1];
+    partner.role = f[2];
+    partner.rocket = f[3];
+    partner.phase = f[4];
+    partner.lastEvent = f[5];
+    partner.health = f[6];
+    partner.fired = f[7];
+    partner.tPlus = 0;
+    for (uint8_t i = 0; i < 4; i++)
+        partner.tPlus |= (uint32_t) f[8 + i] << (8 * i);
+    partner.height = (int16_t) (f[12] | f[13] << 8);
+    lastGood = now;
+    link = LINK_OK;
+    good++;
+    return true;
+}
+
+HEARTBEAT_LINK Heartbeat::check(uint32_t now)
+{
+    if (link != LINK_LOST && now - lastGood > HEARTBEAT_TIMEOUT) {
+        link = LINK_LOST;
+        lost++;
+    }
+    return link;
+}
+
+uint8_t Heartbeat::takeover(uint8_t phase) const
+{
+    // Phases only advance, the later of the two is where the flight is
+    const uint8_t at = phase > partner.phase ? phase : partner.phase;
+    const uint8_t due = at >= PHASE_APOGEE ? PYRO_CHUTE : 0;
+    return due & ~partner.fired;
+}
+
+uint8_t Heartbeat::crc8(const uint8_t *data, uint8_t len)
+{
+    uint8_t crc = 0;
+    while (len--) {
+        crc ^= *data++;
+        for (uint8_t i = 0; i < 8; i++)
+            crc = crc & 0x80 ? (crc << 1) ^ 0x07 : crc << 1;
+    }
+    return crc;
+}
@@ -0,0 +1,106 @@
+/*
+ * This library keeps the two MCUs of USE_DUAL_SYSTEM_WATCHDOG in step
+ * over SPI.
+ * Including
+ * 1. A 16 byte frame each way on every transfer, a snapshot of the
+ *    sender: rocket state, flight phase, last event, sensor health,
+ *    pyros fired, time since lift off and height, sealed with a CRC-8
+ * 2. A sequence number, a partner sending the same one again is stuck,
+ *    not alive
+ * 3. The link WAIT until the first good frame, OK while they come and
+ *    LOST after HEARTBEAT_TIMEOUT without one
+ * 4. The snapshot of the last good frame, the state a backup takes
+ *    over from, and the pyros it fires then
+ * The primary is the SPI master and transfers every HEARTBEAT_PERIOD,
+ * the backup answers with the frame it queued before. Either side sees
+ * the loss within HEARTBEAT_TIMEOUT and one check of its own.
+ *
+ * Example:
+ *     Heartbeat hb;
+ *     hb.reset(micros());
+ *     for (;;) {                  // Every HEARTBEAT_PERIOD
+ *         hb.local.phase = ...;
+ *         hb.encode(frame);
+ *         spi_transfer(frame);   // In place, the partner's comes back
+ *         hb.receive(frame, micros());
+ *         if (hb.check(micros()) == LINK_LOST)
+ *             fire(hb.takeover(phase));
+ *     }
+ */
+
+#ifndef _HEARTBEAT_H
+#define _HEARTBEAT_H
+
+#include <stdint.h>
+
+#include "flight_fsm.h"
+
+#include "../../include/portable_configs.h"
+
+#define HEARTBEAT_FRAME_LEN 16
+#define HEARTBEAT_SYNC 0xa5
+
+enum HEARTBEAT_ROLE { ROLE_PRIMARY, ROLE_BACKUP };
+enum HEARTBEAT_LINK { LINK_WAIT, LINK_OK, LINK_LOST };
+enum HEARTBEAT_HEALTH {
+    HEALTH_IMU = 1,
+    HEALTH_BARO = 2,
+    HEALTH_LOGGER = 4
+};
+enum HEARTBEAT_PYRO {
+    PYRO_CHUTE = 1,    // Fairing or first trigger, at the apogee
+    PYRO_CHUTE_2 = 2,  // Second trigger, CHUTE_DELAY_TIME after
+    PYRO_LAUNCH = 4
+};
+
+#define HEARTBEAT_NO_EVENT 0xff
+
+struct HeartbeatState {
+    uint8_t role;       // HEARTBEAT_ROLE
+    uint8_t rocket;     // ROCKET_STATE
+    uint8_t phase;      // FLIGHT_PHASE
+    uint8_t lastEvent;  // SYSTEM_EVENT handled last
+    uint8_t health;     // HEARTBEAT_HEALTH bits
+    uint8_t fired;      // HEARTBEAT_PYRO bits
+    uint32_t tPlus;     // ms since lift off
+    int16_t height;     // m
+};
+
+class Heartbeat
+{
+private:
+    uint8_t seqOut;      // Of the next frame sent
+    uint8_t seqIn;       // Of the last good frame
+    uint32_t lastGood;   // us
+
+public:
+    HeartbeatState local;    // Sent by encode()
+    HeartbeatState partner;  // Of the last good frame
+    HEARTBEAT_LINK link;
+    uint32_t good, bad, stale;  // Frames, bad CRC or sync, repeated seq
+    uint32_t lost;              // Times the link was lost
+
+    Heartbeat(HEARTBEAT_ROLE role = ROLE_PRIMARY);
+
+    /* Back to WAIT at now, the counters kept */
+    void reset(uint32_t now);
+
+    /* The frame of local, the sequence advanced */
+    void encode(uint8_t *frame);
+
+    /* A frame of the partner, return true if good and new */
+    bool receive(const uint8_t *frame, uint32_t now);
+
+    /* The link at now, LOST once HEARTBEAT_TIMEOUT passed without a *
+     * good frame since the last or reset(), OK again with the next  */
+    HEARTBEAT_LINK check(uint32_t now);
+
+    /* Pyros a backup fires taking over: due by its own phase or the *
+     * partner's, less those the partner reported fired              */
+    uint8_t takeover(uint8_t phase) const;
+
+    /* CRC-8, polynomial 0x07 */
+    static uint8_t crc8(const uint8_t *data, uint8_t len);
+};
+
+#endif
@@ -0,0 +1,76 @@
+#include "loop_stats.h"
+
+#include <stdio.h>
+#include <string.h>
+
+void LoopHistogram::add(uint32_t us)
+{
+    uint8_t i = us ? 32 - __builtin_clz(us) : 0;
+    if (i >= LOOP_STATS_BUCKETS)
+        i = LOOP_STATS_BUCKETS - 1;
+    buckets[i]++;
+    count++;
+    if (us > max)
+        max = us;
+    if (us > maxEver)
+        maxEver = us;
+}
+
+uint32_t LoopHistogram::percentile(float p) const
+{
+    if (!count)
+        return 0;
+    const uint32_t rank = (uint32_t) (p * (count - 1)) + 1;
+    uint32_t seen = 0;
+    for (uint8_t i = 0; i < LOOP_STATS_BUCKETS - 1; i++) {
+        seen += buckets[i];
+        if (seen >= rank)
+            return 1UL << i;
+    }
+    return maxEver;
+}
+
+void LoopHistogram::reset()
+{
+    memset(buckets, 0, sizeof(buckets));
+    count = 0;
+    max = 0;
+}
+
+size_t LoopHistogram::print(char *buf, size_t len) const
+{
+    int n = snprintf(buf, len, "n:%u p50:<%u p99:<%u max:%u ever:%u [",
+                     (unsigned) count, (unsigned) percentile(0.5f),
+                     (unsigned) percentile(0.99f), (unsigned) max,
+                     (unsigned) maxEver);
+    // Up to the last used bucket
+    uint8_t used = LOOP_STATS_BUCKETS;
+    while (used > 1 && !buckets[used - 1])
+        used--;
+    for (uint8_t i = 0; i < used && n > 0 && (size_t) n < len; i++)
+        n += snprintf(buf + n, len - n, i ? " %u" : "%u",
+                      (unsigned) buckets[i]);
+    if (n > 0 && (size_t) n < len)
+        n += snprintf(buf + n, len - n, "]");
+    return n < 0 ? 0 : ((size_t) n < len ? n : len - 1);
+}
+
+LoopTimer::LoopTimer(uint32_t _cyclesPerUs)
+    : last(0), started(false), cyclesPerUs(_cyclesPerUs)
+{
+    memset(&period, 0, sizeof(period));
+}
+
+void LoopTimer::pass(uint32_t cycles)
+{
+    if (started)
+        period.add((cycles - last) / cyclesPerUs);
+    last = cycles;
+    started = true;
+}
+
+void LoopTimer::reset()
+{
+    period.reset();
+    started = false;
+}
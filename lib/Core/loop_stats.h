@@ -0,0 +1,69 @@
+/*
+ * This library measures the timing of the main loop.
+ * Including
+ * 1. A log2 bucket histogram of durations, with the max since reset and
+ *    the max ever
+ * 2. The loop period from a cycle counter stamp on every pass
+ * Adding a value is a count leading zeros and an increment, cheap enough
+ * to stay on in flight.
+ *
+ * Example:
+ *     LoopTimer timer(ESP.getCpuFreqMHz());
+ *     for (;;) {
+ *         timer.pass(ESP.getCycleCount());
+ *         ...
+ *     }
+ *     char line[LOOP_STATS_LINE];
+ *     timer.period.print(line, sizeof(line));
+ */
+
+#ifndef _LOOP_STATS_H
+#define _LOOP_STATS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Bucket 0 is 0 us, bucket i is [2^(i-1), 2^i) us, the last one is open *
+ * ended from 2^(LOOP_STATS_BUCKETS-2) us, 262 ms                        */
+#define LOOP_STATS_BUCKETS 20
+#define LOOP_STATS_LINE 192
+
+struct LoopHistogram {
+    uint32_t buckets[LOOP_STATS_BUCKETS];
+    uint32_t count;
+    uint32_t max;      // us, since reset
+    uint32_t maxEver;  // us, since boot
+
+    void add(uint32_t us);
+
+    /* Upper edge of the bucket holding the p quantile, in us */
+    uint32_t percentile(float p) const;
+
+    /* Keeps maxEver */
+    void reset();
+
+    /* "n:1200 p50:<1024 p99:<4096 max:3010 ever:5120 [0 0 ... 3]" */
+    size_t print(char *buf, size_t len) const;
+};
+
+class LoopTimer
+{
+private:
+    uint32_t last;  // cycles, stamp of the previous pass
+    bool started;
+
+public:
+    uint32_t cyclesPerUs;
+    LoopHistogram period;  // us, start to start of a pass
+
+    LoopTimer(uint32_t cyclesPerUs = 1);
+
+    /* Stamp a pass. The cycle counter wraps every 2^32 cycles, 26 s at *
+     * 160 MHz, longer periods are not measured right.                  */
+    void pass(uint32_t cycles);
+
+    /* The next pass starts a new period */
+    void reset();
+};
+
+#endif
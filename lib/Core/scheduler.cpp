@@ -0,0 +1,133 @@
+#include "scheduler.h"
+
+SchedulerTask::SchedulerTask(const char *_name,
+                             task_fn_t _run,
+                             uint32_t _period,
+                             uint8_t _priority,
+                             uint32_t _budget,
+                             uint8_t _core,
+                             void *_ctx)
+    : name(_name),
+      run(_run),
+      period(_period),
+      priority(_priority),
+      budget(_budget),
+      core(_core),
+      ctx(_ctx),
+      due(0),
+      runs(0),
+      overruns(0),
+      skipped(0),
+      timeMax(0),
+      lateMax(0),
+      timeTotal(0),
+      time()
+{
+}
+
+Scheduler::Scheduler(SchedulerTask *_tasks,
+                     uint8_t _count,
+                     uint32_t (*_clock)(void))
+    : tasks(_tasks),
+      count(_count < SCHEDULER_MAX_TASKS ? _count : SCHEDULER_MAX_TASKS),
+      clock(_clock)
+{
+    resetStats();
+}
+
+void Scheduler::start()
+{
+    const uint32_t now = clock();
+    for (uint8_t i = 0; i < count; i++)
+        tasks[i].due = now;
+}
+
+static inline bool on_core(const SchedulerTask &t, uint8_t core)
+{
+    return core == SCHEDULER_ANY_CORE || t.core == core;
+}
+
+uint8_t Scheduler::run(uint8_t core)
+{
+    uint32_t done = 0;  // Bit of each task run in this pass
+    uint8_t ran = 0;
+    passes[core < SCHEDULER_CORES ? core : 0]++;
+
+    for (;;) {
+        const uint32_t now = clock();
+        SchedulerTask *next = 0;
+        uint8_t index = 0;
+        for (uint8_t i = 0; i < count; i++) {
+            SchedulerTask &t = tasks[i];
+            // Wrap safe, due is at most half the clock range away
+            if ((done >> i) & 1 || !on_core(t, core) ||
+                (int32_t) (now - t.due) < 0)
+                continue;
+            if (!next || t.priority > next->priority ||
+                (t.priority == next->priority &&
+                 (int32_t) (t.due - next->due) < 0)) {
+                next = &t;
+                index = i;
+            }
+        }
+        if (!next)
+            return ran;
+
+        const uint32_t late = now - next->due;
+        if (next->period) {
+            // Keep the phase, a task late by periods skips them
+            const uint32_t missed = late / next->period;
+            next->skipped += missed;
+            next->due += (missed + 1) * next->period;
+        } else {
+            next->due = now;
+        }
+        if (late > next->lateMax)
+            next->lateMax = late;
+
+        next->run(next->ctx);
+
+        const uint32_t time = clock() - now;
+        next->runs++;
+        next->timeTotal += time;
+        next->time.add(time);
+        if (time > next->timeMax)
+            next->timeMax = time;
+        if (next->budget && time > next->budget)
+            next->overruns++;
+        done |= 1UL << index;
+        ran++;
+    }
+}
+
+uint32_t Scheduler::untilDue(uint8_t core) const
+{
+    const uint32_t now = clock();
+    uint32_t wait = UINT32_MAX;
+    for (uint8_t i = 0; i < count; i++) {
+        if (!on_core(tasks[i], core))
+            continue;
+        const int32_t left = (int32_t) (tasks[i].due - now);
+        if (left <= 0)
+            return 0;
+        if ((uint32_t) left < wait)
+            wait = left;
+    }
+    return wait;
+}
+
+void Scheduler::resetStats()
+{
+    for (uint8_t c = 0; c < SCHEDULER_CORES; c++)
+        passes[c] = 0;
+    for (uint8_t i = 0; i < count; i++) {
+        SchedulerTask &t = tasks[i];
+        t.runs = 0;
+        t.overruns = 0;
+        t.skipped = 0;
+        t.timeMax = 0;
+        t.lateMax = 0;
+        t.timeTotal = 0;
+        t.time.reset();
+    }
+}
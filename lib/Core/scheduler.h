@@ -0,0 +1,97 @@
+/*
+ * This library runs the main loop as a fixed table of cooperative tasks.
+ * Including
+ * 1. A period, a priority and a time budget for every task
+ * 2. The most urgent due task first, checked again after every task, so
+ *    a sensor task waits for at most one lower task, never a full pass
+ * 3. Run count, run time, lateness and budget overrun of every task, and
+ *    a histogram of its run time
+ * 4. A core for every task, with two cores each runs its own tasks
+ * Tasks run to completion, a slow task still delays the others of its
+ * core by its own length, the overrun counter tells which one.
+ *
+ * Example:
+ *     static SchedulerTask tasks[] = {
+ *         {"sensor", read_sensor, 2000, 3, 1000, 1},
+ *         {"comms", serve_comms, 10000, 1, 5000, 0},
+ *     };
+ *     Scheduler scheduler(tasks, 2, clock);
+ *     scheduler.start();
+ *     for (;;) scheduler.run();   // One core, every task
+ *     for (;;) scheduler.run(1);  // Two, a loop on core 1 and one on 0
+ */
+
+#ifndef _SCHEDULER_H
+#define _SCHEDULER_H
+
+#include <stdint.h>
+
+#include "loop_stats.h"
+
+#define SCHEDULER_MAX_TASKS 32
+#define SCHEDULER_CORES 2
+#define SCHEDULER_ANY_CORE 0xff  // run() of every task, one core
+
+typedef void (*task_fn_t)(void *ctx);
+
+struct SchedulerTask {
+    const char *name;
+    task_fn_t run;
+    uint32_t period;   // us, 0 to run on every pass
+    uint8_t priority;  // Higher runs first
+    uint32_t budget;   // us, a longer run is an overrun
+    uint8_t core;      // Runs on, ignored by a run() of every core
+    void *ctx;
+
+    // Filled by the scheduler
+    uint32_t due;       // us, next start
+    uint32_t runs;
+    uint32_t overruns;  // Runs over budget
+    uint32_t skipped;   // Periods missed entirely
+    uint32_t timeMax;   // us
+    uint32_t lateMax;   // us, start after due
+    uint64_t timeTotal; // us
+    LoopHistogram time; // us, run time
+
+    // The rows of a task table, statistics zeroed
+    SchedulerTask(const char *name,
+                  task_fn_t run,
+                  uint32_t period,
+                  uint8_t priority,
+                  uint32_t budget,
+                  uint8_t core,
+                  void *ctx = 0);
+};
+
+class Scheduler
+{
+private:
+    SchedulerTask *tasks;
+    uint8_t count;
+    uint32_t (*clock)(void);
+
+public:
+    // run() of each core, each counter written by its core only. The
+    // SCHEDULER_ANY_CORE passes count on 0.
+    uint32_t passes[SCHEDULER_CORES];
+
+    Scheduler(SchedulerTask *tasks, uint8_t count, uint32_t (*clock)(void));
+
+    /* Make every task due now. */
+    void start();
+
+    /* Run the due tasks by priority, each at most once, earlier due first *
+     * within a priority, only those of core unless SCHEDULER_ANY_CORE.   *
+     * Return the number of tasks run.                                    */
+    uint8_t run(uint8_t core = SCHEDULER_ANY_CORE);
+
+    /* us until the next task of core is due, 0 if one is due now */
+    uint32_t untilDue(uint8_t core = SCHEDULER_ANY_CORE) const;
+
+    uint8_t size() const { return count; }
+    const SchedulerTask &task(uint8_t i) const { return tasks[i]; }
+
+    void resetStats();
+};
+
+#endif
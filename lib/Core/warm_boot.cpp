@@ -0,0 +1,129 @@
+#include "warm_boot.h"
+
+#include <stddef.h>
+#include <string.h>
+
+#if defined(ARDUINO) && defined(ESP8266)
+#include <Arduino.h>
+#include <user_interface.h>
+#elif defined(ARDUINO) && defined(ESP32)
+#include <esp_attr.h>
+#include <esp_system.h>
+// Kept over every restart but a power loss, not cleared by the startup
+RTC_NOINIT_ATTR static WarmBootRecord warm_boot_rtc;
+#else
+WarmBootRecord warm_boot_rtc;
+WARM_BOOT_RESET warm_boot_reset = RESET_WATCHDOG;
+#endif
+
+static void rtc_read(WarmBootRecord &r)
+{
+#if defined(ARDUINO) && defined(ESP8266)
+    ESP.rtcUserMemoryRead(WARM_BOOT_RTC_OFFSET, (uint32_t *) &r, sizeof(r));
+#else
+    r = warm_boot_rtc;
+#endif
+}
+
+static void rtc_write(const WarmBootRecord &r)
+{
+#if defined(ARDUINO) && defined(ESP8266)
+    ESP.rtcUserMemoryWrite(WARM_BOOT_RTC_OFFSET, (uint32_t *) &r, sizeof(r));
+#else
+    warm_boot_rtc = r;
+#endif
+}
+
+static uint32_t seal(const WarmBootRecord &r)
+{
+    const size_t from = offsetof(WarmBootRecord, restarts);
+    return WarmBoot::crc32((const uint8_t *) &r + from, sizeof(r) - from);
+}
+
+WarmBoot::WarmBoot() : warm(false), reset(RESET_POWER_ON)
+{
+    memset(&record, 0, sizeof(record));
+}
+
+bool WarmBoot::load()
+{
+    reset = reason();
+    rtc_read(record);
+    // A restart on purpose calibrates again, the board may have sat on
+    // the pad for days since the record was saved
+    const bool unplanned = reset == RESET_WATCHDOG || reset == RESET_PANIC ||
+                           reset == RESET_BROWNOUT;
+    warm = unplanned && record.magic == WARM_BOOT_MAGIC &&
+           record.crc == seal(record);
+    if (!warm)
+        memset(&record, 0, sizeof(record));
+    return warm;
+}
+
+void WarmBoot::save()
+{
+    record.magic = WARM_BOOT_MAGIC;
+    record.crc = seal(record);
+    rtc_write(record);
+}
+
+void WarmBoot::clear()
+{
+    WarmBootRecord r;
+    memset(&r, 0, sizeof(r));
+    rtc_write(r);
+}
+
+WARM_BOOT_RESET WarmBoot::reason()
+{
+#if defined(ARDUINO) && defined(ESP8266)
+    switch (ESP.getResetInfoPtr()->reason) {
+    case REASON_WDT_RST:
+    case REASON_SOFT_WDT_RST:
+        return RESET_WATCHDOG;
+    case REASON_EXCEPTION_RST:
+        return RESET_PANIC;
+    case REASON_SOFT_RESTART:
+        return RESET_SOFTWARE;
+    case REASON_EXT_SYS_RST:
+        return RESET_PIN;
+    case REASON_DEFAULT_RST:
+        // No brownout reason, a sealed record then is a dip the RTC
+        // memory lived through, a real power on fails the seal
+        return RESET_BROWNOUT;
+    default:
+        return RESET_POWER_ON;
+    }
+#elif defined(ARDUINO) && defined(ESP32)
+    switch (esp_reset_reason()) {
+    case ESP_RST_INT_WDT:
+    case ESP_RST_TASK_WDT:
+    case ESP_RST_WDT:
+        return RESET_WATCHDOG;
+    case ESP_RST_PANIC:
+        return RESET_PANIC;
+    case ESP_RST_BROWNOUT:
+        return RESET_BROWNOUT;
+    case ESP_RST_SW:
+        return RESET_SOFTWARE;
+    case ESP_RST_EXT:
+        return RESET_PIN;
+    default:
+        return RESET_POWER_ON;
+    }
+#else
+    return warm_boot_reset;
+#endif
+}
+
+/* CRC-32 (IEEE), bit by bit, a record is a few dozen bytes */
+uint32_t WarmBoot::crc32(const uint8_t *data, uint32_t len)
+{
+    uint32_t crc = 0xffffffff;
+    while (len--) {
+        crc ^= *data++;
+        for (uint8_t i = 0; i < 8; i++)
+            crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+    }
+    return ~crc;
+}
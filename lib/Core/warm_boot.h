@@ -0,0 +1,90 @@
+/*
+ * This library keeps the calibration and the flight over a restart in
+ * RTC memory.
+ * Including
+ * 1. The ground pressure, the IMU biases and the rocket state, flight
+ *    phase and time since lift off, sealed with a CRC
+ * 2. A warm boot when a sealed record is found after a watchdog,
+ *    exception or brownout restart, the calibration is reused and a
+ *    flight goes on where it was
+ * 3. A cold boot otherwise: the RTC memory lost with the power, or a
+ *    software restart (OTA, the restart command) or the reset pin, the
+ *    ways a board on the pad is restarted on purpose
+ * ESP8266 keeps it in the RTC user memory at WARM_BOOT_RTC_OFFSET,
+ * ESP32 in RTC_NOINIT memory, the host build in a static.
+ *
+ * Example:
+ *     WarmBoot boot;
+ *     if (boot.load())
+ *         restore(boot.record);
+ *     else {
+ *         calibrate();
+ *         boot.record.groundPa = ...;
+ *         boot.save();
+ *     }
+ */
+
+#ifndef _WARM_BOOT_H
+#define _WARM_BOOT_H
+
+#include <stdint.h>
+
+#include "../../include/portable_configs.h"
+
+#define WARM_BOOT_MAGIC 0x57424f54  // "WBOT"
+
+enum WARM_BOOT_RESET {
+    RESET_POWER_ON,  // Or a reason not listed
+    RESET_SOFTWARE,  // ESP.restart(), after OTA
+    RESET_PIN,       // The reset pin, the restart command
+    RESET_WATCHDOG,
+    RESET_PANIC,     // Exception
+    RESET_BROWNOUT
+};
+
+struct WarmBootRecord {
+    uint32_t magic;
+    uint32_t crc;        // Of everything after it
+    uint32_t restarts;   // Warm boots since the last cold one
+    float groundPa;      // Pa, calibrate_bmp()
+    float accBias[3];    // x, y, z
+    float gyroBias[3];
+    float magBias[3];
+    uint8_t rocketState;  // ROCKET_STATE
+    uint8_t phase;        // FLIGHT_PHASE
+    uint8_t fairingOpened;
+    uint8_t spare;
+    uint32_t tPlus;  // ms since lift off, as of the last save
+};
+
+#ifndef ARDUINO
+extern WarmBootRecord warm_boot_rtc;    // The RTC memory of the host build
+extern WARM_BOOT_RESET warm_boot_reset;  // The restart of the host build
+#endif
+
+class WarmBoot
+{
+public:
+    WarmBootRecord record;
+    bool warm;              // load() found a sealed record
+    WARM_BOOT_RESET reset;  // Of this boot, by load()
+
+    WarmBoot();
+
+    /* Read the record, return true if it is sealed and the restart was *
+     * not on purpose, a warm boot                                      */
+    bool load();
+
+    /* Seal the record and write it */
+    void save();
+
+    /* Drop the record, the next boot is cold */
+    void clear();
+
+    /* Why the chip restarted */
+    static WARM_BOOT_RESET reason();
+
+    static uint32_t crc32(const uint8_t *data, uint32_t len);
+};
+
+#endif
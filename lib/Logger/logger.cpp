@@ -66,9 +66,12 @@ void Logger::lora_init() {
 #endif
 }
 
-void Logger::log(String msg, LOG_LEVEL level) {
-    // Adding prefix message
-    String prefix = "";
+void Logger::log(const String &msg, LOG_LEVEL level) {
+    log(msg.c_str(), level);
+}
+
+void Logger::log(const char *msg, LOG_LEVEL level) {
+    // Adding prefix message, printed ahead of msg
     // switch (level) {
     // case LEVEL_DEBUG:
     //     prefix = "D->";
@@ -90,7 +93,7 @@ void Logger::log(String msg, LOG_LEVEL level) {
     File sd;
     sd = SD.open(file_ext, FILE_WRITE);
     if (sd) {
-        sd.println(prefix + msg);
+        sd.println(msg);
         sd.close();
     }
 #elif defined(USE_FILE_SYSTEM)
@@ -103,11 +106,13 @@ void Logger::log(String msg, LOG_LEVEL level) {
         Serial.println("Failed to open file for appending");
         return;
     }
-    f.print(prefix + msg + "\n");
+    // Two prints, a sum of Strings would allocate on every line
+    f.print(msg);
+    f.print('\n');
 #endif
 
 #ifdef USE_SERIAL_DEBUGGER
-    Serial.println(prefix + msg);
+    Serial.println(msg);
 #endif
 }
 
@@ -266,7 +271,7 @@ void Logger::lora_send(LOG_LORA_MODE mode, int16_t *data) {
     packet.Packet.id = mode << 12 | lora_packet_id;
     memcpy(packet.Packet.data, data, sizeof(int16_t) * 3);
 
-    lora.Send(packet.raw, 8, SX126x_TXMODE_SYNC);
+    lora.Send(packet.raw, 8, SX126x_TXMODE_ASYNC);
     lora_packet_id++;
     lora_packet_id &= 0x0FFF;
 }
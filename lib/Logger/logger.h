@@ -34,13 +34,14 @@ enum LOG_LEVEL {
 };
 enum LOG_LORA_MODE { LORA_ACCEL, LORA_GYRO, LORA_COMMAND };
 
+// The frame of lora_send(), not the LoraPacket class of Lora.h
 typedef union {
     struct {
         uint16_t id;
         int16_t data[3];
     } Packet;
     uint8_t raw[8];
-} LoraPacket;
+} LoggerLoraFrame;
 
 class Logger
 {
@@ -48,7 +49,7 @@ private:
     bool used;
 
 #ifdef USE_LORA_COMMUNICATION
-    LoraPacket packet;
+    LoggerLoraFrame packet;
     uint16_t lora_packet_id;
 #endif
 
@@ -77,7 +78,9 @@ public:
     void lora_init();
 
     /* Perform logging task */
-    void log(String msg, LOG_LEVEL level = LEVEL_DEBUG);
+    void log(const String &msg, LOG_LEVEL level = LEVEL_DEBUG);
+    /* Same, without a String, the flight log lines take this one */
+    void log(const char *msg, LOG_LEVEL level = LEVEL_DEBUG);
     void log_data(uint8_t *data, size_t length, LOG_LEVEL level);
 
     /* Log existing error code or info code */
@@ -1,10 +1,16 @@
 #include "Lora.h"
 
+#include "radio_sx126x.h"
+
 #ifdef USE_LORA_COMMUNICATION
-hw_config hwConfig;
-RadioEvents_t RadioEvents;
+static Sx126xRadio sx126x;
+LoraCommunication lora(&sx126x);
+
+static const TdmaConfig tdmaConfig = {
+    LORA_TDMA_BEACON * 1000UL, LORA_TDMA_SLOT * 1000UL,
+    LORA_TDMA_GUARD * 1000UL,  LORA_TDMA_DOWNLINK,
+    LORA_TDMA_UPLINK,          LORA_TDMA_SYNC_LOSS};
 
-LoraCommunication lora;
 
 LoraPacket::LoraPacket(uint8_t _id)
 {
@@ -16,7 +22,7 @@ LoraPacket::LoraPacket(uint8_t _id)
 
 void LoraPacket::pack_header(const uint8_t size, uint8_t *buf)
 {
-    buf[0] = size + 3;
+    buf[0] = size + LORA_HEADER_SIZE;
     buf[1] = id;
     buf[2] = timestamp;
 }
@@ -83,106 +89,290 @@ LoraPacketSystemState::LoraPacketSystemState(const uint8_t _id,
     data.state.latitude = _latitude & 0xFF;
 }
 
+// The struct has padding between its fields, so go through the codec
+// instead of copying the raw bytes
 LoraPacketSystemState::LoraPacketSystemState(uint8_t *buf) : LoraPacket(buf[1])
 {
     timestamp = buf[2];
-    memcpy(data.raw, buf + 3, size);
+    LoraStateCodec::Schema::unpack(
+        buf + LORA_HEADER_SIZE, data.state.battery, data.state.satellite,
+        data.state.height, data.state.speed, data.state.angular_velocity,
+        data.state.longitude, data.state.latitude);
 }
 
 void LoraPacketSystemState::serialize(uint8_t *buf)
 {
     pack_header(size, buf);
-    memcpy(buf + 3, data.raw, size);
+    LoraStateCodec::Schema::pack(
+        buf + LORA_HEADER_SIZE, data.state.battery, data.state.satellite,
+        data.state.height, data.state.speed, data.state.angular_velocity,
+        data.state.longitude, data.state.latitude);
 }
 
-LoraCommunication::LoraCommunication()
-    : q_tx(sizeof(uint8_t) * LORA_PACKET_SIZE, TX_BUFFER_LEN, FIFO, false),
-      q_rx(sizeof(uint8_t) * LORA_PACKET_SIZE, RX_BUFFER_LEN, FIFO, false)
+LoraCommunication::LoraCommunication(LoraRadio *_radio)
+    : radio(_radio),
+      q_rx(sizeof(LoraReceived), RX_BUFFER_LEN, FIFO, false),
+#ifdef GROUND_STATION
+      tdma(TDMA_GROUND, tdmaConfig)
+#else
+      tdma(TDMA_VEHICLE, tdmaConfig)
+#endif
 {
-    cadBusy = false;
+    state = LORA_RX;
+    stateTime = 0;
+    stateTimeout = 0;
+    backoff = 0;
+    txPending = false;
+    txBeacon = false;
+    txLength = 0;
+    // LORA_BANDWIDTH is the SX126x register code
+    modulation.sf = LORA_SPREADING_FACTOR;
+    modulation.bandwidth = lora_bandwidth_hz(LORA_BANDWIDTH);
+    modulation.cr = LORA_CODINGRATE;
+    modulation.preamble = LORA_PREAMBLE_LENGTH;
+    modulation.header = !LORA_FIX_LENGTH_PAYLOAD_ON;
+    modulation.crc = true;
+    memset(txTypeBytes, 0, sizeof(txTypeBytes));
+    resetStats();
+    updateTime = 0;
+    updateMax = 0;
 }
 
-void LoraCommunication::begin()
+uint32_t LoraCommunication::airtime(uint8_t length) const
 {
-    // Example uses an eByte E22 module with an SX1262
-    hwConfig.CHIP_TYPE = SX1268_CHIP;
-    hwConfig.PIN_LORA_RESET = PIN_SLORA_RESET;      // LORA RESET
-    hwConfig.PIN_LORA_NSS = PIN_SLORA_SELECT;       // LORA SPI CS
-    hwConfig.PIN_LORA_SCLK = PIN_SLORA_SCLK;        // LORA SPI CLK
-    hwConfig.PIN_LORA_MISO = PIN_SLORA_MISO;        // LORA SPI MISO
-    hwConfig.PIN_LORA_DIO_1 = PIN_SLORA_INTERRUPT;  // LORA DIO_1
-    hwConfig.PIN_LORA_BUSY = PIN_SLORA_BUSY;        // LORA SPI BUSY
-    hwConfig.PIN_LORA_MOSI = PIN_SLORA_MOSI;        // LORA SPI MOSI
-    hwConfig.RADIO_TXEN = PIN_RADIO_TXEN;           // LORA ANTENNA TX ENABLE
-    hwConfig.RADIO_RXEN = PIN_RADIO_RXEN;           // LORA ANTENNA RX ENABLE
-
-    // Example uses an CircuitRocks Alora RFM1262 which uses DIO2
-    // pins as antenna control
-    hwConfig.USE_DIO2_ANT_SWITCH = false;
-
-    // Example uses an CircuitRocks Alora RFM1262 which uses DIO3 to
-    // control oscillator voltage
-    hwConfig.USE_DIO3_TCXO = false;
-
-    // Only Insight ISP4520 module uses DIO3 as antenna control
-    hwConfig.USE_DIO3_ANT_SWITCH = false;
-
-    // Get lora module ID
-    uint8_t deviceId[8];
-    BoardGetUniqueId(deviceId);
-
-    lora_hardware_init(hwConfig);
+    return lora_airtime(modulation, length);
+}
 
-    // Initialize the Radio callbacks
-    RadioEvents.TxDone = OnTxDone;
-    RadioEvents.RxDone = OnRxDone;
-    RadioEvents.TxTimeout = OnTxTimeout;
-    RadioEvents.RxTimeout = OnRxTimeout;
-    RadioEvents.RxError = OnRxError;
-    RadioEvents.CadDone = OnCadDone;
+void LoraCommunication::resetStats()
+{
+    txFrames = 0;
+    txPackets = 0;
+    q_tx.replaced = 0;
+    q_tx.evicted = 0;
+    q_tx.refused = 0;
+    airtimeTotal = 0;
+    statsStart = millis();
+    memset(typeStats, 0, sizeof(typeStats));
+    cadBusyCount = 0;
+    timeoutCount = 0;
+    rxFrames = 0;
+    rxPackets = 0;
+    rxDropped = 0;
+    rxErrors = 0;
+    rxTimeouts = 0;
+    rxQueueMax = 0;
+    rssiLast = 0;
+    snrLast = 0;
+    rssiMin = 0;
+    rssiSum = 0;
+    snrSum = 0;
+}
 
-    // Initialize the Radio
-    Radio.Init(&RadioEvents);
+String LoraCommunication::stats()
+{
+    static const char *names[LORA_STATS_TYPES] = {"other", "vector", "message",
+                                                  "state", "beacon",
+                                                  "keyframe", "delta"};
+    const uint32_t elapsed = millis() - statsStart;
+    const float seconds = elapsed ? elapsed / 1000.0 : 1;
+
+    String msg = String("lora SF") + modulation.sf + " BW" +
+                 modulation.bandwidth / 1000 + "k CR4/" + (modulation.cr + 4) +
+                 ", full frame " + airtime(LORA_PACKET_SIZE) / 1000 + "ms\n";
+    msg += String("duty:") + (100.0 * airtimeTotal / (elapsed ? elapsed : 1)) +
+           "%,frames:" + txFrames + ",packets:" + txPackets +
+           ",cad busy:" + cadBusyCount + ",timeout:" + timeoutCount + "\n";
+    msg += String("tx queue:") + q_tx.getCount() + "/" + TX_BUFFER_LEN +
+           ",replaced:" + q_tx.replaced + ",evicted:" + q_tx.evicted +
+           ",refused:" + q_tx.refused + "\n";
+    for (uint8_t i = 0; i < LORA_STATS_TYPES; i++) {
+        const LoraTypeStats &t = typeStats[i];
+        if (!t.packets)
+            continue;
+        msg += String(names[i]) + ": " + (t.packets / seconds) + "pkt/s," +
+               t.bytes + "B,air:" + t.airtime + "ms,delay avg:" +
+               (t.delay / t.packets) + "ms,max:" + t.delayMax / 1000 + "ms\n";
+    }
+    if (rxFrames)
+        msg += String("rx frames:") + rxFrames + ",packets:" + rxPackets +
+               ",dropped:" + rxDropped + ",queue max:" + rxQueueMax + "/" +
+               RX_BUFFER_LEN + ",error:" + rxErrors +
+               ",timeout:" + rxTimeouts + "\nrssi:" + rssiLast + "dBm,avg:" +
+               (rssiSum / (int32_t) rxFrames) + ",min:" + rssiMin +
+               ",snr:" + snrLast + "dB,avg:" + (snrSum / (int32_t) rxFrames) +
+               "\n";
+    else
+        msg += String("rx error:") + rxErrors + ",timeout:" + rxTimeouts +
+               "\n";
+    msg += String("update max:") + updateMax + "us";
+    return msg;
+}
 
-    // Set Radio channel
-    Radio.SetChannel(RF_FREQUENCY);
+void LoraCommunication::begin()
+{
+    events.ctx = this;
+    events.TxDone = OnTxDone;
+    events.RxDone = OnRxDone;
+    events.TxTimeout = OnTxTimeout;
+    events.RxTimeout = OnRxTimeout;
+    events.RxError = OnRxError;
+    events.CadDone = OnCadDone;
+    radio->init(&events);
+
+    radio->rx();
+    stateTime = micros();
+    tdma.start(stateTime);
+}
 
-    // Set Radio TX configuration
-    Radio.SetTxConfig(MODEM_LORA, TX_OUTPUT_POWER, 0, LORA_BANDWIDTH,
-                      LORA_SPREADING_FACTOR, LORA_CODINGRATE,
-                      LORA_PREAMBLE_LENGTH, LORA_FIX_LENGTH_PAYLOAD_ON, true, 0,
-                      0, LORA_IQ_INVERSION_ON, TX_TIMEOUT_VALUE);
+void LoraCommunication::update()
+{
+    const uint32_t start = micros();
+
+    // Run the callbacks of the radio events, cheap if none
+    radio->process();
+
+    switch (state) {
+    case LORA_RX: {
+#ifdef USE_LORA_TDMA
+        // The ground opens every frame with the beacon
+        uint32_t late;
+        if (tdma.beaconDue(start, &late)) {
+            LoraBeaconCodec::pack(BeaconBuffer, 0, tdma.frame(start),
+                                  late / 16);
+            txBeacon = true;
+            transmit(BeaconBuffer, LoraBeaconCodec::size);
+            break;
+        }
+#endif
+        if (start - stateTime < backoff)
+            break;
+        if (!txPending && aggregate())
+            txPending = true;
+        if (!txPending)
+            break;
+#ifdef USE_LORA_TDMA
+        // The slot is ours, no need to sense the channel
+        if (tdma.synced(start)) {
+            if (tdma.canSend(start, airtime(txLength)))
+                transmit(TxBuffer, txLength);
+            break;
+        }
+#endif
+        // Listen before talk, OnCadDone() decides to send or wait
+        state = LORA_CAD;
+        stateTime = start;
+        stateTimeout = LORA_STATE_TIMEOUT * 1000UL;
+        radio->startCad();
+        break;
+    }
+    case LORA_CAD:
+    case LORA_TX:
+        // The DIO1 interrupt was missed, recover instead of hanging
+        if (start - stateTime > stateTimeout) {
+            timeoutCount++;
+            // As OnTxTimeout(), the frame on air is dropped, a data frame
+            // still waiting for its CAD is kept
+            if (state == LORA_TX) {
+                if (txBeacon)
+                    txBeacon = false;
+                else
+                    txPending = false;
+            }
+            listen();
+        }
+        break;
+    }
 
-    // Set Radio RX configuration
-    Radio.SetRxConfig(MODEM_LORA, LORA_BANDWIDTH, LORA_SPREADING_FACTOR,
-                      LORA_CODINGRATE, 0, LORA_PREAMBLE_LENGTH,
-                      LORA_SYMBOL_TIMEOUT, LORA_FIX_LENGTH_PAYLOAD_ON, 0, true,
-                      0, 0, LORA_IQ_INVERSION_ON, true);
+    updateTime = micros() - start;
+    if (updateTime > updateMax)
+        updateMax = updateTime;
+}
 
-    Radio.Rx(RX_TIMEOUT_VALUE);
+uint8_t LoraCommunication::aggregate()
+{
+    LoraQueued q;
+    const uint32_t now = micros();
+    txLength = 0;
+    memset(txTypeBytes, 0, sizeof(txTypeBytes));
+    while (q_tx.peek(&q)) {
+        // The first byte indicate the size of the packet (including itself)
+        const uint8_t size = q.packet[0];
+        if (size < LORA_HEADER_SIZE || size > LORA_PACKET_SIZE) {
+            q_tx.drop();  // Broken packet, never sendable
+            continue;
+        }
+        if (txLength + size > LORA_PACKET_SIZE)
+            break;  // Goes into the next frame
+        q_tx.drop();
+        memcpy(TxBuffer + txLength, q.packet, size);
+        txLength += size;
+        txPackets++;
+
+        const uint8_t type =
+            q.packet[1] < LORA_STATS_TYPES ? q.packet[1] : 0;
+        const uint32_t delay = now - q.queued;
+        LoraTypeStats &t = typeStats[type];
+        t.packets++;
+        t.bytes += size;
+        t.delay += delay / 1000;
+        if (delay > t.delayMax)
+            t.delayMax = delay;
+        txTypeBytes[type] += size;
+    }
+    if (txLength)
+        txFrames++;
+    return txLength;
 }
 
-void LoraCommunication::update()
+void LoraCommunication::transmit(const uint8_t *buf, uint8_t length)
 {
-    if (!cadBusy && !q_tx.isEmpty()) {
-        q_tx.pop(TxBuffer);
-        Radio.Standby();
-        Radio.SetCadParams(LORA_CAD_08_SYMBOL, LORA_SPREADING_FACTOR + 13, 10,
-                           LORA_CAD_ONLY, 0);
-        cadTime = millis();
-        cadBusy = true;
-        Radio.StartCad();
+    state = LORA_TX;
+    stateTime = micros();
+    const uint32_t air = airtime(length);
+    stateTimeout = air + LORA_STATE_TIMEOUT * 1000UL;
+    radio->send(buf, length);
+
+    // Share the airtime by the bytes of each packet type
+    airtimeTotal += air / 1000;
+    if (buf == BeaconBuffer) {
+        typeStats[LORA_PACKET_BEACON].packets++;
+        typeStats[LORA_PACKET_BEACON].bytes += length;
+        typeStats[LORA_PACKET_BEACON].airtime += air / 1000;
+        return;
+    }
+    for (uint8_t i = 0; i < LORA_STATS_TYPES; i++) {
+        if (txTypeBytes[i])
+            typeStats[i].airtime += air * txTypeBytes[i] / length / 1000;
     }
-    Radio.IrqProcess();
-    delay(50);
-    yield();
+}
+
+void LoraCommunication::listen(uint32_t wait)
+{
+    state = LORA_RX;
+    stateTime = micros();
+    backoff = wait;
+    radio->rx();
 }
 
 bool LoraCommunication::send(LoraPacket *p)
 {
-    uint8_t packet[LORA_PACKET_SIZE];
-    p->serialize(packet);
-    return q_tx.push(packet);
+    LoraQueued q;
+    q.queued = micros();
+    p->serialize(q.packet);
+    return q_tx.push(&q);
+}
+
+bool LoraCommunication::sendState(const LoraState &s)
+{
+    LoraQueued q;
+    q.queued = micros();
+    stateEncoder.encode(s, (millis() / 16) & 0xFF, q.packet);
+    if (q_tx.push(&q))
+        return true;
+    // The deltas to come would refer to a keyframe never sent
+    if (q.packet[1] == LORA_PACKET_KEYFRAME)
+        stateEncoder.restart();
+    return false;
 }
 
 int LoraCommunication::available()
@@ -190,40 +380,107 @@ int LoraCommunication::available()
     return q_rx.getCount();
 }
 
-void OnTxDone(void)
+bool LoraCommunication::receive(LoraReceived *r)
+{
+    return q_rx.pop(r);
+}
+
+void OnTxDone(void *ctx)
 {
-    // Radio.Rx(RX_TIMEOUT_VALUE);
-    lora.cadBusy = false;
+    LoraCommunication &link = *(LoraCommunication *) ctx;
+    if (link.txBeacon)
+        link.txBeacon = false;
+    else
+        link.txPending = false;
+    link.listen();
 }
 
-void OnRxDone(uint8_t *payload, uint16_t size, int16_t rssi, int8_t snr)
+void OnRxDone(void *ctx,
+              uint8_t *payload,
+              uint16_t size,
+              int16_t rssi,
+              int8_t snr)
 {
-    // TODO: check overflow error
-    lora.q_rx.push(payload);
+    LoraCommunication &link = *(LoraCommunication *) ctx;
+    link.rxFrames++;
+    link.rssiLast = rssi;
+    link.snrLast = snr;
+    if (link.rxFrames == 1 || rssi < link.rssiMin)
+        link.rssiMin = rssi;
+    link.rssiSum += rssi;
+    link.snrSum += snr;
+
+    // Split the frame back into packets, each starts with its size
+    LoraReceived r;
+    r.received = micros();
+    r.rssi = rssi;
+    r.snr = snr;
+    uint16_t offset = 0;
+    while (offset + LORA_HEADER_SIZE <= size) {
+        const uint8_t length = payload[offset];
+        if (length < LORA_HEADER_SIZE || offset + length > size)
+            break;
+        uint16_t frame, late;
+        if (LoraBeaconCodec::unpack(payload + offset, NULL, frame, late)) {
+            link.tdma.onBeacon(micros(), frame, late * 16UL,
+                               link.airtime(size));
+            offset += length;
+            continue;
+        }
+        memset(r.packet, 0, sizeof(r.packet));
+        memcpy(r.packet, payload + offset, length);
+        // Keep the newest, a stale packet is worth less to the ground
+        if (link.q_rx.isFull()) {
+            link.q_rx.drop();
+            link.rxDropped++;
+        }
+        link.q_rx.push(&r);
+        link.rxPackets++;
+        if (link.q_rx.getCount() > link.rxQueueMax)
+            link.rxQueueMax = link.q_rx.getCount();
+        offset += length;
+    }
 }
 
-void OnCadDone(bool cadResult)
+void OnCadDone(void *ctx, bool cadResult)
 {
+    LoraCommunication &link = *(LoraCommunication *) ctx;
     if (cadResult) {
-        // Cad busy
+        // Channel busy, keep the packet and retry after a random backoff
+        link.cadBusyCount++;
+        link.listen(random(LORA_CAD_BACKOFF_MIN, LORA_CAD_BACKOFF_MAX) * 1000UL);
     } else {
-        // Serial.println("Message sent!!!");
-        // The first byte indicate the size of the packet (including itself)
-        const uint8_t packet_size = (lora.TxBuffer[0] + 1 < LORA_PACKET_SIZE)
-                                        ? lora.TxBuffer[0]
-                                        : LORA_PACKET_SIZE;
-        Radio.Send(lora.TxBuffer, packet_size);
+        link.transmit(link.TxBuffer, link.txLength);
     }
-    // Serial.println("OnCadDone");
 }
 
-void OnTxTimeout(void)
+void OnTxTimeout(void *ctx)
 {
-    // Need to be logged
+    LoraCommunication &link = *(LoraCommunication *) ctx;
+    // Drop the packet, the next one is likely newer
+    if (link.txBeacon)
+        link.txBeacon = false;
+    else
+        link.txPending = false;
+    link.timeoutCount++;
+    link.listen();
 }
 
-void OnRxTimeout(void) {}
+void OnRxTimeout(void *ctx)
+{
+    LoraCommunication &link = *(LoraCommunication *) ctx;
+    link.rxTimeouts++;
+    // Keep listening, the backoff timer goes on
+    if (link.state == LORA_RX)
+        link.radio->rx();
+}
 
-void OnRxError(void) {}
+void OnRxError(void *ctx)
+{
+    LoraCommunication &link = *(LoraCommunication *) ctx;
+    link.rxErrors++;
+    if (link.state == LORA_RX)
+        link.radio->rx();
+}
 
 #endif
\ No newline at end of file
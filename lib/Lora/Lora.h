@@ -5,21 +5,28 @@
 
 #ifdef USE_LORA_COMMUNICATION
 #include <Arduino.h>
-#include <SX126x-Arduino.h>
 #include <cppQueue.h>
 
 // For mathematical variables
 #include "../Helper_3dmath/Helper_3dmath.h"
+#include "airtime.h"
+#include "packet_codec.h"
+#include "radio.h"
+#include "state_codec.h"
+#include "tdma.h"
+#include "tx_queue.h"
 
-#define TX_BUFFER_LEN 5
-#define RX_BUFFER_LEN 5
+#define TX_BUFFER_LEN 8
+#define RX_BUFFER_LEN LORA_RX_QUEUE_LEN
 
 /* The new style packet use a LoraPacket class as a middle data type *
  * , once you want to design a new type packet, you should provide   *
  * the following functions to your new class inherited from          *
  * LoraPacket.                                                       *
  * - The two constructors                                            *
- * - serialize(): which copy the data to buffer.                     */
+ * - serialize(): which copy the data to buffer.                     *
+ * Several packets are packed into one radio frame back to back, the *
+ * first byte (packet size) tells where the next one starts.         */
 class LoraPacket
 {
 protected:
@@ -73,11 +80,13 @@ public:
     virtual void serialize(uint8_t *buf);
 };
 
+/* Superseded by LoraCommunication::sendState(), which keeps the whole *
+ * GPS position, this one only carries its lowest byte.               */
 class LoraPacketSystemState : public LoraPacket
 {
 private:
 public:
-    static const uint8_t size = 6 + sizeof(float) * 3;
+    static const uint8_t size = LoraStateCodec::Schema::size;
     union {
         struct {
             uint8_t battery;
@@ -108,36 +117,140 @@ public:
     virtual void serialize(uint8_t *buf);
 };
 
+/* Received packet with the link quality of its frame */
+struct LoraReceived {
+    uint32_t received;  // us
+    int16_t rssi;       // dBm
+    int8_t snr;         // dB
+    uint8_t packet[LORA_PACKET_SIZE];
+};
+
+/* Statistics of one packet type (LORA_PACKET_TYPE, 0 for the others) */
+struct LoraTypeStats {
+    uint32_t packets;
+    uint32_t bytes;
+    uint32_t airtime;   // ms, its share of the frames
+    uint32_t delay;     // ms, total time waiting in the queue
+    uint32_t delayMax;  // us
+};
+#define LORA_STATS_TYPES (LORA_PACKET_DELTA + 1)
+
+/* Radio state, moved forward by the DIO1 callbacks:       *
+ * RX --(tx queued)--> CAD --(channel free)--> TX --> RX    *
+ *                     CAD --(channel busy)--> RX, backoff  *
+ * With USE_LORA_TDMA and a beacon heard, RX goes to TX in  *
+ * our own slot without CAD.                                */
+enum LORA_STATE { LORA_RX, LORA_CAD, LORA_TX };
+
 class LoraCommunication
 {
 private:
 public:
-    cppQueue q_tx;
+    LoraRadio *radio;
+    LoraRadioEvents events;
+    LoraTxQueue<TX_BUFFER_LEN> q_tx;
     cppQueue q_rx;
-    time_t cadTime;
-    bool cadBusy;
+    volatile LORA_STATE state;
+    uint32_t stateTime;     // us, entering the current state
+    uint32_t stateTimeout;  // us, CAD/TX done expected within
+    uint32_t backoff;       // us, wait before the next CAD
+    bool txPending;         // TxBuffer holds a frame not sent yet
+    bool txBeacon;          // The beacon is on air, not TxBuffer
+    uint8_t txLength;       // Bytes of the packets packed in TxBuffer
     uint8_t TxBuffer[LORA_PACKET_SIZE];
     uint8_t RxBuffer[LORA_PACKET_SIZE];
+    uint8_t BeaconBuffer[LoraBeaconCodec::size];
+    TdmaScheduler tdma;
+    LoraStateEncoder stateEncoder;
+    LoraStateDecoder stateDecoder;  // For the received state packets
+
+    LoraModulation modulation;
+    uint8_t txTypeBytes[LORA_STATS_TYPES];  // Bytes of each type in TxBuffer
 
-    LoraCommunication();
+    // Statistics
+    uint32_t txFrames;   // Radio frames sent
+    uint32_t txPackets;  // Packets carried by these frames
+    uint32_t airtimeTotal;  // ms on air since statsStart
+    uint32_t statsStart;    // ms
+    LoraTypeStats typeStats[LORA_STATS_TYPES];
+    uint16_t cadBusyCount;
+    uint16_t timeoutCount;
+    uint32_t rxFrames;    // Radio frames received, beacons included
+    uint32_t rxPackets;   // Packets pushed into q_rx
+    uint32_t rxDropped;   // Oldest packets dropped for a full q_rx
+    uint16_t rxErrors;    // CRC or header errors
+    uint16_t rxTimeouts;
+    uint8_t rxQueueMax;   // Highest count of q_rx
+    int16_t rssiLast;     // dBm
+    int8_t snrLast;       // dB
+    int16_t rssiMin;
+    int32_t rssiSum;      // Over rxFrames, for the average
+    int32_t snrSum;
+    uint32_t updateTime;  // us, cost of the last update()
+    uint32_t updateMax;   // us
+
+    LoraCommunication(LoraRadio *radio);
 
     void begin(void);
 
     /* Return the number of packet received. */
     int available();
 
+    /* Pop the oldest received packet, return false if none. */
+    bool receive(LoraReceived *r);
+
     /* Return true if succeed to push. */
     bool send(LoraPacket *p);
 
+    /* Pack the fields with a LoraCodec and push, e.g.   *
+     * lora.send<LoraVectorCodec>(a.x, a.y, a.z);         */
+    template <typename Codec, typename... Ts>
+    bool send(const Ts &... v)
+    {
+        LoraQueued q;
+        q.queued = micros();
+        Codec::pack(q.packet, (millis() / 16) & 0xFF, v...);
+        return q_tx.push(&q);
+    }
+
+    /* Push the state as a keyframe or a delta against the last one. */
+    bool sendState(const LoraState &s);
+
+    /* us on air of a frame of `length` bytes */
+    uint32_t airtime(uint8_t length) const;
+
+    /* Duty cycle, queue delay and rate of each packet type. */
+    String stats();
+    void resetStats();
+
+    /* Serve the radio events and start the next transmission, never *
+     * blocks so it can be called every loop.                        */
     void update();
+
+    /* Pack the queued packets into TxBuffer as many as fit, return *
+     * the frame length.                                             */
+    uint8_t aggregate();
+
+    /* Put TxBuffer on air at once, the slot or CAD said it's free. */
+    void transmit(const uint8_t *buf, uint8_t length);
+
+    /* Go back to receive mode after TX, CAD or an error. */
+    void listen(uint32_t wait = 0);
 };
 
-void OnTxDone(void);
-void OnRxDone(uint8_t *payload, uint16_t size, int16_t rssi, int8_t snr);
-void OnTxTimeout(void);
-void OnRxTimeout(void);
-void OnRxError(void);
-void OnCadDone(bool cadResult);
+extern LoraCommunication lora;
+
+// Radio events, ctx is the LoraCommunication
+void OnTxDone(void *ctx);
+void OnRxDone(void *ctx,
+              uint8_t *payload,
+              uint16_t size,
+              int16_t rssi,
+              int8_t snr);
+void OnTxTimeout(void *ctx);
+void OnRxTimeout(void *ctx);
+void OnRxError(void *ctx);
+void OnCadDone(void *ctx, bool cadResult);
 
 #endif
 
@@ -0,0 +1,35 @@
+#include "airtime.h"
+
+uint32_t lora_bandwidth_hz(uint8_t code)
+{
+    // Indexed by the register code, 0x07 is not used
+    static const uint32_t table[] = {7810,   15630,  31250, 62500,
+                                     125000, 250000, 500000, 0,
+                                     10420,  20830,  41670};
+    return code < sizeof(table) / sizeof(table[0]) ? table[code] : 0;
+}
+
+uint32_t lora_symbol_time(const LoraModulation &m)
+{
+    return ((uint64_t) 1000000 << m.sf) / m.bandwidth;
+}
+
+uint32_t lora_airtime(const LoraModulation &m, uint8_t payload)
+{
+    const uint32_t symbol = lora_symbol_time(m);
+    // Low data rate optimization is required above 16 ms per symbol
+    const int32_t de = symbol >= 16000 ? 1 : 0;
+    // SF5 and SF6 need 2 more preamble symbols and no 8 symbol floor
+    const bool short_sf = m.sf < 7;
+
+    const int32_t bits = 8 * payload - 4 * m.sf + (short_sf ? 0 : 8) +
+                         (m.crc ? 16 : 0) + (m.header ? 20 : 0);
+    const int32_t per_block = 4 * (m.sf - 2 * de);
+    int32_t blocks = bits > 0 ? (bits + per_block - 1) / per_block : 0;
+    const uint32_t payload_symbols = 8 + blocks * (m.cr + 4);
+
+    // In quarter symbols, the preamble ends with 4.25 symbols
+    const uint32_t quarters =
+        (m.preamble + (short_sf ? 2 : 0)) * 4 + 17 + payload_symbols * 4;
+    return (uint64_t) quarters * symbol / 4;
+}
@@ -0,0 +1,33 @@
+/*
+ * This library computes the time on air of LoRa packets with the
+ * formula of the Semtech SX126x datasheet (6.1.4), so telemetry rates
+ * can be sized against the radio capacity.
+ *
+ * T = (n_preamble + 4.25 + 8 + max(ceil((8PL - 4SF + 28 + 16CRC - 20IH)
+ *      / (4(SF - 2DE))) (CR + 4), 0)) * 2^SF / BW
+ */
+
+#ifndef _AIRTIME_H
+#define _AIRTIME_H
+
+#include <stdint.h>
+
+struct LoraModulation {
+    uint8_t sf;          // 5..12
+    uint32_t bandwidth;  // Hz
+    uint8_t cr;          // 1..4 for 4/5..4/8
+    uint16_t preamble;   // symbols
+    bool header;         // explicit header
+    bool crc;
+};
+
+/* Hz of the SX126x bandwidth code (SX126X_LORA_BW_xxx), 0 if unknown */
+uint32_t lora_bandwidth_hz(uint8_t code);
+
+/* us of one symbol */
+uint32_t lora_symbol_time(const LoraModulation &m);
+
+/* us on air of a packet with `payload` bytes */
+uint32_t lora_airtime(const LoraModulation &m, uint8_t payload);
+
+#endif
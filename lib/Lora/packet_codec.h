@@ -0,0 +1,178 @@
+/*
+ * This library packs LoRa packets from a schema declared once.
+ * Including
+ * 1. Little-endian field encoders, independent of the host byte order
+ *    and of the compiler struct packing
+ * 2. Packet size known at compile time and checked against
+ *    LORA_PACKET_SIZE
+ * 3. Static pack/unpack without vtable or heap
+ *
+ * Packet: [size][type][timestamp][fields...], the same header as
+ * LoraPacket, so both kinds can be aggregated into one frame.
+ *
+ * Example:
+ *     typedef LoraCodec<LORA_PACKET_VECTOR, float, float, float> Vector;
+ *     uint8_t buf[Vector::size];
+ *     Vector::pack(buf, timestamp, x, y, z);
+ *     Vector::unpack(buf, &timestamp, x, y, z);
+ */
+
+#ifndef _PACKET_CODEC_H
+#define _PACKET_CODEC_H
+
+#include <stdint.h>
+#include <string.h>
+
+#include "../../include/portable_configs.h"
+
+#define LORA_HEADER_SIZE 3  // [size][type][timestamp]
+
+enum LORA_PACKET_TYPE {
+    LORA_PACKET_VECTOR = 1,
+    LORA_PACKET_MESSAGE,
+    LORA_PACKET_STATE,
+    LORA_PACKET_BEACON,
+    LORA_PACKET_KEYFRAME,  // state_codec.h
+    LORA_PACKET_DELTA
+};
+
+/* Fixed length text field, shorter text is zero padded */
+template <uint8_t N>
+struct LoraText {
+    char str[N];
+};
+
+/* Encoder of one field type, `size` is the bytes on air */
+template <typename T>
+struct LoraField;
+
+template <typename T, uint8_t N>
+struct LoraIntField {
+    static const uint8_t size = N;
+    static void put(uint8_t *buf, T v)
+    {
+        for (uint8_t i = 0; i < N; i++)
+            buf[i] = (uint8_t) ((uint32_t) v >> (8 * i));
+    }
+    static void get(const uint8_t *buf, T &v)
+    {
+        uint32_t raw = 0;
+        for (uint8_t i = 0; i < N; i++)
+            raw |= (uint32_t) buf[i] << (8 * i);
+        v = (T) raw;
+    }
+};
+
+template <>
+struct LoraField<uint8_t> : LoraIntField<uint8_t, 1> {};
+template <>
+struct LoraField<int8_t> : LoraIntField<int8_t, 1> {};
+template <>
+struct LoraField<uint16_t> : LoraIntField<uint16_t, 2> {};
+template <>
+struct LoraField<int16_t> : LoraIntField<int16_t, 2> {};
+template <>
+struct LoraField<uint32_t> : LoraIntField<uint32_t, 4> {};
+template <>
+struct LoraField<int32_t> : LoraIntField<int32_t, 4> {};
+
+template <>
+struct LoraField<float> {
+    static const uint8_t size = 4;
+    static void put(uint8_t *buf, float v)
+    {
+        static_assert(sizeof(float) == 4, "IEEE 754 single float required");
+        uint32_t raw;
+        memcpy(&raw, &v, 4);
+        LoraField<uint32_t>::put(buf, raw);
+    }
+    static void get(const uint8_t *buf, float &v)
+    {
+        uint32_t raw;
+        LoraField<uint32_t>::get(buf, raw);
+        memcpy(&v, &raw, 4);
+    }
+};
+
+template <uint8_t N>
+struct LoraField<LoraText<N> > {
+    static const uint8_t size = N;
+    static void put(uint8_t *buf, const LoraText<N> &v) { memcpy(buf, v.str, N); }
+    static void get(const uint8_t *buf, LoraText<N> &v) { memcpy(v.str, buf, N); }
+};
+
+/* Field list, packed in the declared order without padding */
+template <typename... Ts>
+struct LoraSchema;
+
+template <>
+struct LoraSchema<> {
+    static const uint8_t size = 0;
+    static void pack(uint8_t *) {}
+    static void unpack(const uint8_t *) {}
+};
+
+template <typename T, typename... Ts>
+struct LoraSchema<T, Ts...> {
+    static const uint8_t size = LoraField<T>::size + LoraSchema<Ts...>::size;
+    static void pack(uint8_t *buf, const T &v, const Ts &... rest)
+    {
+        LoraField<T>::put(buf, v);
+        LoraSchema<Ts...>::pack(buf + LoraField<T>::size, rest...);
+    }
+    static void unpack(const uint8_t *buf, T &v, Ts &... rest)
+    {
+        LoraField<T>::get(buf, v);
+        LoraSchema<Ts...>::unpack(buf + LoraField<T>::size, rest...);
+    }
+};
+
+/* A packet type: header plus the schema of its fields */
+template <uint8_t TYPE, typename... Ts>
+struct LoraCodec {
+    typedef LoraSchema<Ts...> Schema;
+    static const uint8_t type = TYPE;
+    static const uint8_t size = LORA_HEADER_SIZE + Schema::size;
+    static_assert(size <= LORA_PACKET_SIZE,
+                  "packet does not fit into LORA_PACKET_SIZE");
+
+    /* Write the packet into buf, return its size. */
+    static uint8_t pack(uint8_t *buf, uint8_t timestamp, const Ts &... v)
+    {
+        buf[0] = size;
+        buf[1] = TYPE;
+        buf[2] = timestamp;
+        Schema::pack(buf + LORA_HEADER_SIZE, v...);
+        return size;
+    }
+
+    /* Return false if buf is not a packet of this type. */
+    static bool unpack(const uint8_t *buf, uint8_t *timestamp, Ts &... v)
+    {
+        if (buf[0] != size || buf[1] != TYPE)
+            return false;
+        if (timestamp)
+            *timestamp = buf[2];
+        Schema::unpack(buf + LORA_HEADER_SIZE, v...);
+        return true;
+    }
+};
+
+// Packets of the telemetry
+typedef LoraCodec<LORA_PACKET_VECTOR, float, float, float> LoraVectorCodec;
+typedef LoraCodec<LORA_PACKET_MESSAGE, LoraText<15> > LoraMessageCodec;
+typedef LoraCodec<LORA_PACKET_STATE,
+                  uint8_t,   // battery
+                  int8_t,    // satellite
+                  float,     // height
+                  float,     // speed
+                  float,     // angular velocity
+                  uint16_t,  // longitude
+                  uint16_t>  // latitude
+    LoraStateCodec;
+typedef LoraCodec<LORA_PACKET_BEACON,
+                  uint16_t,  // frame number
+                  uint16_t>  // 16 us, sent after the frame start
+    LoraBeaconCodec;
+
+#endif
@@ -0,0 +1,52 @@
+/*
+ * This library abstracts the radio under LoraCommunication, so the same
+ * link runs on
+ * 1. The SX126x through SX126x-Arduino (radio_sx126x.h)
+ * 2. An in-process simulation on the host (radio_sim.h)
+ * The events are run from process(), like IrqProcess() of
+ * SX126x-Arduino, never from an interrupt. They get back the ctx of
+ * LoraRadioEvents, so several links can share one process.
+ */
+
+#ifndef _RADIO_H
+#define _RADIO_H
+
+#include <stdint.h>
+
+struct LoraRadioEvents {
+    void *ctx;
+    void (*TxDone)(void *ctx);
+    void (*RxDone)(void *ctx,
+                   uint8_t *payload,
+                   uint16_t size,
+                   int16_t rssi,
+                   int8_t snr);
+    void (*TxTimeout)(void *ctx);
+    void (*RxTimeout)(void *ctx);
+    void (*RxError)(void *ctx);
+    void (*CadDone)(void *ctx, bool busy);
+};
+
+class LoraRadio
+{
+public:
+    virtual ~LoraRadio() {}
+
+    /* Configure the radio, `events` must outlive it. */
+    virtual void init(const LoraRadioEvents *events) = 0;
+
+    /* Receive continuously until the next command. */
+    virtual void rx() = 0;
+    virtual void standby() = 0;
+
+    /* Channel activity detection, ends with CadDone. */
+    virtual void startCad() = 0;
+
+    /* Put the frame on air, ends with TxDone or TxTimeout. */
+    virtual void send(const uint8_t *buf, uint8_t length) = 0;
+
+    /* Run the events which happened since the last call. */
+    virtual void process() = 0;
+};
+
+#endif
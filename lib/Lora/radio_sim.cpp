@@ -0,0 +1,173 @@
+#include "radio_sim.h"
+
+#include <string.h>
+
+SimRadio::SimRadio(SimChannel &_channel, int16_t _rssi, int8_t _snr)
+    : channel(_channel),
+      events(NULL),
+      mode(SIM_STANDBY),
+      since(0),
+      until(0),
+      collided(false),
+      txLength(0),
+      txDone(false),
+      cadDone(false),
+      cadBusy(false),
+      rxDone(false),
+      rxLength(0),
+      rssi(_rssi),
+      snr(_snr)
+{
+    channel.attach(this);
+}
+
+void SimRadio::init(const LoraRadioEvents *_events)
+{
+    events = _events;
+    standby();
+}
+
+void SimRadio::rx()
+{
+    // Stays listening if it already is, a frame on the way is not lost
+    if (mode == SIM_RX)
+        return;
+    mode = SIM_RX;
+    since = channel.now;
+}
+
+void SimRadio::standby()
+{
+    mode = SIM_STANDBY;
+    since = channel.now;
+}
+
+void SimRadio::startCad()
+{
+    mode = SIM_CAD;
+    since = channel.now;
+    until = since + SIM_CAD_SYMBOLS * lora_symbol_time(channel.modulation);
+    cadBusy = false;
+    // A preamble already on air, or starting before the end, is detected
+    for (uint8_t i = 0; i < channel.count; i++) {
+        if (channel.radios[i]->mode == SIM_TX)
+            cadBusy = true;
+    }
+}
+
+void SimRadio::send(const uint8_t *buf, uint8_t length)
+{
+    mode = SIM_TX;
+    since = channel.now;
+    until = since + lora_airtime(channel.modulation, length);
+    collided = false;
+    txLength = length < LORA_PACKET_SIZE ? length : LORA_PACKET_SIZE;
+    memcpy(txBuffer, buf, txLength);
+    channel.stats.frames++;
+
+    for (uint8_t i = 0; i < channel.count; i++) {
+        SimRadio &r = *channel.radios[i];
+        if (&r == this)
+            continue;
+        if (r.mode == SIM_TX) {
+            r.collided = true;
+            collided = true;
+        } else if (r.mode == SIM_CAD) {
+            r.cadBusy = true;
+        }
+    }
+}
+
+void SimRadio::process()
+{
+    if (!events)
+        return;
+    // Clear each flag before its callback, which may start the next one
+    if (txDone) {
+        txDone = false;
+        events->TxDone(events->ctx);
+    }
+    if (cadDone) {
+        cadDone = false;
+        events->CadDone(events->ctx, cadBusy);
+    }
+    if (rxDone) {
+        rxDone = false;
+        events->RxDone(events->ctx, rxBuffer, rxLength, rssi, snr);
+    }
+}
+
+SimChannel::SimChannel(const LoraModulation &_modulation,
+                       float _loss,
+                       uint32_t _seed)
+    : modulation(_modulation), loss(_loss), seed(_seed), count(0), now(0)
+{
+    memset(&stats, 0, sizeof(stats));
+}
+
+void SimChannel::attach(SimRadio *r)
+{
+    if (count < SIM_RADIOS)
+        radios[count++] = r;
+}
+
+float SimChannel::uniform()
+{
+    // xorshift32, the same sequence on every host
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    return (seed >> 8) / 16777216.0f;
+}
+
+void SimChannel::finish(SimRadio &r)
+{
+    if (r.mode == SimRadio::SIM_CAD) {
+        stats.cad++;
+        if (r.cadBusy)
+            stats.cadBusy++;
+        r.standby();
+        r.cadDone = true;
+        return;
+    }
+
+    if (r.collided)
+        stats.collided++;
+    for (uint8_t i = 0; i < count; i++) {
+        SimRadio &to = *radios[i];
+        if (&to == &r || r.collided)
+            continue;
+        if (to.mode != SimRadio::SIM_RX || to.since > r.since) {
+            stats.missed++;
+        } else if (uniform() < loss) {
+            stats.lost++;
+        } else {
+            if (to.rxDone)
+                stats.overrun++;
+            stats.delivered++;
+            to.rxDone = true;
+            to.rxLength = r.txLength;
+            memcpy(to.rxBuffer, r.txBuffer, r.txLength);
+        }
+    }
+    r.standby();
+    r.txDone = true;
+}
+
+void SimChannel::run(uint64_t t)
+{
+    for (;;) {
+        SimRadio *first = NULL;
+        for (uint8_t i = 0; i < count; i++) {
+            SimRadio *r = radios[i];
+            if ((r->mode == SimRadio::SIM_CAD || r->mode == SimRadio::SIM_TX) &&
+                r->until <= t && (!first || r->until < first->until))
+                first = r;
+        }
+        if (!first)
+            break;
+        now = first->until;
+        finish(*first);
+    }
+    now = t;
+}
@@ -0,0 +1,114 @@
+/*
+ * This library simulates LoRa radios sharing one channel in the same
+ * process, so the link logic can be loaded on the host. Including
+ * 1. Time on air from lora_airtime(), CAD over SIM_CAD_SYMBOLS symbols
+ * 2. Collisions, frames overlapping on air are lost for everyone
+ * 3. Half duplex, a radio only hears a frame it listened to from the
+ *    start
+ * 4. Random loss of the remaining frames
+ * Time is virtual, the bench moves it forward with SimChannel::run()
+ * and reads it back with micros().
+ *
+ * Example:
+ *     SimChannel channel(modulation, 0.1f, 1);
+ *     SimRadio ground(channel), vehicle(channel);
+ *     ... init() both with their events ...
+ *     for (;;) {
+ *         ground.process(); vehicle.process();  // Callbacks
+ *         channel.run(channel.now + 100);
+ *     }
+ */
+
+#ifndef _RADIO_SIM_H
+#define _RADIO_SIM_H
+
+#include "airtime.h"
+#include "packet_codec.h"
+#include "radio.h"
+
+#define SIM_RADIOS 4       // At most on one channel
+#define SIM_CAD_SYMBOLS 8  // LORA_CAD_08_SYMBOL
+
+struct SimStats {
+    uint32_t frames;     // Sent
+    uint32_t collided;   // Sent and overlapped by another
+    uint32_t delivered;  // To a receiver
+    uint32_t lost;       // To a receiver, by the random loss
+    uint32_t missed;     // Receiver not listening from the start
+    uint32_t overrun;    // Received before the last one was processed
+    uint32_t cad;
+    uint32_t cadBusy;
+};
+
+class SimChannel;
+
+class SimRadio : public LoraRadio
+{
+    friend class SimChannel;
+
+private:
+    enum SIM_MODE { SIM_STANDBY, SIM_RX, SIM_CAD, SIM_TX };
+
+    SimChannel &channel;
+    const LoraRadioEvents *events;
+    SIM_MODE mode;
+    uint64_t since;  // us, entering the mode
+    uint64_t until;  // us, end of the CAD or TX
+
+    // Frame on air while SIM_TX
+    bool collided;
+    uint8_t txLength;
+    uint8_t txBuffer[LORA_PACKET_SIZE];
+
+    // Events waiting for process(), like the IRQ flags
+    bool txDone;
+    bool cadDone;
+    bool cadBusy;
+    bool rxDone;
+    uint8_t rxLength;
+    uint8_t rxBuffer[LORA_PACKET_SIZE];
+
+public:
+    int16_t rssi;  // dBm, reported with every frame
+    int8_t snr;    // dB
+
+    SimRadio(SimChannel &channel, int16_t rssi = -80, int8_t snr = 8);
+
+    virtual void init(const LoraRadioEvents *events);
+    virtual void rx();
+    virtual void standby();
+    virtual void startCad();
+    virtual void send(const uint8_t *buf, uint8_t length);
+    virtual void process();
+};
+
+class SimChannel
+{
+    friend class SimRadio;
+
+private:
+    LoraModulation modulation;
+    float loss;
+    uint32_t seed;
+    SimRadio *radios[SIM_RADIOS];
+    uint8_t count;
+
+    void attach(SimRadio *r);
+    float uniform();
+
+    /* End the TX or CAD of r at `now`. */
+    void finish(SimRadio &r);
+
+public:
+    uint64_t now;  // us
+    SimStats stats;
+
+    SimChannel(const LoraModulation &modulation, float loss, uint32_t seed);
+
+    uint32_t micros() const { return (uint32_t) now; }
+
+    /* Move the clock to t, ending every TX and CAD due by then in order. */
+    void run(uint64_t t);
+};
+
+#endif
@@ -0,0 +1,128 @@
+#include "radio_sx126x.h"
+
+#ifdef USE_LORA_COMMUNICATION
+const LoraRadioEvents *Sx126xRadio::events = NULL;
+
+void Sx126xRadio::onTxDone(void)
+{
+    events->TxDone(events->ctx);
+}
+
+void Sx126xRadio::onRxDone(uint8_t *payload,
+                           uint16_t size,
+                           int16_t rssi,
+                           int8_t snr)
+{
+    events->RxDone(events->ctx, payload, size, rssi, snr);
+}
+
+void Sx126xRadio::onTxTimeout(void)
+{
+    events->TxTimeout(events->ctx);
+}
+
+void Sx126xRadio::onRxTimeout(void)
+{
+    events->RxTimeout(events->ctx);
+}
+
+void Sx126xRadio::onRxError(void)
+{
+    events->RxError(events->ctx);
+}
+
+void Sx126xRadio::onCadDone(bool busy)
+{
+    events->CadDone(events->ctx, busy);
+}
+
+void Sx126xRadio::init(const LoraRadioEvents *_events)
+{
+    events = _events;
+
+    // Example uses an eByte E22 module with an SX1262
+    hwConfig.CHIP_TYPE = SX1268_CHIP;
+    hwConfig.PIN_LORA_RESET = PIN_SLORA_RESET;      // LORA RESET
+    hwConfig.PIN_LORA_NSS = PIN_SLORA_SELECT;       // LORA SPI CS
+    hwConfig.PIN_LORA_SCLK = PIN_SLORA_SCLK;        // LORA SPI CLK
+    hwConfig.PIN_LORA_MISO = PIN_SLORA_MISO;        // LORA SPI MISO
+    hwConfig.PIN_LORA_DIO_1 = PIN_SLORA_INTERRUPT;  // LORA DIO_1
+    hwConfig.PIN_LORA_BUSY = PIN_SLORA_BUSY;        // LORA SPI BUSY
+    hwConfig.PIN_LORA_MOSI = PIN_SLORA_MOSI;        // LORA SPI MOSI
+    hwConfig.RADIO_TXEN = PIN_RADIO_TXEN;           // LORA ANTENNA TX ENABLE
+    hwConfig.RADIO_RXEN = PIN_RADIO_RXEN;           // LORA ANTENNA RX ENABLE
+
+    // Example uses an CircuitRocks Alora RFM1262 which uses DIO2
+    // pins as antenna control
+    hwConfig.USE_DIO2_ANT_SWITCH = false;
+
+    // Example uses an CircuitRocks Alora RFM1262 which uses DIO3 to
+    // control oscillator voltage
+    hwConfig.USE_DIO3_TCXO = false;
+
+    // Only Insight ISP4520 module uses DIO3 as antenna control
+    hwConfig.USE_DIO3_ANT_SWITCH = false;
+
+    // Get lora module ID
+    uint8_t deviceId[8];
+    BoardGetUniqueId(deviceId);
+
+    lora_hardware_init(hwConfig);
+
+    // Initialize the Radio callbacks
+    radioEvents.TxDone = onTxDone;
+    radioEvents.RxDone = onRxDone;
+    radioEvents.TxTimeout = onTxTimeout;
+    radioEvents.RxTimeout = onRxTimeout;
+    radioEvents.RxError = onRxError;
+    radioEvents.CadDone = onCadDone;
+
+    // Initialize the Radio
+    Radio.Init(&radioEvents);
+
+    // Set Radio channel
+    Radio.SetChannel(RF_FREQUENCY);
+
+    // Set Radio TX configuration
+    Radio.SetTxConfig(MODEM_LORA, TX_OUTPUT_POWER, 0, LORA_BANDWIDTH,
+                      LORA_SPREADING_FACTOR, LORA_CODINGRATE,
+                      LORA_PREAMBLE_LENGTH, LORA_FIX_LENGTH_PAYLOAD_ON, true, 0,
+                      0, LORA_IQ_INVERSION_ON, TX_TIMEOUT_VALUE);
+
+    // Set Radio RX configuration
+    Radio.SetRxConfig(MODEM_LORA, LORA_BANDWIDTH, LORA_SPREADING_FACTOR,
+                      LORA_CODINGRATE, 0, LORA_PREAMBLE_LENGTH,
+                      LORA_SYMBOL_TIMEOUT, LORA_FIX_LENGTH_PAYLOAD_ON, 0, true,
+                      0, 0, LORA_IQ_INVERSION_ON, true);
+}
+
+void Sx126xRadio::rx()
+{
+    Radio.Rx(RX_TIMEOUT_VALUE);
+}
+
+void Sx126xRadio::standby()
+{
+    Radio.Standby();
+}
+
+void Sx126xRadio::startCad()
+{
+    Radio.Standby();
+    Radio.SetCadParams(LORA_CAD_08_SYMBOL, LORA_SPREADING_FACTOR + 13, 10,
+                       LORA_CAD_ONLY, 0);
+    Radio.StartCad();
+}
+
+void Sx126xRadio::send(const uint8_t *buf, uint8_t length)
+{
+    Radio.Send((uint8_t *) buf, length);
+}
+
+void Sx126xRadio::process()
+{
+    // Run the callbacks if DIO1 has fired, cheap otherwise
+    Radio.IrqProcess();
+}
+
+#endif
@@ -0,0 +1,46 @@
+/*
+ * This library runs LoraRadio on the SX126x through SX126x-Arduino.
+ * The library has one global Radio with plain function callbacks, so
+ * only one Sx126xRadio can exist.
+ */
+
+#ifndef _RADIO_SX126X_H
+#define _RADIO_SX126X_H
+
+#include "../../include/configs.h"
+
+#ifdef USE_LORA_COMMUNICATION
+#include <Arduino.h>
+#include <SX126x-Arduino.h>
+
+#include "radio.h"
+
+class Sx126xRadio : public LoraRadio
+{
+private:
+    hw_config hwConfig;
+    RadioEvents_t radioEvents;
+    static const LoraRadioEvents *events;
+
+    static void onTxDone(void);
+    static void onRxDone(uint8_t *payload,
+                         uint16_t size,
+                         int16_t rssi,
+                         int8_t snr);
+    static void onTxTimeout(void);
+    static void onRxTimeout(void);
+    static void onRxError(void);
+    static void onCadDone(bool busy);
+
+public:
+    virtual void init(const LoraRadioEvents *events);
+    virtual void rx();
+    virtual void standby();
+    virtual void startCad();
+    virtual void send(const uint8_t *buf, uint8_t length);
+    virtual void process();
+};
+
+#endif
+
+#endif
@@ -0,0 +1,103 @@
+#include "state_codec.h"
+
+#include <math.h>
+
+/* Scale the difference into int16, return false if it does not fit. */
+static bool quantize(float diff, float unit, int16_t &out)
+{
+    const float q = roundf(diff / unit);
+    if (q < -32768 || q > 32767)
+        return false;
+    out = (int16_t) q;
+    return true;
+}
+
+static bool quantize(int32_t diff, int32_t unit, int16_t &out)
+{
+    // Round half away from zero like roundf()
+    const int32_t q = (diff + (diff < 0 ? -unit : unit) / 2) / unit;
+    if (q < -32768 || q > 32767)
+        return false;
+    out = (int16_t) q;
+    return true;
+}
+
+LoraStateEncoder::LoraStateEncoder()
+    : key(),
+      key_id(0),
+      since_key(0),
+      has_key(false),
+      keyframes(0),
+      deltas(0),
+      forced(0)
+{
+}
+
+uint8_t LoraStateEncoder::encode(const LoraState &s,
+                                 uint8_t timestamp,
+                                 uint8_t *buf)
+{
+    // Battery and satellites change seldom, they ride on the keyframes
+    if (has_key && since_key < LORA_STATE_KEYFRAME - 1) {
+        int16_t height, speed, angular, longitude, latitude;
+        if (s.battery == key.battery && s.satellite == key.satellite &&
+            quantize(s.height - key.height, LORA_DELTA_HEIGHT, height) &&
+            quantize(s.speed - key.speed, LORA_DELTA_SPEED, speed) &&
+            quantize(s.angular_velocity - key.angular_velocity,
+                     LORA_DELTA_ANGULAR, angular) &&
+            quantize(s.longitude - key.longitude, LORA_DELTA_POSITION,
+                     longitude) &&
+            quantize(s.latitude - key.latitude, LORA_DELTA_POSITION,
+                     latitude)) {
+            since_key++;
+            deltas++;
+            return LoraDeltaCodec::pack(buf, timestamp, key_id, height, speed,
+                                        angular, longitude, latitude);
+        }
+        forced++;
+    }
+
+    key = s;
+    key_id++;
+    since_key = 0;
+    has_key = true;
+    keyframes++;
+    return LoraKeyframeCodec::pack(buf, timestamp, key_id, s.battery,
+                                   s.satellite, s.height, s.speed,
+                                   s.angular_velocity, s.longitude,
+                                   s.latitude);
+}
+
+LoraStateDecoder::LoraStateDecoder()
+    : key(), key_id(0), has_key(false), orphans(0)
+{
+}
+
+bool LoraStateDecoder::decode(const uint8_t *buf, LoraState &s)
+{
+    uint8_t id;
+    if (LoraKeyframeCodec::unpack(buf, NULL, id, key.battery, key.satellite,
+                                  key.height, key.speed, key.angular_velocity,
+                                  key.longitude, key.latitude)) {
+        key_id = id;
+        has_key = true;
+        s = key;
+        return true;
+    }
+
+    int16_t height, speed, angular, longitude, latitude;
+    if (!LoraDeltaCodec::unpack(buf, NULL, id, height, speed, angular,
+                                longitude, latitude))
+        return false;
+    if (!has_key || id != key_id) {
+        orphans++;
+        return false;
+    }
+    s = key;
+    s.height += height * LORA_DELTA_HEIGHT;
+    s.speed += speed * LORA_DELTA_SPEED;
+    s.angular_velocity += angular * LORA_DELTA_ANGULAR;
+    s.longitude += (int32_t) longitude * LORA_DELTA_POSITION;
+    s.latitude += (int32_t) latitude * LORA_DELTA_POSITION;
+    return true;
+}
@@ -0,0 +1,94 @@
+/*
+ * This library compresses the vehicle state stream for LoRa.
+ * 1. A keyframe with full precision every LORA_STATE_KEYFRAME packets
+ * 2. Scaled integer deltas against the last keyframe in between
+ * Deltas refer to the keyframe, not to the previous delta, so a lost
+ * packet never corrupts the following ones. A delta which would
+ * overflow its field, or a new battery or satellite count, forces a
+ * keyframe.
+ *
+ * Keyframe: [header][key][battery][satellite][height f32][speed f32]
+ *           [angular velocity f32][longitude i32][latitude i32]
+ * Delta:    [header][key][height][speed][angular velocity][longitude]
+ *           [latitude], all int16 in the LORA_DELTA_* units
+ */
+
+#ifndef _STATE_CODEC_H
+#define _STATE_CODEC_H
+
+#include "../../include/portable_configs.h"
+#include "packet_codec.h"
+
+#define LORA_DELTA_HEIGHT 0.1f    // m
+#define LORA_DELTA_SPEED 0.1f     // m/s
+#define LORA_DELTA_ANGULAR 0.5f   // deg/s
+#define LORA_DELTA_POSITION 10    // 1e-7 deg, about 1 cm
+
+struct LoraState {
+    uint8_t battery;
+    int8_t satellite;
+    float height;            // m
+    float speed;             // m/s
+    float angular_velocity;  // deg/s
+    int32_t longitude;       // 1e-7 deg
+    int32_t latitude;        // 1e-7 deg
+};
+
+typedef LoraCodec<LORA_PACKET_KEYFRAME,
+                  uint8_t,  // key
+                  uint8_t,  // battery
+                  int8_t,   // satellite
+                  float,    // height
+                  float,    // speed
+                  float,    // angular velocity
+                  int32_t,  // longitude
+                  int32_t>  // latitude
+    LoraKeyframeCodec;
+typedef LoraCodec<LORA_PACKET_DELTA,
+                  uint8_t,  // key
+                  int16_t,  // height
+                  int16_t,  // speed
+                  int16_t,  // angular velocity
+                  int16_t,  // longitude
+                  int16_t>  // latitude
+    LoraDeltaCodec;
+
+class LoraStateEncoder
+{
+private:
+    LoraState key;  // Last keyframe sent
+    uint8_t key_id;
+    uint8_t since_key;
+    bool has_key;
+
+public:
+    uint32_t keyframes;
+    uint32_t deltas;
+    uint32_t forced;  // Keyframes sent early, see above
+
+    LoraStateEncoder();
+
+    /* Write the next packet of the stream into buf, return its size. */
+    uint8_t encode(const LoraState &s, uint8_t timestamp, uint8_t *buf);
+
+    /* Send a keyframe next, e.g. after the link was lost. */
+    void restart() { has_key = false; }
+};
+
+class LoraStateDecoder
+{
+private:
+    LoraState key;
+    uint8_t key_id;
+    bool has_key;
+
+public:
+    uint32_t orphans;  // Deltas of a keyframe never received
+
+    LoraStateDecoder();
+
+    /* Return true and fill `s` if buf is a state packet we can use. */
+    bool decode(const uint8_t *buf, LoraState &s);
+};
+
+#endif
@@ -0,0 +1,130 @@
+#include "tdma.h"
+
+TdmaScheduler::TdmaScheduler(TDMA_ROLE role, const TdmaConfig &config)
+    : role(role),
+      config(config),
+      started(false),
+      epoch(0),
+      epoch_frame(0),
+      last_beacon(0),
+      beacon_frame(0),
+      beacons(0),
+      beaconSkipped(0),
+      correction(0)
+{
+}
+
+uint32_t TdmaScheduler::frameLength() const
+{
+    return config.beacon +
+           config.slot * (uint32_t) (config.downlink + config.uplink);
+}
+
+void TdmaScheduler::start(uint32_t now)
+{
+    if (role != TDMA_GROUND)
+        return;
+    epoch = now;
+    epoch_frame = 0;
+    beacon_frame = 0xFFFF;
+    started = true;
+}
+
+void TdmaScheduler::onBeacon(uint32_t now,
+                             uint16_t frame,
+                             uint32_t late,
+                             uint32_t airtime)
+{
+    if (role != TDMA_VEHICLE)
+        return;
+    const uint32_t start = now - airtime - late;
+    if (synced(now)) {
+        // Where our clock thought this frame had begun
+        const uint32_t expect =
+            epoch + (uint16_t) (frame - epoch_frame) * frameLength();
+        correction = (int32_t) (start - expect);
+    }
+    epoch = start;
+    epoch_frame = frame;
+    last_beacon = now;
+    started = true;
+    beacons++;
+}
+
+bool TdmaScheduler::synced(uint32_t now) const
+{
+    if (!started)
+        return false;
+    if (role == TDMA_GROUND)
+        return true;
+    return now - last_beacon < config.sync_loss * frameLength();
+}
+
+TDMA_SLOT TdmaScheduler::slotAt(uint32_t now, uint32_t *remain) const
+{
+    const uint32_t offset = (now - epoch) % frameLength();
+    TDMA_SLOT slot;
+    uint32_t end;
+    if (offset < config.beacon) {
+        slot = TDMA_BEACON;
+        end = config.beacon;
+    } else {
+        const uint32_t index = (offset - config.beacon) / config.slot;
+        slot = index < config.downlink ? TDMA_DOWNLINK : TDMA_UPLINK;
+        end = config.beacon + (index + 1) * config.slot;
+    }
+    if (remain)
+        *remain = end - offset;
+    return slot;
+}
+
+uint16_t TdmaScheduler::frame(uint32_t now) const
+{
+    return epoch_frame + (now - epoch) / frameLength();
+}
+
+bool TdmaScheduler::canSend(uint32_t now, uint32_t airtime) const
+{
+    if (!synced(now))
+        return false;
+    uint32_t remain;
+    const TDMA_SLOT slot = slotAt(now, &remain);
+    const TDMA_SLOT own = role == TDMA_GROUND ? TDMA_UPLINK : TDMA_DOWNLINK;
+    return slot == own && airtime + config.guard <= remain;
+}
+
+bool TdmaScheduler::beaconDue(uint32_t now, uint32_t *late)
+{
+    if (role != TDMA_GROUND || !started)
+        return false;
+    const uint16_t current = frame(now);
+    if (current == beacon_frame || slotAt(now) != TDMA_BEACON)
+        return false;
+    beacon_frame = current;
+
+    // Too late, the beacon would run into the first downlink slot
+    const uint32_t offset = (now - epoch) % frameLength();
+    if (offset + config.guard >= config.beacon) {
+        beaconSkipped++;
+        return false;
+    }
+    *late = offset;
+    beacons++;
+    return true;
+}
+
+uint32_t TdmaScheduler::untilOwnSlot(uint32_t now) const
+{
+    const uint32_t offset = (now - epoch) % frameLength();
+    const TDMA_SLOT slot = slotAt(now);
+    if (role == TDMA_GROUND) {
+        if (slot == TDMA_UPLINK)
+            return 0;
+        return config.beacon + config.slot * config.downlink - offset;
+    }
+    if (slot == TDMA_DOWNLINK)
+        return 0;
+    if (slot == TDMA_BEACON)
+        return config.beacon - offset;
+    return frameLength() - offset + config.beacon;
+}
@@ -0,0 +1,80 @@
+/*
+ * This library shares the LoRa channel between ground and vehicle by
+ * time slots instead of CAD contention.
+ * Frame: [beacon][downlink 0]...[downlink n-1][uplink 0]...[uplink m-1]
+ * 1. The ground starts every frame with a beacon carrying the frame
+ *    number, the vehicle aligns its frame start to it
+ * 2. Downlink slots belong to the vehicle (telemetry), uplink slots to
+ *    the ground (commands), so neither side has to sense the channel
+ * 3. A packet is only sent if it ends before the guard of its slot
+ * Without beacon for `sync_loss` frames the vehicle is unsynced and the
+ * caller should fall back to CAD.
+ *
+ * All times are in microseconds from the caller, so the same code runs
+ * on the radio and in the host simulation.
+ */
+
+#ifndef _TDMA_H
+#define _TDMA_H
+
+#include <stdint.h>
+
+enum TDMA_ROLE { TDMA_GROUND, TDMA_VEHICLE };
+enum TDMA_SLOT { TDMA_BEACON, TDMA_DOWNLINK, TDMA_UPLINK };
+
+struct TdmaConfig {
+    uint32_t beacon;    // us, beacon slot
+    uint32_t slot;      // us, data slot
+    uint32_t guard;     // us, kept silent at the end of every slot
+    uint8_t downlink;   // data slots of the vehicle per frame
+    uint8_t uplink;     // data slots of the ground per frame
+    uint8_t sync_loss;  // frames without beacon before unsynced
+};
+
+class TdmaScheduler
+{
+private:
+    TDMA_ROLE role;
+    TdmaConfig config;
+    bool started;
+    uint32_t epoch;         // us, start of frame `epoch_frame`
+    uint16_t epoch_frame;
+    uint32_t last_beacon;   // us, when the last beacon was heard
+    uint16_t beacon_frame;  // last frame the ground sent a beacon in
+
+public:
+    uint32_t beacons;        // Beacons sent or heard
+    uint32_t beaconSkipped;  // Ground too late for the beacon slot
+    int32_t correction;      // us, last clock correction by a beacon
+
+    TdmaScheduler(TDMA_ROLE role, const TdmaConfig &config);
+
+    uint32_t frameLength() const;
+
+    /* The ground starts its frames, the vehicle waits for a beacon. */
+    void start(uint32_t now);
+
+    /* Feed a beacon received at `now` (RX done). `late` is how long  *
+     * after the frame start the ground began sending, `airtime` the  *
+     * time on air of the beacon.                                     */
+    void onBeacon(uint32_t now, uint16_t frame, uint32_t late, uint32_t airtime);
+
+    bool synced(uint32_t now) const;
+
+    /* Slot at `now`, `remain` gets the us left in it. */
+    TDMA_SLOT slotAt(uint32_t now, uint32_t *remain = 0) const;
+    uint16_t frame(uint32_t now) const;
+
+    /* True if we own the data slot at `now` and a packet of `airtime` *
+     * ends before its guard.                                           */
+    bool canSend(uint32_t now, uint32_t airtime) const;
+
+    /* Ground only: true once per frame inside the beacon slot, `late` *
+     * gets the delay after the frame start to put into the beacon.    */
+    bool beaconDue(uint32_t now, uint32_t *late);
+
+    /* us until the next data slot of ours begins, 0 if inside one. */
+    uint32_t untilOwnSlot(uint32_t now) const;
+};
+
+#endif
@@ -0,0 +1,25 @@
+#include "tx_queue.h"
+
+#define LORA_MASK(type) (1U << (type))
+
+LoraTxPolicy lora_tx_policy(uint8_t type)
+{
+    // Commands and events first, then the state the ground flies by, a
+    // keyframe obsoletes the deltas of the one before
+    switch (type) {
+    case LORA_PACKET_MESSAGE:
+        return {3, 0};
+    case LORA_PACKET_KEYFRAME:
+        return {2, LORA_MASK(LORA_PACKET_KEYFRAME) |
+                       LORA_MASK(LORA_PACKET_DELTA)};
+    case LORA_PACKET_DELTA:
+        return {1, LORA_MASK(LORA_PACKET_DELTA)};
+    case LORA_PACKET_STATE:
+        return {1, LORA_MASK(LORA_PACKET_STATE)};
+    case LORA_PACKET_VECTOR:
+        return {0, LORA_MASK(LORA_PACKET_VECTOR)};
+    default:
+        // Legacy LoraPacket ids, no idea what they carry
+        return {1, 0};
+    }
+}
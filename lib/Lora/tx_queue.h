@@ -0,0 +1,154 @@
+/*
+ * This library queues the LoRa packets waiting for the radio. Including
+ * 1. Priorities by packet type, FIFO within the same priority
+ * 2. Latest value wins, a new packet replaces the queued ones of the
+ *    types in its `replaces` mask, at the place of the oldest
+ * 3. Packets with an empty mask (messages, commands, unknown types) are
+ *    never dropped, a full queue evicts the oldest replaceable packet
+ *    of the lowest priority for them, or refuses them
+ * So at most one packet of each replaceable type waits, and what the
+ * ground receives is at most one frame old.
+ */
+
+#ifndef _TX_QUEUE_H
+#define _TX_QUEUE_H
+
+#include "packet_codec.h"
+
+/* Queued packet with the time it was pushed */
+struct LoraQueued {
+    uint32_t queued;  // us
+    uint8_t packet[LORA_PACKET_SIZE];
+};
+
+struct LoraTxPolicy {
+    uint8_t priority;  // Higher goes first
+    uint8_t replaces;  // Mask of 1 << LORA_PACKET_TYPE, 0 never dropped
+};
+
+/* Policy of a packet type, the default for unknown ones */
+LoraTxPolicy lora_tx_policy(uint8_t type);
+
+template <uint8_t N>
+class LoraTxQueue
+{
+private:
+    LoraQueued entries[N];
+    uint32_t order[N];  // Push sequence, FIFO within a priority
+    uint32_t next;
+    uint8_t count;
+
+    /* Index of the packet to send first, N if empty. */
+    uint8_t head() const
+    {
+        uint8_t best = N;
+        uint8_t best_priority = 0;
+        for (uint8_t i = 0; i < count; i++) {
+            const uint8_t p = lora_tx_policy(entries[i].packet[1]).priority;
+            if (best == N || p > best_priority ||
+                (p == best_priority && order[i] < order[best])) {
+                best = i;
+                best_priority = p;
+            }
+        }
+        return best;
+    }
+
+    static bool replaces(const LoraTxPolicy &policy, uint8_t type)
+    {
+        return type < 8 && (policy.replaces >> type) & 1;
+    }
+
+    void remove(uint8_t i)
+    {
+        count--;
+        entries[i] = entries[count];
+        order[i] = order[count];
+    }
+
+public:
+    uint32_t replaced;  // Packets superseded by a newer one
+    uint32_t evicted;   // Replaceable packets dropped for a full queue
+    uint32_t refused;   // Packets refused for a full queue
+
+    LoraTxQueue() : next(0), count(0), replaced(0), evicted(0), refused(0) {}
+
+    uint8_t getCount() const { return count; }
+    bool isEmpty() const { return count == 0; }
+
+    /* Return false if the packet could not be queued. */
+    bool push(const LoraQueued *q)
+    {
+        const LoraTxPolicy policy = lora_tx_policy(q->packet[1]);
+
+        // Take the place of the oldest packet it replaces, drop the others
+        uint8_t slot = N;
+        for (uint8_t i = 0; i < count; i++) {
+            if (replaces(policy, entries[i].packet[1]) &&
+                (slot == N || order[i] < order[slot]))
+                slot = i;
+        }
+        if (slot != N) {
+            const uint32_t place = order[slot];
+            for (uint8_t i = 0; i < count;) {
+                if (replaces(policy, entries[i].packet[1])) {
+                    remove(i);
+                    replaced++;
+                } else {
+                    i++;
+                }
+            }
+            entries[count] = *q;
+            order[count] = place;
+            count++;
+            return true;
+        }
+
+        if (count == N) {
+            // Make room with the oldest replaceable packet of the lowest
+            // priority, below or at its own
+            uint8_t victim = N;
+            uint8_t victim_priority = policy.priority;
+            for (uint8_t i = 0; i < count; i++) {
+                const LoraTxPolicy p = lora_tx_policy(entries[i].packet[1]);
+                if (!p.replaces || p.priority > victim_priority)
+                    continue;
+                if (victim == N || p.priority < victim_priority ||
+                    order[i] < order[victim]) {
+                    victim = i;
+                    victim_priority = p.priority;
+                }
+            }
+            if (victim == N) {
+                refused++;
+                return false;
+            }
+            remove(victim);
+            evicted++;
+        }
+        entries[count] = *q;
+        order[count] = next++;
+        count++;
+        return true;
+    }
+
+    /* Copy the packet to send first, return false if empty. */
+    bool peek(LoraQueued *q) const
+    {
+        const uint8_t i = head();
+        if (i == N)
+            return false;
+        *q = entries[i];
+        return true;
+    }
+
+    /* Remove the packet peek() returns. */
+    void drop()
+    {
+        const uint8_t i = head();
+        if (i != N)
+            remove(i);
+    }
+};
+
+#endif
@@ -2,7 +2,16 @@
 #include <SPI.h>
 #include "Arduino.h"
 
+#ifndef IRAM_ATTR
+#define IRAM_ATTR
+#endif
 
+volatile bool SX126x::dio1Fired = false;
+
+void IRAM_ATTR SX126x::OnDio1(void)
+{
+    dio1Fired = true;
+}
 
 SX126x::SX126x(int spiSelect, int reset, int busy, int interrupt)
 {
@@ -12,6 +21,14 @@ SX126x::SX126x(int spiSelect, int reset, int busy, int interrupt)
     SX126x_INT0 = interrupt;
 
     txActive = false;
+    txStart = 0;
+    txIrq = 0;
+    txCallback = NULL;
+    txContext = NULL;
+    rxCallback = NULL;
+    rxContext = NULL;
+    busyTimeouts = 0;
+    txTimeouts = 0;
 
     pinMode(SX126x_SPI_SELECT, OUTPUT);
     pinMode(SX126x_RESET, OUTPUT);
@@ -62,6 +79,9 @@ int16_t SX126x::begin(uint8_t packetType,
                     SX126X_IRQ_NONE);      // interrupts on DIO3
 
     SetRfFrequency(frequencyInHz);
+
+    // DIO1 rises on TX_DONE, RX_DONE and TIMEOUT
+    attachInterrupt(digitalPinToInterrupt(SX126x_INT0), OnDio1, RISING);
     return 0;
 }
 
@@ -108,7 +128,7 @@ int16_t SX126x::LoRaConfig(uint8_t spreadingFactor,
 
     SPIwriteCommand(SX126X_CMD_SET_PACKET_PARAMS, PacketParams, 6);
     SetDioIrqParams(SX126X_IRQ_ALL,  // all interrupts enabled
-                    (SX126X_IRQ_RX_DONE | SX126X_IRQ_TX_DONE,
+                    (SX126X_IRQ_RX_DONE | SX126X_IRQ_TX_DONE |
                      SX126X_IRQ_TIMEOUT),  // interrupts on DIO1
                     SX126X_IRQ_NONE,       // interrupts on DIO2
                     SX126X_IRQ_NONE);
@@ -134,58 +154,102 @@ uint8_t SX126x::Receive(uint8_t *pData, uint16_t len)
 
 bool SX126x::Send(uint8_t *pData, uint8_t len, uint8_t mode)
 {
-    uint16_t irq;
-    bool rv = false;
+    // Reap the previous packet if it is done
+    if (txActive)
+        Process();
+    if (!SendAsync(pData, len))
+        return false;
+
+    if (mode & SX126x_TXMODE_SYNC) {
+        // Only on request of the caller, bounded by the TX deadline
+        while (txActive) {
+            Process();
+            yield();
+        }
+        return !(txIrq & SX126X_IRQ_TIMEOUT);
+    }
+    return true;
+}
 
-    if (txActive == false) {
-        txActive = true;
-        PacketParams[2] = 0x00;  // Variable length packet (explicit header)
-        PacketParams[3] = len;
-        SPIwriteCommand(SX126X_CMD_SET_PACKET_PARAMS, PacketParams, 6);
 
-        ClearIrqStatus(SX126X_IRQ_TX_DONE | SX126X_IRQ_TIMEOUT);
+bool SX126x::SendAsync(uint8_t *pData,
+                       uint8_t len,
+                       sx126x_callback_t cb,
+                       void *ctx)
+{
+    if (txActive)
+        return false;
 
-        WriteBuffer(pData, len);
-        SetTx(500);
+    txActive = true;
+    txCallback = cb;
+    txContext = ctx;
+    PacketParams[2] = 0x00;  // Variable length packet (explicit header)
+    PacketParams[3] = len;
+    SPIwriteCommand(SX126X_CMD_SET_PACKET_PARAMS, PacketParams, 6);
 
-        if (mode & SX126x_TXMODE_SYNC) {
-            irq = GetIrqStatus();
-            while ((!(irq & SX126X_IRQ_TX_DONE)) &&
-                   (!(irq & SX126X_IRQ_TIMEOUT))) {
-                irq = GetIrqStatus();
-            }
-            txActive = false;
+    ClearIrqStatus(SX126X_IRQ_TX_DONE | SX126X_IRQ_TIMEOUT);
 
-            SetRx(0xFFFFFF);
+    WriteBuffer(pData, len);
+    txStart = millis();
+    SetTx(SX126X_TX_TIMEOUT);
+    return true;
+}
 
-            if (irq != SX126X_IRQ_TIMEOUT)
-                rv = true;
-        } else {
-            rv = true;
-        }
-    }
 
-    return rv;
+void SX126x::OnReceive(sx126x_callback_t cb, void *ctx)
+{
+    rxCallback = cb;
+    rxContext = ctx;
 }
 
 
-bool SX126x::ReceiveMode(void)
+void SX126x::Process(void)
 {
-    uint16_t irq;
-    bool rv = false;
-
-    if (txActive == false) {
-        rv = true;
-    } else {
-        irq = GetIrqStatus();
-        if (irq & (SX126X_IRQ_TX_DONE | SX126X_IRQ_TIMEOUT)) {
-            SetRx(0xFFFFFF);
-            txActive = false;
-            rv = true;
+    if (dio1Fired) {
+        dio1Fired = false;
+        const uint16_t irq = GetIrqStatus();
+        uint16_t left = irq & (SX126X_IRQ_RX_DONE | SX126X_IRQ_TX_DONE |
+                               SX126X_IRQ_TIMEOUT);
+        if (txActive && (irq & (SX126X_IRQ_TX_DONE | SX126X_IRQ_TIMEOUT))) {
+            ClearIrqStatus(SX126X_IRQ_TX_DONE | SX126X_IRQ_TIMEOUT);
+            left &= ~(SX126X_IRQ_TX_DONE | SX126X_IRQ_TIMEOUT);
+            if (irq & SX126X_IRQ_TIMEOUT)
+                txTimeouts++;
+            FinishTx(irq);
+        }
+        if ((irq & SX126X_IRQ_RX_DONE) && rxCallback) {
+            // Receive() reads and clears the flag
+            left &= ~SX126X_IRQ_RX_DONE;
+            rxCallback(rxContext, irq);
         }
+        // A flag nobody took keeps DIO1 high, the next rising edge, the
+        // TX_DONE of the next packet, would never come
+        if (left)
+            ClearIrqStatus(left);
+    } else if (txActive && millis() - txStart > SX126X_TX_TIMEOUT + 10) {
+        // DIO1 never came, recover by ourselves
+        txTimeouts++;
+        SetStandby(SX126X_STANDBY_RC);
+        FinishTx(SX126X_IRQ_TIMEOUT);
     }
+}
 
-    return rv;
+
+void SX126x::FinishTx(uint16_t irq)
+{
+    txActive = false;
+    txIrq = irq;
+    SetRx(0xFFFFFF);
+    if (txCallback)
+        txCallback(txContext, irq);
+}
+
+
+bool SX126x::ReceiveMode(void)
+{
+    if (txActive)
+        Process();
+    return !txActive;
 }
 
 
@@ -214,8 +278,7 @@ void SX126x::Reset(void)
     delay(20);
     digitalWrite(SX126x_RESET, 1);
     delay(10);
-    while (digitalRead(SX126x_BUSY))
-        ;
+    WaitOnBusy(SX126X_RESET_TIMEOUT * 1000UL);
 }
 
 
@@ -280,17 +343,23 @@ uint8_t SX126x::GetStatus(void)
 //  down again before sending another command.
 //
 //  Parameters:
-//  none
+//  timeoutInUs: give up after this long, the chip is considered hung
 //
 //
 //  Return value:
-//  none
+//  false if BUSY was still high after the timeout
 //
 //----------------------------------------------------------------------------------------------------------------------------
-void SX126x::WaitOnBusy(void)
+bool SX126x::WaitOnBusy(uint32_t timeoutInUs)
 {
-    while (digitalRead(SX126x_BUSY) == 1)
-        ;
+    const uint32_t start = micros();
+    while (digitalRead(SX126x_BUSY) == 1) {
+        if (micros() - start > timeoutInUs) {
+            busyTimeouts++;
+            return false;
+        }
+    }
+    return true;
 }
 
 
@@ -333,7 +402,9 @@ void SX126x::SetDio3AsTcxoCtrl(uint8_t tcxoVoltage, uint32_t timeout)
 void SX126x::Calibrate(uint8_t calibParam)
 {
     uint8_t data = calibParam;
-    SPIwriteCommand(SX126X_CMD_CALIBRATE, &data, 1);
+    // Calibration holds BUSY for up to 3.5 ms
+    SPIwriteCommand(SX126X_CMD_CALIBRATE, &data, 1, false);
+    WaitOnBusy(SX126X_RESET_TIMEOUT * 1000UL);
 }
 
 
@@ -737,7 +808,7 @@ void SX126x::SetRx(uint32_t timeout)
 void SX126x::SetTx(uint32_t timeoutInMs)
 {
     uint8_t buf[3];
-    uint32_t tout = (uint32_t) (timeoutInMs * 0, 015625);
+    uint32_t tout = timeoutInMs * 64;  // 1 ms = 64 * 15.625 us
     buf[0] = (uint8_t) ((tout >> 16) & 0xFF);
     buf[1] = (uint8_t) ((tout >> 8) & 0xFF);
     buf[2] = (uint8_t) (tout & 0xFF);
@@ -788,8 +859,8 @@ uint8_t SX126x::ReadBuffer(uint8_t *rxData, uint8_t *rxDataLen, uint8_t maxLen)
         return 1;
     }
 
-    while (digitalRead(SX126x_BUSY))
-        ;
+    if (!WaitOnBusy())
+        return 1;
 
     digitalWrite(SX126x_SPI_SELECT, LOW);
     SPI.beginTransaction(SPISettings(2000000, MSBFIRST, SPI_MODE0));
@@ -799,10 +870,10 @@ uint8_t SX126x::ReadBuffer(uint8_t *rxData, uint8_t *rxDataLen, uint8_t maxLen)
     for (uint16_t i = 0; i < *rxDataLen; i++) {
         rxData[i] = SPI.transfer(SX126X_CMD_NOP);
     }
+    SPI.endTransaction();
     digitalWrite(SX126x_SPI_SELECT, HIGH);
 
-    while (digitalRead(SX126x_BUSY))
-        ;
+    WaitOnBusy();
 
     return 0;
 }
@@ -821,6 +892,8 @@ uint8_t SX126x::ReadBuffer(uint8_t *rxData, uint8_t *rxDataLen, uint8_t maxLen)
 //----------------------------------------------------------------------------------------------------------------------------
 uint8_t SX126x::WriteBuffer(uint8_t *txData, uint8_t txDataLen)
 {
+    if (!WaitOnBusy())
+        return 1;
     // Serial.print("SPI write: CMD=0x");
     // Serial.print(SX126X_CMD_WRITE_BUFFER, HEX);
     // Serial.print(" DataOut: ");
@@ -834,10 +907,10 @@ uint8_t SX126x::WriteBuffer(uint8_t *txData, uint8_t txDataLen)
         // Serial.print(" ");
         SPI.transfer(txData[i]);
     }
+    SPI.endTransaction();
     digitalWrite(SX126x_SPI_SELECT, HIGH);
     // Serial.println("");
-    while (digitalRead(SX126x_BUSY))
-        ;
+    WaitOnBusy();
 
     return 0;
 }
@@ -868,10 +941,10 @@ void SX126x::SPItransfer(uint8_t cmd,
                          uint8_t numBytes,
                          bool waitForBusy)
 {
-    // ensure BUSY is low (state meachine ready)
-    // TODO timeout
-    while (digitalRead(SX126x_BUSY))
-        ;
+    // ensure BUSY is low (state meachine ready), skip the command if
+    // the chip is hung instead of locking up the caller
+    if (!WaitOnBusy())
+        return;
 
     // start transfer
     digitalWrite(SX126x_SPI_SELECT, LOW);
@@ -913,10 +986,8 @@ void SX126x::SPItransfer(uint8_t cmd,
     digitalWrite(SX126x_SPI_SELECT, HIGH);
 
     // wait for BUSY to go high and then low
-    // TODO timeout
     if (waitForBusy) {
         delayMicroseconds(1);
-        while (digitalRead(SX126x_BUSY))
-            ;
+        WaitOnBusy();
     }
 }
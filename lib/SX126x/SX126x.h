@@ -447,6 +447,15 @@
 #define SX126x_TXMODE_SYNC 0x02
 #define SX126x_TXMODE_BACK2RX 0x04
 
+// Bounded waits, the chip is considered hung after these
+#define SX126X_BUSY_TIMEOUT 2000  // us, BUSY low after a command
+#define SX126X_RESET_TIMEOUT 20   // ms, BUSY low after reset/calibration
+#define SX126X_TX_TIMEOUT 500     // ms, TX_DONE after SetTx
+
+/* Completion of an asynchronous command, irq holds the IRQ flags *
+ * (SX126X_IRQ_TX_DONE, SX126X_IRQ_RX_DONE or SX126X_IRQ_TIMEOUT) */
+typedef void (*sx126x_callback_t)(void *ctx, uint16_t irq);
+
 
 // common low-level SPI interface
 class SX126x
@@ -470,10 +479,43 @@ public:
     void ReceiveStatus(uint8_t *rssiPacket, uint8_t *snrPacket);
     void SetTxPower(int8_t txPowerInDbm);
 
+    /* Start transmitting and return at once, `cb` is called from   *
+     * Process() with TX_DONE, or TIMEOUT after SX126X_TX_TIMEOUT.  *
+     * Return false if the previous packet is still on air.         */
+    bool SendAsync(uint8_t *pData,
+                   uint8_t len,
+                   sx126x_callback_t cb = NULL,
+                   void *ctx = NULL);
+
+    /* Called with RX_DONE when a packet is waiting for Receive(),   *
+     * call it from there. Without a callback the packet is dropped. */
+    void OnReceive(sx126x_callback_t cb, void *ctx = NULL);
+
+    /* Serve the DIO1 interrupt and the TX deadline, put this in loop(). *
+     * It only touches SPI after DIO1 has fired.                         */
+    void Process(void);
+
+    bool TxActive(void) { return txActive; }
+
+    // Statistics
+    uint16_t busyTimeouts;  // BUSY stuck high
+    uint16_t txTimeouts;    // TX_DONE never came
+
 
 private:
     uint8_t PacketParams[6];
-    bool txActive;
+    volatile bool txActive;
+    uint32_t txStart;  // ms
+    uint16_t txIrq;    // IRQ flags which ended the last TX
+    sx126x_callback_t txCallback;
+    void *txContext;
+    sx126x_callback_t rxCallback;
+    void *rxContext;
+
+    static volatile bool dio1Fired;
+    static void OnDio1(void);
+
+    void FinishTx(uint16_t irq);
 
     int SX126x_SPI_SELECT;
     int SX126x_RESET;
@@ -500,7 +542,7 @@ private:
     void Reset(void);
     uint8_t GetStatus(void);
     void SetStandby(uint8_t mode);
-    void WaitOnBusy(void);
+    bool WaitOnBusy(uint32_t timeoutInUs = SX126X_BUSY_TIMEOUT);
     void SetRfFrequency(uint32_t frequency);
     void Calibrate(uint8_t calibParam);
     void CalibrateImage(uint32_t frequency);
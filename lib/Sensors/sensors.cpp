@@ -1,16 +1,21 @@
 #include "sensors.h"
 
-SENSOR::SENSOR() {}
+SENSOR::SENSOR()
+#ifdef USE_PERIPHERAL_BMP280
+    : altitudeKalmanFilter(1, 1, 0.01)
+#endif
+{
+}
 
-bool SENSOR::init()
+bool SENSOR::init(bool warm)
 {
     uint8_t success = 0;
-    success |= init_bmp();
-    success != init_imu();
+    success |= init_bmp(warm);
+    success != init_imu(warm);
     return success;
 }
 
-bool SENSOR::init_imu()
+bool SENSOR::init_imu(bool warm)
 {
 #ifdef USE_GY91_MPU9250
     if (imu.begin() != INV_SUCCESS) {
@@ -35,7 +40,14 @@ bool SENSOR::init_imu()
     // imu.dmpBegin(DMP_FEATURE_GYRO_CAL |   // Enable gyro cal
     //           DMP_FEATURE_SEND_CAL_GYRO,// Send cal'd gyro values
     //           100);
+    // The scales are set here, the biases of a warm boot are kept
+    const fvec_t acc = acc_bias, gyro = gyro_bias, mag = mag_bias;
     calibrate_imu();
+    if (warm) {
+        acc_bias = acc;
+        gyro_bias = gyro;
+        mag_bias = mag;
+    }
     Serial.println("IMU initialize successfully");
 #endif
     return 0;
@@ -65,7 +77,7 @@ void SENSOR::calibrate_imu()
     mag_scale.z[2] = 1;
 }
 
-bool SENSOR::init_bmp()
+bool SENSOR::init_bmp(bool warm)
 {
 #ifdef USE_PERIPHERAL_BMP280
     // bmp.reset();
@@ -82,9 +94,11 @@ bool SENSOR::init_bmp()
 
     rate_bmp = 1000;
     Serial.println("BMP initialize successfully");
-    calibrate_bmp();
+    if (!warm)
+        calibrate_bmp();
 
-    altitudeKalmanFilter = new SimpleKalmanFilter(1, 1, 0.01);
+    // Restart the estimate in place, a soft init allocates nothing
+    altitudeKalmanFilter = SimpleKalmanFilter(1, 1, 0.01);
 #endif
     return 0;
 }
@@ -155,6 +169,12 @@ float SENSOR::getPressure(uint8_t p_type)
     return 0;
 }
 
+void SENSOR::setPressure(float pa)
+{
+    pressure_Pa = pa;
+    pressure_HPa = pa / 100;
+}
+
 void SENSOR::update_imu()
 {
 #ifdef USE_GY91_MPU9250
@@ -213,7 +233,7 @@ bool SENSOR::update_bmp()
         velocity_bmp = (altitude_bmp - altitude_last) / (1 / rate_bmp);
         altitude_last = altitude_bmp;
 
-        altitude_estimate = altitudeKalmanFilter->updateEstimate(altitude_bmp);
+        altitude_estimate = altitudeKalmanFilter.updateEstimate(altitude_bmp);
         velocity_estimate = (altitude_estimate - est_altitude_last) /
                             ((float) (T_now - T) / 1000);
         est_altitude_last = altitude_estimate;
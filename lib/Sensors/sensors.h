@@ -62,7 +62,7 @@ private:
 
 #ifdef USE_PERIPHERAL_BMP280
     Adafruit_BMP280 bmp;  // I2C
-    SimpleKalmanFilter *altitudeKalmanFilter;
+    SimpleKalmanFilter altitudeKalmanFilter;
 #endif
     float altitude_bmp;
     float velocity_bmp;
@@ -90,12 +90,16 @@ public:
     float getBmpVelocity();
     // float getTemperature();
     float getPressure(uint8_t);
+    /* Ground pressure of an earlier calibration, for a warm boot */
+    void setPressure(float pa);
 
     // float getGPS();
 
-    bool init();
-    bool init_imu();
-    bool init_bmp();
+    /* warm: the ground pressure and the biases are restored, their *
+     * calibration is skipped                                       */
+    bool init(bool warm = false);
+    bool init_imu(bool warm = false);
+    bool init_bmp(bool warm = false);
     bool init_gps();
 
     void calibrate_imu();
@@ -0,0 +1,228 @@
+#include "command_channel.h"
+
+static void packHeader(uint8_t *frame,
+                       COMMAND_FRAME_TYPE type,
+                       uint16_t session,
+                       uint16_t seq,
+                       uint8_t status)
+{
+    frame[0] = COMMAND_FRAME_MAGIC;
+    frame[1] = type;
+    frame[2] = session & 0xFF;
+    frame[3] = session >> 8;
+    frame[4] = seq & 0xFF;
+    frame[5] = seq >> 8;
+    frame[6] = status;
+}
+
+CommandChannel::CommandChannel(Transport *t)
+    : transport(t),
+      pending(),
+      session(0),
+      seq(0),
+      report_cb(NULL),
+      report_ctx(NULL),
+      rx_head(0),
+      rx_count(0),
+      history(),
+      resend_count(0),
+      resent(0)
+{
+}
+
+void CommandChannel::onReport(command_report_t cb, void *ctx)
+{
+    report_cb = cb;
+    report_ctx = ctx;
+}
+
+uint16_t CommandChannel::next()
+{
+    // A new session each boot, the receiver drops what it kept of the
+    // last one, so our first numbers are never taken as duplicates
+    if (session == 0) {
+        session = transport_random() | 1;
+        seq = transport_micros() | 1;
+    }
+    return ++seq;
+}
+
+bool CommandChannel::send(uint8_t peer, const char *cmd)
+{
+    if (peer >= COMMAND_CHANNEL_PEERS)
+        return false;
+    if (session == 0)
+        next();
+    size_t length = strlen(cmd);
+    if (length > ESPNOW_CMD_MAX_LENGTH)
+        length = ESPNOW_CMD_MAX_LENGTH;
+
+    for (auto &p : pending) {
+        if (p.active)
+            continue;
+        p.active = true;
+        p.acked = false;
+        p.peer = peer;
+        p.seq = seq;
+        p.retries = 0;
+        p.length = COMMAND_FRAME_HEADER + length;
+        packHeader(p.frame, COMMAND_FRAME_CMD, session, p.seq, 0);
+        memcpy(p.frame + COMMAND_FRAME_HEADER, cmd, length);
+        p.first_sent = p.last_sent = transport_micros();
+        transport->send(peer, p.frame, p.length);
+        return true;
+    }
+    return false;
+}
+
+void CommandChannel::sendAck(uint8_t peer,
+                             uint16_t session,
+                             uint16_t seq,
+                             uint8_t status)
+{
+    uint8_t frame[COMMAND_FRAME_HEADER];
+    packHeader(frame, COMMAND_FRAME_ACK, session, seq, status);
+    transport->send(peer, frame, COMMAND_FRAME_HEADER);
+}
+
+void CommandChannel::update()
+{
+    // Answer the duplicated commands
+    while (resend_count) {
+        const Ack &a = resend[--resend_count];
+        sendAck(a.peer, a.session, a.seq, a.status);
+    }
+
+    const uint32_t now = transport_micros();
+    for (auto &p : pending) {
+        if (!p.active)
+            continue;
+        if (p.acked) {
+            p.active = false;
+            if (report_cb)
+                report_cb(report_ctx, p.peer, p.seq,
+                          (COMMAND_STATUS) p.status, p.rtt);
+        } else if (now - p.last_sent > ESPNOW_CMD_TIMEOUT * 1000UL) {
+            if (p.retries >= ESPNOW_CMD_MAX_RETRIES) {
+                p.active = false;
+                if (report_cb)
+                    report_cb(report_ctx, p.peer, p.seq, COMMAND_LOST,
+                              now - p.first_sent);
+                continue;
+            }
+            p.retries++;
+            p.last_sent = now;
+            resent++;
+            transport->send(p.peer, p.frame, p.length);
+        }
+    }
+}
+
+const char *CommandChannel::fetch()
+{
+    return rx_count ? rx[rx_head].cmd : NULL;
+}
+
+void CommandChannel::ack(COMMAND_STATUS status)
+{
+    if (!rx_count)
+        return;
+    const Received &r = rx[rx_head];
+    record(r.peer, r.session, r.seq, status);
+    sendAck(r.peer, r.session, r.seq, status);
+    rx_head = (rx_head + 1) % ESPNOW_CMD_PENDING_LEN;
+    rx_count--;
+}
+
+int8_t CommandChannel::lookup(uint8_t peer, uint16_t session, uint16_t seq)
+{
+    const History &h = history[peer];
+    if (!h.valid || h.session != session)
+        return -1;  // First from the peer since it or we booted
+    const int16_t age = h.last - seq;
+    if (age < 0)
+        return -1;  // Newer than all handled
+    if (age >= 32)
+        return COMMAND_REJECTED;  // Too old to tell, a late resend
+    if (!(h.done & (1UL << age)))
+        return -1;
+    return (h.rejected & (1UL << age)) ? COMMAND_REJECTED : COMMAND_EXECUTED;
+}
+
+void CommandChannel::record(uint8_t peer,
+                            uint16_t session,
+                            uint16_t seq,
+                            uint8_t status)
+{
+    History &h = history[peer];
+    const bool same = h.valid && h.session == session;
+    int16_t age = h.last - seq;
+    if (!same || age < 0) {
+        // Slide the window forward to the new sequence number, or start
+        // it over for a new session
+        const uint16_t shift = same ? -age : 32;
+        h.done = shift >= 32 ? 0 : h.done << shift;
+        h.rejected = shift >= 32 ? 0 : h.rejected << shift;
+        h.session = session;
+        h.last = seq;
+        h.valid = true;
+        age = 0;
+    }
+    if (age < 32) {
+        h.done |= 1UL << age;
+        if (status == COMMAND_REJECTED)
+            h.rejected |= 1UL << age;
+    }
+}
+
+bool CommandChannel::onFrame(uint8_t peer, const uint8_t *data, uint8_t length)
+{
+    if (length < COMMAND_FRAME_HEADER || data[0] != COMMAND_FRAME_MAGIC)
+        return false;
+    if (peer >= COMMAND_CHANNEL_PEERS)
+        return true;
+    const uint16_t frame_session = data[2] | (data[3] << 8);
+    const uint16_t frame_seq = data[4] | (data[5] << 8);
+
+    if (data[1] == COMMAND_FRAME_ACK) {
+        for (auto &p : pending) {
+            if (p.active && !p.acked && p.peer == peer &&
+                frame_session == session && p.seq == frame_seq) {
+                p.rtt = transport_micros() - p.first_sent;
+                p.status = data[6];
+                p.acked = true;
+            }
+        }
+    } else if (data[1] == COMMAND_FRAME_CMD) {
+        // Already handled, the ack was lost, ack again without executing
+        const int8_t status = lookup(peer, frame_session, frame_seq);
+        if (status >= 0) {
+            if (resend_count < ESPNOW_CMD_PENDING_LEN)
+                resend[resend_count++] = {peer, frame_session, frame_seq,
+                                          (uint8_t) status};
+            return true;
+        }
+        // Still waiting for execution
+        for (uint8_t i = 0; i < rx_count; i++) {
+            const Received &r = rx[(rx_head + i) % ESPNOW_CMD_PENDING_LEN];
+            if (r.peer == peer && r.session == frame_session &&
+                r.seq == frame_seq)
+                return true;
+        }
+        // If the queue is full the sender would resend it later
+        if (rx_count == ESPNOW_CMD_PENDING_LEN)
+            return true;
+
+        Received &r = rx[(rx_head + rx_count) % ESPNOW_CMD_PENDING_LEN];
+        uint8_t cmd_length = length - COMMAND_FRAME_HEADER;
+        if (cmd_length > ESPNOW_CMD_MAX_LENGTH)
+            cmd_length = ESPNOW_CMD_MAX_LENGTH;
+        memcpy(r.cmd, data + COMMAND_FRAME_HEADER, cmd_length);
+        r.cmd[cmd_length] = 0;
+        r.peer = peer;
+        r.session = frame_session;
+        r.seq = frame_seq;
+        rx_count++;
+    }
+    return true;
+}
@@ -0,0 +1,136 @@
+/*
+ * This library delivers commands reliably over a Transport.
+ * Including
+ * 1. Sequence numbers and bounded resend until acked
+ * 2. Execute-once on the receiver, duplicates are only re-acked
+ * 3. Round-trip time of every ack reported to the sender
+ * 4. A random session of every boot, the receiver starts the history of
+ *    a sender over when it changes, so a rebooted sender's numbers are
+ *    never taken for ones handled before
+ *
+ * Frames start with COMMAND_FRAME_MAGIC, which never appears in the
+ * plain text stream, so both kinds of traffic share the same peers.
+ * Frame: [magic][type][session lo][session hi][seq lo][seq hi][status]
+ *        [command text...]
+ */
+
+#ifndef _COMMAND_CHANNEL_H
+#define _COMMAND_CHANNEL_H
+
+#include "transport.h"
+
+#include "../../include/portable_configs.h"
+
+#define COMMAND_FRAME_MAGIC 0xA5
+#define COMMAND_FRAME_HEADER 7
+#define COMMAND_CHANNEL_PEERS TRANSPORT_MAX_PEERS
+
+enum COMMAND_FRAME_TYPE { COMMAND_FRAME_CMD = 1, COMMAND_FRAME_ACK };
+enum COMMAND_STATUS {
+    COMMAND_EXECUTED,
+    COMMAND_REJECTED,
+    COMMAND_LOST  // Reported by the sender after the last retry
+};
+
+/* Called on the sender for every command acked or given up */
+typedef void (*command_report_t)(void *ctx,
+                                 uint8_t peer,
+                                 uint16_t seq,
+                                 COMMAND_STATUS status,
+                                 uint32_t rtt);
+
+class CommandChannel
+{
+private:
+    Transport *transport;
+
+    // Sender side, commands waiting for ack
+    struct Pending {
+        bool active;
+        volatile bool acked;
+        volatile uint8_t status;
+        volatile uint32_t rtt;  // us
+        uint8_t peer;
+        uint16_t seq;
+        uint8_t retries;
+        uint8_t length;
+        uint32_t first_sent;  // us
+        uint32_t last_sent;   // us
+        uint8_t frame[COMMAND_FRAME_HEADER + ESPNOW_CMD_MAX_LENGTH];
+    } pending[ESPNOW_CMD_PENDING_LEN];
+    uint16_t session;  // Of this boot, 0 until the first next()
+    uint16_t seq;
+    command_report_t report_cb;
+    void *report_ctx;
+
+    // Receiver side, commands waiting for execution
+    struct Received {
+        uint8_t peer;
+        uint16_t session;
+        uint16_t seq;
+        char cmd[ESPNOW_CMD_MAX_LENGTH + 1];
+    } rx[ESPNOW_CMD_PENDING_LEN];
+    volatile uint8_t rx_head, rx_count;
+
+    // Sequence numbers handled of each peer in its session, bit i of the
+    // masks stands for `last - i`, so commands arriving out of order
+    // still run once
+    struct History {
+        bool valid;
+        uint16_t session;
+        uint16_t last;
+        uint32_t done;
+        uint32_t rejected;
+    } history[COMMAND_CHANNEL_PEERS];
+
+    // Acks to resend for duplicated commands
+    struct Ack {
+        uint8_t peer;
+        uint16_t session;
+        uint16_t seq;
+        uint8_t status;
+    } resend[ESPNOW_CMD_PENDING_LEN];
+    volatile uint8_t resend_count;
+
+    /* Return the status of a handled command, or -1 if it is new. A *
+     * number too old for the window is rejected, never run again.   */
+    int8_t lookup(uint8_t peer, uint16_t session, uint16_t seq);
+    void record(uint8_t peer,
+                uint16_t session,
+                uint16_t seq,
+                uint8_t status);
+
+    void sendAck(uint8_t peer,
+                 uint16_t session,
+                 uint16_t seq,
+                 uint8_t status);
+
+public:
+    uint32_t resent;  // Frames sent again after timeout
+
+    CommandChannel(Transport *t);
+
+    void onReport(command_report_t cb, void *ctx);
+
+    /* Queue a command to a peer and send it at once. Return false if *
+     * the pending table is full.                                      */
+    bool send(uint8_t peer, const char *cmd);
+
+    /* Start a new sequence number, call it once per command before   *
+     * sending it to several peers.                                    */
+    uint16_t next();
+
+    /* Resend timeout commands and report acks, put this in loop(). */
+    void update();
+
+    /* Return the oldest received command not executed yet. */
+    const char *fetch();
+
+    /* Ack the fetched command after executing it. */
+    void ack(COMMAND_STATUS status = COMMAND_EXECUTED);
+
+    /* Feed a received frame, return false if it is not a command frame. */
+    bool onFrame(uint8_t peer, const uint8_t *data, uint8_t length);
+};
+
+#endif
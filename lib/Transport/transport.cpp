@@ -0,0 +1,161 @@
+#include "transport.h"
+
+#ifndef ARDUINO
+#include <chrono>
+#include <random>
+
+uint32_t transport_micros()
+{
+    static const auto start = std::chrono::steady_clock::now();
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+               std::chrono::steady_clock::now() - start)
+        .count();
+}
+
+uint32_t transport_random()
+{
+    static std::random_device device;
+    return device();
+}
+#endif
+
+Transport::Transport() : recv_cb(NULL), recv_ctx(NULL) {}
+
+void Transport::onReceive(transport_recv_t cb, void *ctx)
+{
+    recv_cb = cb;
+    recv_ctx = ctx;
+}
+
+void Transport::deliver(uint8_t peer, const uint8_t *data, uint8_t length)
+{
+    if (recv_cb)
+        recv_cb(recv_ctx, peer, data, length);
+}
+
+bool Transport::send_text(uint8_t peer, const char *text)
+{
+    size_t remain = strlen(text);
+    bool success = true;
+    do {
+        const uint8_t size =
+            remain > TRANSPORT_TEXT_CHUNK ? TRANSPORT_TEXT_CHUNK : remain;
+        success &= send(peer, (const uint8_t *) text, size);
+        text += size;
+        remain -= size;
+    } while (remain);
+    return success;
+}
+
+TextAssembler::TextAssembler() : length(0), overflow(0)
+{
+    buf[0] = 0;
+}
+
+void TextAssembler::append(const uint8_t *data, uint8_t size)
+{
+    if (length + size >= TRANSPORT_TEXT_BUFFER) {
+        // The end of the message was lost, drop the broken part
+        overflow++;
+        length = 0;
+    }
+    memcpy(buf + length, data, size);
+    length += size;
+    buf[length] = 0;
+}
+
+char *TextAssembler::fetch()
+{
+    // end of message
+    if (length && buf[length - 1] == '\n')
+        return buf;
+    return NULL;
+}
+
+void TextAssembler::clear()
+{
+    length = 0;
+    buf[0] = 0;
+}
+
+#ifndef ARDUINO
+LoopbackTransport::LoopbackTransport(uint8_t self, uint32_t seed)
+    : stats(),
+      self(self),
+      order(0),
+      remotes(),
+      last_due(),
+      imp(),
+      rng(seed)
+{
+}
+
+void LoopbackTransport::connect(uint8_t peer, LoopbackTransport *remote)
+{
+    if (peer < TRANSPORT_MAX_PEERS)
+        remotes[peer] = remote;
+}
+
+void LoopbackTransport::setImpairment(const Impairment &imp)
+{
+    this->imp = imp;
+}
+
+bool LoopbackTransport::send(uint8_t peer, const uint8_t *data, uint8_t length)
+{
+    if (peer >= TRANSPORT_MAX_PEERS || !remotes[peer] ||
+        length > TRANSPORT_MAX_FRAME)
+        return false;
+    stats.sent++;
+
+    std::uniform_real_distribution<float> chance(0, 1);
+    if (chance(rng) < imp.loss) {
+        stats.lost++;
+        return true;  // Lost on air, the sender cannot tell
+    }
+    uint32_t due = transport_micros() + imp.delay;
+    if (imp.jitter)
+        due += rng() % imp.jitter;
+    // Jitter alone keeps the air order, only `reorder` breaks it
+    if ((int32_t) (last_due[peer] - due) > 0)
+        due = last_due[peer];
+    last_due[peer] = due;
+    if (chance(rng) < imp.reorder) {
+        stats.reordered++;
+        due += imp.hold;
+    }
+    remotes[peer]->enqueue(self, data, length, due);
+    return true;
+}
+
+void LoopbackTransport::enqueue(uint8_t from,
+                                const uint8_t *data,
+                                uint8_t length,
+                                uint32_t due)
+{
+    Frame f;
+    f.due = due;
+    f.order = order++;
+    f.peer = from;
+    f.length = length;
+    memcpy(f.data, data, length);
+    inbox.push(f);
+}
+
+void LoopbackTransport::poll()
+{
+    const uint32_t now = transport_micros();
+    while (!inbox.empty() && (int32_t) (now - inbox.top().due) >= 0) {
+        // Copy out first, the receiver may send and enqueue again
+        Frame f = inbox.top();
+        inbox.pop();
+        stats.delivered++;
+        deliver(f.peer, f.data, f.length);
+    }
+}
+
+size_t LoopbackTransport::inflight() const
+{
+    return inbox.size();
+}
+#endif
@@ -0,0 +1,171 @@
+/*
+ * This library abstracts the link between boards, so the framing and
+ * command logic above it run the same on ESP-NOW and on the host.
+ * Including
+ * 1. Transport interface with text fragmentation
+ * 2. Text reassembly for '\n' terminated messages
+ * 3. Loopback transport with loss, reordering and delay (host only)
+ *
+ * Require: a subclass calling deliver() for every received frame
+ * Return:
+ */
+
+#ifndef _TRANSPORT_H
+#define _TRANSPORT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifdef ARDUINO
+#include <Arduino.h>
+#endif
+
+#define TRANSPORT_MAX_FRAME 250   // ESP-NOW payload limit
+#define TRANSPORT_TEXT_CHUNK 200  // Text bytes per frame
+#define TRANSPORT_TEXT_BUFFER 2048
+#define TRANSPORT_MAX_PEERS 8
+
+/* Microsecond clock shared by the timeouts and latency stats */
+#ifdef ARDUINO
+inline uint32_t transport_micros()
+{
+    return micros();
+}
+#else
+uint32_t transport_micros();
+#endif
+
+/* A random word, from the hardware RNG on the ESP chips */
+#ifdef ARDUINO
+inline uint32_t transport_random()
+{
+#ifdef ESP32
+    return esp_random();
+#else
+    return RANDOM_REG32;
+#endif
+}
+#else
+uint32_t transport_random();
+#endif
+
+typedef void (*transport_recv_t)(void *ctx,
+                                 uint8_t peer,
+                                 const uint8_t *data,
+                                 uint8_t length);
+
+class Transport
+{
+private:
+    transport_recv_t recv_cb;
+    void *recv_ctx;
+
+protected:
+    /* Subclasses hand every received frame to the receiver here. */
+    void deliver(uint8_t peer, const uint8_t *data, uint8_t length);
+
+public:
+    Transport();
+
+    /* Send one frame (up to TRANSPORT_MAX_FRAME bytes) to a peer. */
+    virtual bool send(uint8_t peer, const uint8_t *data, uint8_t length) = 0;
+
+    /* Deliver the frames due now, for transports without interrupts. */
+    virtual void poll() {}
+
+    void onReceive(transport_recv_t cb, void *ctx);
+
+    /* Split the text into TRANSPORT_TEXT_CHUNK frames. */
+    bool send_text(uint8_t peer, const char *text);
+};
+
+/* Collect text frames until the message ends with '\n' */
+class TextAssembler
+{
+private:
+    char buf[TRANSPORT_TEXT_BUFFER];
+    size_t length;
+
+public:
+    uint32_t overflow;  // Frames dropped for lack of space
+
+    TextAssembler();
+
+    void append(const uint8_t *data, uint8_t size);
+
+    /* Return the whole message, or NULL if it is not complete yet. */
+    char *fetch();
+    void clear();
+};
+
+#ifndef ARDUINO
+#include <queue>
+#include <random>
+#include <vector>
+
+/* In-process link for host builds. Every send is queued into the   *
+ * remote inbox with the configured delay, and poll() on the remote *
+ * delivers it once due.                                            */
+class LoopbackTransport : public Transport
+{
+public:
+    struct Impairment {
+        float loss;       // Probability of dropping a frame
+        float reorder;    // Probability of holding a frame back
+        uint32_t delay;   // us, base latency
+        uint32_t jitter;  // us, uniform extra latency
+        uint32_t hold;    // us, extra latency of a reordered frame
+    };
+
+    struct Stats {
+        uint32_t sent;
+        uint32_t lost;
+        uint32_t reordered;
+        uint32_t delivered;
+    } stats;
+
+    LoopbackTransport(uint8_t self, uint32_t seed = 1);
+
+    /* Frames sent to `peer` go to `remote`, which sees them from us. */
+    void connect(uint8_t peer, LoopbackTransport *remote);
+    void setImpairment(const Impairment &imp);
+
+    virtual bool send(uint8_t peer, const uint8_t *data, uint8_t length);
+    virtual void poll();
+
+    /* Number of frames still on the way to this node. */
+    size_t inflight() const;
+
+private:
+    struct Frame {
+        uint32_t due;
+        uint32_t order;
+        uint8_t peer;
+        uint8_t length;
+        uint8_t data[TRANSPORT_MAX_FRAME];
+    };
+    struct Later {
+        bool operator()(const Frame &a, const Frame &b) const
+        {
+            const int32_t d = a.due - b.due;
+            return d != 0 ? d > 0 : a.order > b.order;
+        }
+    };
+
+    uint8_t self;
+    uint32_t order;
+    LoopbackTransport *remotes[TRANSPORT_MAX_PEERS];
+    uint32_t last_due[TRANSPORT_MAX_PEERS];
+    Impairment imp;
+    std::mt19937 rng;
+    std::priority_queue<Frame, std::vector<Frame>, Later> inbox;
+
+    void enqueue(uint8_t from,
+                 const uint8_t *data,
+                 uint8_t length,
+                 uint32_t due);
+};
+#endif
+
+#endif
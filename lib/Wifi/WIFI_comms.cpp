@@ -6,7 +6,62 @@ static uint8_t groundMac[] = {0xBC, 0xFF, 0x4D, 0x18, 0xF5, 0xF6};
 static uint8_t ignitorMac[] = {0xE8, 0xDB, 0x84, 0x94, 0x17, 0xB2};
 static uint8_t vehicleMAC[] = {0x98, 0xCD, 0xAC, 0x23, 0xD2, 0x33};
 
-wifiServer::wifiServer() : server(80), webSocket(81), message(""), dB(0) {}
+#ifdef USE_ESPNOW_COMMUNICATION
+static uint8_t *peers[PEER_NUM] = {groundMac, ignitorMac, vehicleMAC};
+
+static EspNowTransport espnow;
+static CommandChannel channel(&espnow);
+static TextAssembler espnow_message;
+
+static void onFrame(void *ctx,
+                    uint8_t peer,
+                    const uint8_t *data,
+                    uint8_t length);
+static void onReport(void *ctx,
+                     uint8_t peer,
+                     uint16_t seq,
+                     COMMAND_STATUS status,
+                     uint32_t rtt);
+#endif
+
+/* Catch-all of the web files, registered after the other routes. The *
+ * async server drops every request header that no handler asked for  *
+ * in canHandle(), If-None-Match is kept here for the 304 of an asset. */
+class WebFileHandler : public AsyncWebHandler
+{
+private:
+    wifiServer *web;
+
+public:
+    WebFileHandler(wifiServer *_web) : web(_web) {}
+
+    virtual bool canHandle(AsyncWebServerRequest *request)
+    {
+        request->addInterestingHeader("If-None-Match");
+        return true;
+    }
+
+    virtual void handleRequest(AsyncWebServerRequest *request)
+    {
+        // handleFileRead() has sent the response if it succeeded
+        if (!web->handleFileRead(request)) {
+            request->send(404, "text/plain", "FileNotFound");
+        }
+    }
+};
+
+wifiServer::wifiServer()
+    : asset_count(0),
+      server(80),
+      wsServer(81),
+      webSocket("/"),
+      message(""),
+      dB(0),
+      ws_policy(WIFI_WS_DROP_POLICY)
+{
+    for (auto &q : ws_clients)
+        q.active = false;
+}
 
 bool wifiServer::init(const char *ssid /*=WIFI_SSID*/,
                       const char *passward /*=WIFI_PASSWARD*/)
@@ -34,26 +89,25 @@ bool wifiServer::init(const char *ssid /*=WIFI_SSID*/,
 #endif
     Serial.println(String("\nMAC Address: ") + WiFi.macAddress());
 
-    server.onNotFound(
-        [=]() {  //[=] lambda expression calling all variables by value
-            // server.uri() --> server get request path from client
-            if (!handleFileRead(server.uri())) {
-                server.send(404, "text/plain", "FileNotFound");
-            } else {
-                server.send(200);  // 200 means OK
-            }
-        });
+    loadAssets();
 
     // List current file on board by using "/list" link
-    server.on("/list", [=]() { server.send(200, "text/plain", listFile()); });
+    server.on("/list", HTTP_GET, [=](AsyncWebServerRequest *request) {
+        request->send(200, "text/plain", listFile());
+    });
+
+    // Every other path is a file, the handlers are tried in order
+    server.addHandler(new WebFileHandler(this));
 
     // WebSocketEvent waits for webSocket client to send command
     webSocket.onEvent(std::bind(&wifiServer::webSocketEvent, this,
                                 std::placeholders::_1, std::placeholders::_2,
-                                std::placeholders::_3, std::placeholders::_4));
+                                std::placeholders::_3, std::placeholders::_4,
+                                std::placeholders::_5, std::placeholders::_6));
+    wsServer.addHandler(&webSocket);
 
     // Start wesocket and server service
-    webSocket.begin();
+    wsServer.begin();
     server.begin();
 
 #ifdef USE_ESPNOW_COMMUNICATION
@@ -67,6 +121,8 @@ bool wifiServer::init(const char *ssid /*=WIFI_SSID*/,
     esp_now_set_self_role(ESP_NOW_ROLE_COMBO);
     esp_now_register_send_cb(onDataSend);
     esp_now_register_recv_cb(onDataRecv);
+    espnow.onReceive(onFrame, NULL);
+    channel.onReport(onReport, NULL);
 
     // Register peer
     esp_now_add_peer(ignitorMac, ESP_NOW_ROLE_COMBO, 1, NULL, 0);
@@ -77,108 +133,185 @@ bool wifiServer::init(const char *ssid /*=WIFI_SSID*/,
     return true;  // If all things operate successfully
 }
 
-bool wifiServer::handleFileRead(String path)
+void wifiServer::loadAssets()
+{
+    asset_count = 0;
+    Dir dir = filesystem->openDir("/");
+    while (dir.next() && asset_count < WIFI_ASSET_TABLE_LEN) {
+        String path = "/" + dir.fileName();
+        // Logged data keeps changing, leave them to the fallback path
+        if (path.startsWith(String("/") + LOGGER_FILENAME))
+            continue;
+        bool gz = path.endsWith(".gz");
+        if (gz)
+            path.remove(path.length() - 3);
+
+        // The gzip version wins if both of them exist
+        web_asset_t *asset = (web_asset_t *) findAsset(path);
+        if (asset && !gz)
+            continue;
+        if (!asset)
+            asset = &assets[asset_count++];
+
+        asset->path = path;
+        asset->gz = gz;
+        asset->size = dir.fileSize();
+        asset->mime = getContentType(path);
+
+        // FNV-1a over name, size and modified time
+        uint32_t hash = 2166136261u;
+        auto mix = [&hash](uint32_t v) {
+            for (int i = 0; i < 4; i++) {
+                hash ^= (v >> (8 * i)) & 0xFF;
+                hash *= 16777619u;
+            }
+        };
+        for (size_t i = 0; i < path.length(); i++)
+            mix(path[i]);
+        mix(gz);
+        mix(asset->size);
+        mix(dir.fileTime());
+        snprintf(asset->etag, sizeof(asset->etag), "\"%08x\"", hash);
+    }
+    Serial.printf("Web assets loaded: %u\n", asset_count);
+}
+
+const web_asset_t *wifiServer::findAsset(const String &path)
+{
+    for (uint8_t i = 0; i < asset_count; i++) {
+        if (assets[i].path == path)
+            return &assets[i];
+    }
+    return NULL;
+}
+
+bool wifiServer::handleFileRead(AsyncWebServerRequest *request)
 {
-    Serial.println("handleFileRead: " + path);
+    String path = request->url();
     // If server request end with "/", then auto direct to "index.html"
     if (path.endsWith("/")) {
         path += "index.html";
     }
-    String contentType = getContentType(path);  // Get file type
-    String pathWithGz = path + ".gz";
-    if (filesystem->exists(pathWithGz) || filesystem->exists(path)) {
-        if (filesystem->exists(pathWithGz)) {
-            path += ".gz";
+    const bool download = request->hasArg("download");
+
+    // The response reads the file in chunks from the TCP callbacks, so
+    // a long download never holds up loop()
+    AsyncWebServerResponse *response;
+    const web_asset_t *asset = findAsset(path);
+    if (asset) {
+        // Let the browser revalidate, a matching ETag costs only a 304
+        if (request->header("If-None-Match") == asset->etag) {
+            response = request->beginResponse(304);
+        } else {
+            File file = filesystem->open(asset->gz ? path + ".gz" : path, "r");
+            if (!file)
+                return false;
+            response = request->beginResponse(
+                file, path,
+                download ? "application/octet-stream" : asset->mime,
+                download);
         }
+        response->addHeader("ETag", asset->etag);
+        response->addHeader("Cache-Control", "no-cache");
+    } else {
+        // Files created after startup, such as the logged data
+        Serial.println("handleFileRead: " + path);
         File file = filesystem->open(path, "r");  // Open file by path
-        server.sendHeader("Access-Control-Allow-Origin", "*");
-        server.streamFile(file, contentType);  // stream the file to all clients
-        file.close();
-        return true;
+        if (!file)
+            return false;
+        response = request->beginResponse(
+            file, path,
+            download ? "application/octet-stream" : getContentType(path),
+            download);
     }
-    return false;
+    response->addHeader("Access-Control-Allow-Origin", "*");
+    request->send(response);
+    return true;
 }
 
-String wifiServer::getContentType(String filename)
+const char *wifiServer::getContentType(const String &filename)
 {  // identify sub-file-name and return
     // the corespond content-type
-    if (server.hasArg("download")) {
-        // if server request has argument "download" or not
-        return "application/octet-stream";
-    } else if (filename.endsWith(".htm")) {
-        return "text/html";
-    } else if (filename.endsWith(".html")) {
-        return "text/html";
-    } else if (filename.endsWith(".css")) {
-        return "text/css";
-    } else if (filename.endsWith(".js")) {
-        return "application/javascript";
-    } else if (filename.endsWith(".png")) {
-        return "image/png";
-    } else if (filename.endsWith(".gif")) {
-        return "image/gif";
-    } else if (filename.endsWith(".jpg")) {
-        return "image/jpeg";
-    } else if (filename.endsWith(".ico")) {
-        return "image/x-icon";
-    } else if (filename.endsWith(".xml")) {
-        return "text/xml";
-    } else if (filename.endsWith(".pdf")) {
-        return "application/x-pdf";
-    } else if (filename.endsWith(".zip")) {
-        return "application/x-zip";
-    } else if (filename.endsWith(".gz")) {
-        return "application/x-gzip";
+    static const struct {
+        const char *ext;
+        const char *mime;
+    } types[] = {
+        {".htm", "text/html"},         {".html", "text/html"},
+        {".css", "text/css"},          {".js", "application/javascript"},
+        {".png", "image/png"},         {".gif", "image/gif"},
+        {".jpg", "image/jpeg"},        {".ico", "image/x-icon"},
+        {".xml", "text/xml"},          {".pdf", "application/x-pdf"},
+        {".zip", "application/x-zip"}, {".gz", "application/x-gzip"},
+    };
+    for (const auto &t : types) {
+        if (filename.endsWith(t.ext))
+            return t.mime;
     }
     return "text/plain";
 }
 
-void wifiServer::webSocketEvent(uint8_t num,
-                                WStype_t type,
+void wifiServer::webSocketEvent(AsyncWebSocket *ws,
+                                AsyncWebSocketClient *client,
+                                AwsEventType type,
+                                void *arg,
                                 uint8_t *payload,
                                 size_t length)
 {
+    const uint32_t num = client->id();
     String device;
     switch (type) {
     // If websocket is disconnected
-    case WStype_DISCONNECTED:
+    case WS_EVT_DISCONNECT: {
+        ws_queue_t *q = ws_find(num);
+        if (q)
+            q->active = false;
         Serial.printf("[%u] Disconnected!\n", num);
         device = String(num) + " disconnected";
-        webSocket.broadcastTXT(device);
+        ws_broadcast(device.c_str(), WS_COMMAND);
         message = "disconnected";
-        break;
+    } break;
     // If websocket is connected
-    case WStype_CONNECTED: {
-        IPAddress ip = webSocket.remoteIP(num);
-        Serial.printf("[%u] Connected from %d.%d.%d.%d url: %s\n", num, ip[0],
-                      ip[1], ip[2], ip[3], payload);
+    case WS_EVT_CONNECT: {
+        ws_queue_t *q = ws_find(0);  // Find a free slot
+        if (!q) {
+            client->close();
+            break;
+        }
+        q->active = true;
+        q->id = num;
+        q->t_head = q->t_count = 0;
+        q->c_head = q->c_count = 0;
+        q->dropped = q->refused = 0;
+        q->bytes = q->bytes_window = q->rate = 0;
+        IPAddress ip = client->remoteIP();
+        Serial.printf("[%u] Connected from %d.%d.%d.%d\n", num, ip[0], ip[1],
+                      ip[2], ip[3]);
 
         // Send message to client
         device = String(num) + " has connected";
-        webSocket.broadcastTXT(device);
+        ws_broadcast(device.c_str(), WS_COMMAND);
         message = "connected";
     } break;
-    // If websocket get text message (Use this as command)
-    case WStype_TEXT:
-        Serial.printf("[%u] : %s\n", num, payload);
-        message = (const char *) payload;
+    // If websocket get data (Use text as command)
+    case WS_EVT_DATA: {
+        AwsFrameInfo *info = (AwsFrameInfo *) arg;
+        // Commands are short, ignore fragmented frames
+        if (!info->final || info->index != 0 || info->len != length)
+            break;
+        if (info->opcode == WS_TEXT) {
+            message = "";
+            message.concat((const char *) payload, length);
+            Serial.printf("[%u] : %s\n", num, message.c_str());
 
-        if (message[0] == 'w') {
-            dB = message.substring(2).toInt();
+            if (message[0] == 'w') {
+                dB = message.substring(2).toInt();
+            }
+        } else {
+            Serial.printf("[%u] get binary length: %u\n", num, length);
+            hexdump(payload, length);
         }
-        // Send message to client
-        // webSocket.sendTXT(num, "message here");
-
-        // Send data to all connected clients
-        // webSocket.broadcastTXT("message here");
-        break;
-    // If websocket get binary message
-    case WStype_BIN:
-        Serial.printf("[%u] get binary length: %u\n", num, length);
-        hexdump(payload, length);
-
-        // Send message to client
-        // webSocket.sendBIN(num, payload, length);
+    } break;
+    default:
         break;
     }
 }
@@ -186,53 +319,131 @@ void wifiServer::webSocketEvent(uint8_t num,
 // This section is for sending data to client
 // cleanMsg is default true, it will auto clean the message
 // Turn it off if you don't want message be cleaned after calling it
-bool wifiServer::wifi_send(uint8_t num, String payload, bool cleanMsg)
+bool wifiServer::wifi_send(uint32_t num, String payload, bool cleanMsg)
 {
-#ifdef USE_WIFI_COMMUNICATION
-    bool success = webSocket.sendTXT(num, payload);
+    return wifi_send(num, payload.c_str(), cleanMsg);
+}
+bool wifiServer::wifi_send(uint32_t num, const char *payload, bool cleanMsg)
+{
+    ws_queue_t *q = ws_find(num);
+    bool success = q && ws_push(q, payload, WS_COMMAND);
+    ws_flush();
     if (success && cleanMsg)
         message = "";
     return success;
-#endif
 }
-bool wifiServer::wifi_send(uint8_t num, const char *payload, bool cleanMsg)
+
+ws_queue_t *wifiServer::ws_find(uint32_t id)
 {
-#ifdef USE_WIFI_COMMUNICATION
-    bool success = webSocket.sendTXT(num, payload);
-    if (success && cleanMsg)
-        message = "";
+    for (auto &q : ws_clients) {
+        // id 0 is never used by AsyncWebSocket, it finds a free slot
+        if (id ? (q.active && q.id == id) : !q.active)
+            return &q;
+    }
+    return NULL;
+}
+
+bool wifiServer::ws_push(ws_queue_t *q, const char *payload, WS_MSG_TYPE type)
+{
+    if (type == WS_TELEMETRY) {
+        if (q->t_count == WIFI_WS_TELEMETRY_LEN) {
+            q->dropped++;
+            if (ws_policy == WS_DROP_NEWEST)
+                return false;
+            q->t_head = (q->t_head + 1) % WIFI_WS_TELEMETRY_LEN;
+            q->t_count--;
+        }
+        // Assigning into the slot reuses its buffer
+        q->telemetry[(q->t_head + q->t_count++) % WIFI_WS_TELEMETRY_LEN] =
+            payload;
+    } else {
+        // Never drop a command response, report it to the caller
+        if (q->c_count == WIFI_WS_COMMAND_LEN) {
+            q->refused++;
+            return false;
+        }
+        q->command[(q->c_head + q->c_count++) % WIFI_WS_COMMAND_LEN] =
+            payload;
+    }
+    return true;
+}
+
+bool wifiServer::ws_broadcast(const char *payload, WS_MSG_TYPE type)
+{
+    bool success = false;
+    for (auto &q : ws_clients) {
+        if (q.active)
+            success |= ws_push(&q, payload, type);
+    }
+    ws_flush();
     return success;
-#endif
 }
 
-bool wifiServer::wifi_broadcast(const String &payload, bool cleanMsg)
+void wifiServer::ws_flush()
+{
+    for (auto &q : ws_clients) {
+        if (!q.active)
+            continue;
+        AsyncWebSocketClient *client = webSocket.client(q.id);
+        if (!client || client->status() != WS_CONNECTED)
+            continue;
+        // Command responses go ahead of telemetry
+        while ((q.c_count || q.t_count) && client->canSend()) {
+            String *msg;
+            if (q.c_count) {
+                msg = &q.command[q.c_head];
+                q.c_head = (q.c_head + 1) % WIFI_WS_COMMAND_LEN;
+                q.c_count--;
+            } else {
+                msg = &q.telemetry[q.t_head];
+                q.t_head = (q.t_head + 1) % WIFI_WS_TELEMETRY_LEN;
+                q.t_count--;
+            }
+            client->text(*msg);
+            q.bytes += msg->length();
+            q.bytes_window += msg->length();
+        }
+    }
+}
+
+String wifiServer::wsStats()
 {
-    return wifi_broadcast(payload.c_str(), cleanMsg);
+    String stats = "ws clients:\n";
+    for (auto &q : ws_clients) {
+        if (!q.active)
+            continue;
+        stats += String("[") + q.id + "] queued:" + q.t_count + "/" +
+                 q.c_count + ",dropped:" + q.dropped +
+                 ",refused:" + q.refused + ",bytes:" + q.bytes +
+                 ",rate:" + q.rate + "B/s\n";
+    }
+    stats += String("policy:") +
+             (ws_policy == WS_DROP_OLDEST ? "drop oldest" : "drop newest");
+    return stats;
 }
 
-bool wifiServer::wifi_broadcast(const char *payload, bool cleanMsg)
+bool wifiServer::wifi_broadcast(const String &payload,
+                                bool cleanMsg,
+                                WS_MSG_TYPE type)
+{
+    return wifi_broadcast(payload.c_str(), cleanMsg, type);
+}
+
+bool wifiServer::wifi_broadcast(const char *payload,
+                                bool cleanMsg,
+                                WS_MSG_TYPE type)
 {
     bool success = false;
 #ifdef USE_WIFI_COMMUNICATION
-    success |= webSocket.broadcastTXT(payload);
+    success |= ws_broadcast(payload, type);
 #endif
 #ifdef USE_ESPNOW_COMMUNICATION
-    const size_t max_size = 200;
-    size_t partition = strlen(payload) / max_size + 1;
-    for (size_t i = 0; i < partition; i++) {
 #ifdef GROUND_STATION
-        success |= esp_now_send(
-            vehicleMAC, (u8 *) payload + (max_size * i),
-            i == partition - 1 ? (strlen(payload) % max_size) : max_size);
-        success |= esp_now_send(
-            ignitorMac, (u8 *) payload + (max_size * i),
-            i == partition - 1 ? (strlen(payload) % max_size) : max_size);
+    success |= espnow.send_text(PEER_VEHICLE, payload);
+    success |= espnow.send_text(PEER_IGNITOR, payload);
 #else
-        success |= esp_now_send(
-            groundMac, (u8 *) payload + (max_size * i),
-            i == partition - 1 ? (strlen(payload) % max_size) : max_size);
+    success |= espnow.send_text(PEER_GROUND, payload);
 #endif
-    }
 #endif
     if (success && cleanMsg)
         message = "";
@@ -242,14 +453,64 @@ bool wifiServer::wifi_broadcast(const char *payload, bool cleanMsg)
 void wifiServer::loop()
 {
 #ifndef USE_ESPNOW_COMMUNICATION
-    server.handleClient();  // Loop for server
-    webSocket.loop();       // Loop for websocket
-    MDNS.update();          // For muiltipule clients to connect
+    // HTTP and websocket are served in the async callbacks
+    ws_flush();  // Send the frames left by the busy clients
+    static unsigned long last_cleanup = 0;
+    if (millis() - last_cleanup > 1000) {
+        webSocket.cleanupClients();  // Drop the closed clients
+        for (auto &q : ws_clients) {
+            q.rate = q.bytes_window;
+            q.bytes_window = 0;
+        }
+        last_cleanup = millis();
+    }
+    MDNS.update();  // For muiltipule clients to connect
+#else
+    updateESPNOWCommand();  // Resend the commands not acked
 #endif
 }
 
 #ifdef USE_ESPNOW_COMMUNICATION
-static char message[2048] = {0};
+bool EspNowTransport::send(uint8_t peer, const uint8_t *data, uint8_t length)
+{
+    if (peer >= PEER_NUM)
+        return false;
+    return esp_now_send(peers[peer], (u8 *) data, length) == 0;
+}
+
+void EspNowTransport::receive(const uint8_t *mac_addr,
+                              const uint8_t *payload,
+                              uint8_t length)
+{
+    for (uint8_t i = 0; i < PEER_NUM; i++) {
+        if (memcmp(mac_addr, peers[i], 6) == 0) {
+            deliver(i, payload, length);
+            return;
+        }
+    }
+}
+
+// Command frames go to the channel, the others are the text stream
+static void onFrame(void *ctx,
+                    uint8_t peer,
+                    const uint8_t *data,
+                    uint8_t length)
+{
+    if (!channel.onFrame(peer, data, length))
+        espnow_message.append(data, length);
+}
+
+static void onReport(void *ctx,
+                     uint8_t peer,
+                     uint16_t seq,
+                     COMMAND_STATUS status,
+                     uint32_t rtt)
+{
+    static const char *result[] = {"executed", "rejected", "lost"};
+    Serial.printf("ESP-NOW: cmd %u to peer %u %s, rtt %u us\n", seq, peer,
+                  result[status], rtt);
+}
+
 void onDataSend(uint8_t *mac_addr, uint8_t status)
 {
     if (status)
@@ -258,25 +519,48 @@ void onDataSend(uint8_t *mac_addr, uint8_t status)
 
 void onDataRecv(uint8_t *mac_addr, uint8_t *payload, uint8_t length)
 {
-    payload[length] = 0;
-    strcat(message, (char *) payload);
+    espnow.receive(mac_addr, payload, length);
 }
 
 char *fetchESPNOWMessage()
 {
-    // end of command
-    static uint8_t EOC;
-    EOC = message[strlen(message) - 1] == '\n';
-    if (EOC)
-        return message;
-    else
-        return NULL;
+    return espnow_message.fetch();
 }
 
 void clearESPNOWMessage()
 {
-    message[0] = 0;
+    espnow_message.clear();
 }
+
+bool sendESPNOWCommand(const char *cmd)
+{
+    bool success = true;
+    channel.next();
+#ifdef GROUND_STATION
+    success &= channel.send(PEER_VEHICLE, cmd);
+    success &= channel.send(PEER_IGNITOR, cmd);
+#else
+    success &= channel.send(PEER_GROUND, cmd);
 #endif
+    if (!success)
+        Serial.println("ESP-NOW: Command table full");
+    return success;
+}
 
-#endif
\ No newline at end of file
+void updateESPNOWCommand()
+{
+    channel.update();
+}
+
+const char *fetchESPNOWCommand()
+{
+    return channel.fetch();
+}
+
+void ackESPNOWCommand(COMMAND_STATUS status)
+{
+    channel.ack(status);
+}
+#endif
+
+#endif
@@ -16,34 +16,116 @@
 #include <logger.h>
 #include "../../include/configs.h"
 #ifdef USE_WIFI_COMMUNICATION
-#include <ESP8266WebServer.h>
 #include <ESP8266WiFi.h>
 #include <ESP8266mDNS.h>
-#include <Hash.h>
-#include <WebSocketsServer.h>
+#include <ESPAsyncTCP.h>
+#include <ESPAsyncWebServer.h>
 #ifdef USE_ESPNOW_COMMUNICATION
+#include <command_channel.h>
 #include <espnow.h>
+#include <transport.h>
+
+enum ESPNOW_PEER { PEER_GROUND, PEER_IGNITOR, PEER_VEHICLE, PEER_NUM };
+
+/* Transport over ESP-NOW, peers are indexed by ESPNOW_PEER */
+class EspNowTransport : public Transport
+{
+public:
+    virtual bool send(uint8_t peer, const uint8_t *data, uint8_t length);
+
+    /* Map the sender MAC to the peer and hand the frame over. */
+    void receive(const uint8_t *mac_addr,
+                 const uint8_t *payload,
+                 uint8_t length);
+};
+
 char *fetchESPNOWMessage();
 void clearESPNOWMessage();
 void onDataSend(uint8_t *mac_addr, uint8_t status);
 void onDataRecv(uint8_t *mac_addr, uint8_t *payload, uint8_t length);
+
+/* Send a command to the partner boards through the CommandChannel,   *
+ * it is resent every ESPNOW_CMD_TIMEOUT ms until acked or            *
+ * ESPNOW_CMD_MAX_RETRIES fails. Return false if the table is full.   */
+bool sendESPNOWCommand(const char *cmd);
+
+/* Resend timeout commands and report acks, put this in loop(). */
+void updateESPNOWCommand();
+
+/* Return the received command which has not been executed yet. */
+const char *fetchESPNOWCommand();
+
+/* Ack the fetched command after executing it. Duplicates of the same *
+ * sequence number are answered with this ack without re-executing.   */
+void ackESPNOWCommand(COMMAND_STATUS status = COMMAND_EXECUTED);
 #endif
 
+/* Web file information collected once at startup */
+typedef struct web_asset {
+    String path;       // Request path, without ".gz"
+    bool gz;           // Stored as path + ".gz"
+    size_t size;       // Stored file size
+    const char *mime;  // Content type of the request path
+    char etag[11];     // Quoted 32-bit hash
+} web_asset_t;
+
+/* Telemetry may be dropped when a client falls behind, command *
+ * responses are always delivered in order.                      */
+enum WS_MSG_TYPE { WS_TELEMETRY, WS_COMMAND };
+enum WS_DROP_POLICY { WS_DROP_OLDEST, WS_DROP_NEWEST };
+
+/* Send queue and statistics of a websocket client */
+typedef struct ws_queue {
+    bool active;
+    uint32_t id;
+    String telemetry[WIFI_WS_TELEMETRY_LEN];
+    uint8_t t_head, t_count;
+    String command[WIFI_WS_COMMAND_LEN];
+    uint8_t c_head, c_count;
+    uint32_t dropped;       // Telemetry frames dropped
+    uint32_t refused;       // Command responses refused, queue full
+    uint32_t bytes;         // Total bytes handed to the socket
+    uint32_t bytes_window;  // Bytes in the current second
+    uint32_t rate;          // Bytes per second of the last second
+} ws_queue_t;
+
 class wifiServer : public Logger
 // Inherit from logger.h to use function of file operation
 {
 private:
-    String getContentType(String fileName);
+    const char *getContentType(const String &fileName);
 
-    ESP8266WebServer server;
-    WebSocketsServer webSocket;
+    web_asset_t assets[WIFI_ASSET_TABLE_LEN];
+    uint8_t asset_count;
+    const web_asset_t *findAsset(const String &path);
+
+    // Both servers run in the ESPAsyncTCP callbacks, a slow client never
+    // blocks loop(). Websocket stays on port 81 for the existing web page.
+    AsyncWebServer server;
+    AsyncWebServer wsServer;
+    AsyncWebSocket webSocket;
+    ws_queue_t ws_clients[WIFI_WS_MAX_CLIENTS];
 
     // WebSocketEvent waits for webSocket client to send command
-    void webSocketEvent(uint8_t num,
-                        WStype_t type,
+    void webSocketEvent(AsyncWebSocket *ws,
+                        AsyncWebSocketClient *client,
+                        AwsEventType type,
+                        void *arg,
                         uint8_t *payload,
                         size_t length);
 
+    ws_queue_t *ws_find(uint32_t id);
+
+    /* Queue the text by the drop policy, return false if not queued. */
+    bool ws_push(ws_queue_t *q, const char *payload, WS_MSG_TYPE type);
+
+    /* Queue the text to every client. A slow client only loses its *
+     * own telemetry frames instead of stalling the others.         */
+    bool ws_broadcast(const char *payload, WS_MSG_TYPE type);
+
+    /* Hand the queued frames to the clients which can take them. */
+    void ws_flush();
+
 public:
     wifiServer(void);
 
@@ -51,16 +133,29 @@ public:
 
     int dB;
 
+    WS_DROP_POLICY ws_policy;
+
     bool init(const char *ssid = WIFI_SSID,
               const char *passward = WIFI_PASSWARD);
 
-    bool handleFileRead(String path);  // Stream file for web client
+    // Stream file for web client
+    bool handleFileRead(AsyncWebServerRequest *request);
+
+    /* Rebuild the web file table, call it after changing web files */
+    void loadAssets();
+
+    bool wifi_send(uint32_t num, String payload, bool cleanMsg = true);
+    bool wifi_send(uint32_t num, const char *payload, bool cleanMsg = true);
 
-    bool wifi_send(uint8_t num, String payload, bool cleanMsg = true);
-    bool wifi_send(uint8_t num, const char *payload, bool cleanMsg = true);
+    bool wifi_broadcast(const String &payload,
+                        bool cleanMsg = true,
+                        WS_MSG_TYPE type = WS_COMMAND);
+    bool wifi_broadcast(const char *payload,
+                        bool cleanMsg = true,
+                        WS_MSG_TYPE type = WS_COMMAND);
 
-    bool wifi_broadcast(const String &payload, bool cleanMsg = true);
-    bool wifi_broadcast(const char *payload, bool cleanMsg = true);
+    /* Queue depth, drops and throughput of each websocket client */
+    String wsStats();
 
     void loop();  // Put this loop to core loop()
 };
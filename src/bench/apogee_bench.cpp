@@ -0,0 +1,241 @@
+/*
+ * Host replay of flights through the apogee detectors:
+ * 1. The old check, velocity_estimate below IMU_FALLING_CRITERIA on one
+ *    sample after the lift off protect time (sensor.pose)
+ * 2. ApogeeDetector, the vote of baro, inertial and peak
+ * Without arguments it replays synthetic flights, sampled at 2 ms with a
+ * baro every 8 ms run through the Kalman filter and the differentiation
+ * of sensors.cpp, the true apogee known. With flight log files (the "f,"
+ * lines the logger writes) it replays those at the log rate, the apogee
+ * taken as the highest smoothed altitude.
+ * Reported is the delay of each detector after the apogee, negative is
+ * early, a deployment at speed.
+ * Exits non-zero if the vote is early or later than 700 ms on any
+ * synthetic flight.
+ *
+ * Run: pio run -e bench_apogee -t exec
+ *      .pio/build/bench_apogee/program flight.txt ...
+ */
+#include <apogee.h>
+#include "../../include/portable_configs.h"
+
+#include <cmath>
+#include <cstdio>
+#include <vector>
+
+#define G 9.80665f
+#define PROTECT (FLIGHT_PROTECT_TIME * 1000UL)  // us, the flown guard
+#define FALLING -0.8f  // m/s, IMU_FALLING_CRITERIA
+#define LATE 700000    // us, the baro filter lags about 450 ms
+
+/* One IMU sample as the sensor task sees it */
+struct Record {
+    uint32_t t;  // us
+    float accUp, height, speed;
+    bool baroNew;
+};
+
+struct Flight {
+    const char *name;
+    std::vector<Record> records;
+    uint32_t liftoff, apogee;  // us
+};
+
+static uint32_t seed = 11;
+
+static float noise(float amplitude)
+{
+    seed = seed * 1103515245 + 12345;
+    return amplitude * (((seed >> 8) % 2001) / 1000.0f - 1);
+}
+
+/* SimpleKalmanFilter(1, 1, 0.01) of sensors.cpp */
+struct Kalman {
+    float err_measure, err_estimate, q, last;
+
+    float update(float mea)
+    {
+        const float gain = err_estimate / (err_estimate + err_measure);
+        const float estimate = last + gain * (mea - last);
+        err_estimate = (1 - gain) * err_estimate + fabsf(last - estimate) * q;
+        last = estimate;
+        return estimate;
+    }
+};
+
+struct Profile {
+    const char *name;
+    float thrust;    // m/s^2
+    uint32_t burn;   // us
+    float drag;      // 1/m
+    float baro;      // m, noise
+    float bias;      // g, accelerometer
+    uint32_t gust;   // us, a 40 ms pressure dip of 15 m, 0 for none
+};
+
+static Flight synthesize(const Profile &p)
+{
+    Flight f = {p.name, std::vector<Record>(), 1000000, 0};
+    Kalman kalman = {1, 1, 0.01f, 0};
+    float height = 0, speed = 0, estimate_last = 0, baro_speed = 0;
+    float baro_height = 0;
+    for (uint32_t t = 0; t < 60000000; t += 2000) {
+        float acc_up = 1;
+        if (t >= f.liftoff) {
+            const float thrust = t < f.liftoff + p.burn ? p.thrust : 0;
+            const float drag = p.drag * speed * fabsf(speed);
+            speed += (thrust - drag - G) * 0.002f;
+            height += speed * 0.002f;
+            acc_up = (thrust - drag) / G;
+            if (!f.apogee && t > f.liftoff + p.burn && speed < 0)
+                f.apogee = t;
+        }
+        const bool baro_new = t % 8000 == 0;
+        if (baro_new) {
+            float reading = height + noise(p.baro);
+            if (p.gust && t >= p.gust && t < p.gust + 40000)
+                reading -= 15;
+            const float estimate = kalman.update(reading);
+            baro_speed = (estimate - estimate_last) / 0.008f;
+            estimate_last = estimate;
+            baro_height = reading;
+        }
+        const Record r = {t, acc_up + p.bias + noise(0.03f), baro_height,
+                          baro_speed, baro_new};
+        f.records.push_back(r);
+        if (f.apogee && t > f.apogee + 3000000)
+            break;
+    }
+    return f;
+}
+
+/* "f,T_plus,height,height_est,speed,ax,ay,az,..." lines of flight() */
+static bool load(const char *path, Flight &f)
+{
+    FILE *in = fopen(path, "r");
+    if (!in)
+        return false;
+    f.name = path;
+    char line[256];
+    float height_last = NAN;
+    while (fgets(line, sizeof(line), in)) {
+        unsigned long ms;
+        float height, est, speed, ax, ay, az;
+        if (sscanf(line, "f,%lu,%f,%f,%f,%f,%f,%f", &ms, &height, &est,
+                   &speed, &ax, &ay, &az) != 7)
+            continue;
+        const Record r = {(uint32_t) (ms * 1000), az, height, speed,
+                          height != height_last};
+        height_last = height;
+        f.records.push_back(r);
+    }
+    fclose(in);
+    if (f.records.size() < 20)
+        return false;
+
+    // Lift off the first of 3 samples over 2.5 g, apogee the highest of
+    // the altitude averaged over 9 samples after it
+    f.liftoff = f.records[0].t;
+    for (size_t i = 2; i < f.records.size(); i++) {
+        if (f.records[i].accUp > 2.5f && f.records[i - 1].accUp > 2.5f &&
+            f.records[i - 2].accUp > 2.5f) {
+            f.liftoff = f.records[i - 2].t;
+            break;
+        }
+    }
+    float best = -1e9f;
+    for (size_t i = 4; i + 4 < f.records.size(); i++) {
+        if (f.records[i].t < f.liftoff)
+            continue;
+        float sum = 0;
+        for (size_t j = i - 4; j <= i + 4; j++)
+            sum += f.records[j].height;
+        if (sum / 9 > best) {
+            best = sum / 9;
+            f.apogee = f.records[i].t;
+        }
+    }
+    return true;
+}
+
+struct Detection {
+    int32_t old_delay, vote_delay;  // us after the apogee
+    uint8_t votes_at;               // Votes that made it
+};
+
+static Detection replay(const Flight &f)
+{
+    Detection d = {INT32_MAX, INT32_MAX, 0};
+    ApogeeDetector apogee;
+    bool started = false;
+    for (const Record &r : f.records) {
+        if (r.t < f.liftoff)
+            continue;
+        if (!started) {
+            apogee.reset(r.t, r.height);
+            started = true;
+            continue;
+        }
+        const bool protect = r.t - f.liftoff <= PROTECT;
+        if (d.old_delay == INT32_MAX && !protect && r.speed < FALLING)
+            d.old_delay = (int32_t) (r.t - f.apogee);
+        const ApogeeInput in = {r.t, r.accUp, r.height, r.speed, r.baroNew};
+        if (apogee.update(in) && !protect && d.vote_delay == INT32_MAX) {
+            d.vote_delay = (int32_t) (r.t - f.apogee);
+            d.votes_at = (apogee.baro.on ? 1 : 0) |
+                         (apogee.inertial.on ? 2 : 0) |
+                         (apogee.peak.on ? 4 : 0);
+        }
+        // Protect time as the flight state machine, vote again after it
+        if (apogee.detected && protect)
+            apogee.detected = false;
+    }
+    return d;
+}
+
+static void report(const Flight &f, const Detection &d)
+{
+    printf("  %-10s apogee %7.3f s  old %+8.1f ms  vote %+8.1f ms  (%s%s%s)"
+           "\n",
+           f.name, f.apogee / 1e6,
+           d.old_delay == INT32_MAX ? NAN : d.old_delay / 1e3,
+           d.vote_delay == INT32_MAX ? NAN : d.vote_delay / 1e3,
+           d.votes_at & 1 ? "baro " : "", d.votes_at & 2 ? "inertial " : "",
+           d.votes_at & 4 ? "peak" : "");
+}
+
+int main(int argc, char **argv)
+{
+    if (argc > 1) {
+        printf("recorded flights, delay after the highest smoothed altitude\n");
+        for (int i = 1; i < argc; i++) {
+            Flight f = {0, std::vector<Record>(), 0, 0};
+            if (!load(argv[i], f)) {
+                printf("  %s: no flight\n", argv[i]);
+                continue;
+            }
+            report(f, replay(f));
+        }
+        return 0;
+    }
+
+    static const Profile profiles[] = {
+        {"nominal", 60, 2500000, 0.0008f, 0.3f, 0, 0},
+        {"low", 30, 1500000, 0.002f, 0.3f, 0, 0},
+        {"noisy", 60, 2500000, 0.0008f, 1.5f, 0, 0},
+        {"gust", 60, 2500000, 0.0008f, 0.3f, 0, 7000000},
+        {"biased", 60, 2500000, 0.0008f, 0.3f, 0.02f, 0},
+        {"high", 120, 3000000, 0.0004f, 0.3f, 0, 0},
+    };
+    printf("synthetic flights, delay after the true apogee\n");
+    bool ok = true;
+    for (const Profile &p : profiles) {
+        const Flight f = synthesize(p);
+        const Detection d = replay(f);
+        report(f, d);
+        ok &= d.vote_delay >= 0 && d.vote_delay <= LATE;
+    }
+    if (!ok)
+        printf("FAILED\n");
+    return ok ? 0 : 1;
+}
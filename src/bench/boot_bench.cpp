@@ -0,0 +1,143 @@
+/*
+ * Host check of the warm boot record of System::init():
+ * 1. A cold boot, RTC memory of random bytes as after a power loss, is
+ *    never taken for a warm one
+ * 2. A record saved after calibration and in flight loads back as it
+ *    was, and counts the warm restarts
+ * 3. Every single bit flipped in the record makes the boot cold
+ * 4. clear(), the restart command and OTA, makes the next boot cold
+ * 5. A sealed record boots warm after a watchdog, exception or brownout
+ *    only, cold after a software restart, the reset pin or a power on
+ * Reported are the waits a warm boot skips, the boot wait of setup() and
+ * the baro calibration, and the time to load the record.
+ * Exits non-zero if any of the checks fails.
+ *
+ * Run: pio run -e bench_boot -t exec
+ */
+#include <warm_boot.h>
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+
+#define BOOT_WAIT 3000                           // ms, configs.h
+#define IMU_BMP_SEA_LEVEL_PRESSURE_SAMPLING 50  // configs.h
+#define CALIBRATE_DELAY 20                      // ms a sample, sensors.cpp
+#define POWER_ONS 100000
+#define LOADS 100000
+
+static uint32_t seed = 5;
+
+static uint8_t next_byte()
+{
+    seed = seed * 1103515245 + 12345;
+    return seed >> 16;
+}
+
+int main()
+{
+    bool ok = true;
+
+    // 1. Power on, the RTC memory holds whatever it came up with
+    uint32_t warm = 0;
+    for (uint32_t i = 0; i < POWER_ONS; i++) {
+        uint8_t *p = (uint8_t *) &warm_boot_rtc;
+        for (size_t j = 0; j < sizeof(warm_boot_rtc); j++)
+            p[j] = next_byte();
+        if (i % 2)
+            warm_boot_rtc.magic = WARM_BOOT_MAGIC;  // Even the magic right
+        warm += WarmBoot().load();
+    }
+    printf("power on with random RTC memory: %u of %u warm\n", warm,
+           POWER_ONS);
+    ok &= warm == 0;
+
+    // 2. Calibrated on the pad, then a watchdog restart
+    WarmBoot boot;
+    boot.record.groundPa = 100812.5f;
+    const float bias[3] = {-0.86f, 0.56f, -0.36f};
+    memcpy(boot.record.accBias, bias, sizeof(bias));
+    boot.record.rocketState = 2;  // ROCKET_OFFGROUND
+    boot.record.phase = 2;        // PHASE_COAST
+    boot.record.tPlus = 4210;
+    boot.save();
+    WarmBoot restarted;
+    bool same = restarted.load() && restarted.warm &&
+                restarted.record.groundPa == 100812.5f &&
+                !memcmp(restarted.record.accBias, bias, sizeof(bias)) &&
+                restarted.record.rocketState == 2 &&
+                restarted.record.phase == 2 && restarted.record.tPlus == 4210;
+    for (int i = 0; i < 3; i++) {
+        restarted.record.restarts++;
+        restarted.save();
+        restarted.load();
+    }
+    same &= restarted.record.restarts == 3;
+    printf("saved record, in flight, after 3 warm restarts: %s\n",
+           same ? "kept" : "LOST");
+    ok &= same;
+
+    // 3. A bit lost in RTC memory
+    const WarmBootRecord good = warm_boot_rtc;
+    uint32_t taken = 0;
+    const uint32_t bits = sizeof(good) * 8;
+    for (uint32_t b = 0; b < bits; b++) {
+        warm_boot_rtc = good;
+        ((uint8_t *) &warm_boot_rtc)[b / 8] ^= 1 << (b % 8);
+        taken += WarmBoot().load();
+    }
+    printf("single bit flips: %u of %u taken as warm\n", taken, bits);
+    ok &= taken == 0;
+
+    // 4. The restart command
+    warm_boot_rtc = good;
+    WarmBoot().clear();
+    const bool cleared = !WarmBoot().load();
+    printf("after clear(): %s boot\n", cleared ? "cold" : "warm");
+    ok &= cleared;
+
+    // 5. The reasons of a restart
+    static const struct {
+        WARM_BOOT_RESET reset;
+        const char *name;
+        bool warm;
+    } resets[] = {
+        {RESET_POWER_ON, "power on", false},
+        {RESET_SOFTWARE, "software", false},
+        {RESET_PIN, "reset pin", false},
+        {RESET_WATCHDOG, "watchdog", true},
+        {RESET_PANIC, "exception", true},
+        {RESET_BROWNOUT, "brownout", true},
+    };
+    printf("sealed record after a restart by");
+    for (const auto &r : resets) {
+        warm_boot_rtc = good;
+        warm_boot_reset = r.reset;
+        const bool loaded = WarmBoot().load();
+        printf(" %s: %s%s", r.name, loaded ? "warm" : "cold",
+               loaded == r.warm ? "" : " WRONG");
+        ok &= loaded == r.warm;
+    }
+    printf("\n");
+    warm_boot_reset = RESET_WATCHDOG;
+
+    warm_boot_rtc = good;
+    const auto t0 = std::chrono::steady_clock::now();
+    uint32_t loaded = 0;
+    for (uint32_t i = 0; i < LOADS; i++)
+        loaded += WarmBoot().load();
+    const double us =
+        std::chrono::duration<double, std::micro>(
+            std::chrono::steady_clock::now() - t0)
+            .count() /
+        LOADS;
+    ok &= loaded == LOADS;
+    printf("warm boot skips %d ms boot wait and %d ms baro calibration, "
+           "load %.3f us\n",
+           BOOT_WAIT, IMU_BMP_SEA_LEVEL_PRESSURE_SAMPLING * CALIBRATE_DELAY,
+           us);
+
+    if (!ok)
+        printf("FAILED\n");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,165 @@
+/*
+ * Host round-trip check and throughput of the LoRa packet codec.
+ * 1. Every codec packs and unpacks random values back unchanged
+ * 2. The bytes on air are little-endian and without padding
+ * 3. Packets per second of LoraCodec against the virtual LoraPacket
+ *    style (union + memcpy through a vtable)
+ *
+ * Run: pio run -e bench_codec -t exec
+ */
+#include <packet_codec.h>
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+
+static uint32_t failures = 0;
+
+#define CHECK(cond)                                               \
+    do {                                                          \
+        if (!(cond)) {                                            \
+            printf("FAIL %s:%d %s\n", __FILE__, __LINE__, #cond); \
+            failures++;                                           \
+        }                                                         \
+    } while (0)
+
+static void check_layout()
+{
+    uint8_t buf[LORA_PACKET_SIZE];
+    CHECK(LoraVectorCodec::pack(buf, 7, 1.0f, -2.0f, 0.0f) == 15);
+    const uint8_t expect[] = {15,   LORA_PACKET_VECTOR, 7,    0x00, 0x00,
+                              0x80, 0x3F,               0x00, 0x00, 0x00,
+                              0xC0, 0x00,               0x00, 0x00, 0x00};
+    CHECK(memcmp(buf, expect, sizeof(expect)) == 0);
+
+    LoraStateCodec::pack(buf, 0, 0x64, -1, 0, 0, 0, 0x1234, 0xABCD);
+    CHECK(buf[0] == 21);
+    CHECK(buf[3] == 0x64 && buf[4] == 0xFF);
+    CHECK(buf[17] == 0x34 && buf[18] == 0x12);
+    CHECK(buf[19] == 0xCD && buf[20] == 0xAB);
+
+    // Wrong type or size is refused
+    float x, y, z;
+    CHECK(!LoraVectorCodec::unpack(buf, NULL, x, y, z));
+}
+
+static void check_roundtrip(uint32_t count)
+{
+    std::mt19937 rng(1);
+    std::uniform_real_distribution<float> real(-1e4f, 1e4f);
+    uint8_t buf[LORA_PACKET_SIZE];
+    for (uint32_t i = 0; i < count; i++) {
+        const uint8_t ts = rng();
+        const float v[3] = {real(rng), real(rng), real(rng)};
+        LoraVectorCodec::pack(buf, ts, v[0], v[1], v[2]);
+        uint8_t ts2;
+        float u[3];
+        CHECK(LoraVectorCodec::unpack(buf, &ts2, u[0], u[1], u[2]));
+        CHECK(ts2 == ts && u[0] == v[0] && u[1] == v[1] && u[2] == v[2]);
+
+        const uint8_t battery = rng();
+        const int8_t satellite = rng();
+        const uint16_t lon = rng(), lat = rng();
+        LoraStateCodec::pack(buf, ts, battery, satellite, v[0], v[1], v[2],
+                             lon, lat);
+        uint8_t b2;
+        int8_t s2;
+        float f[3];
+        uint16_t lon2, lat2;
+        CHECK(LoraStateCodec::unpack(buf, NULL, b2, s2, f[0], f[1], f[2], lon2,
+                                     lat2));
+        CHECK(b2 == battery && s2 == satellite && lon2 == lon && lat2 == lat);
+        CHECK(f[0] == v[0] && f[1] == v[1] && f[2] == v[2]);
+
+        LoraText<15> text = {}, text2;
+        snprintf(text.str, sizeof(text.str), "msg %u", i);
+        LoraMessageCodec::pack(buf, ts, text);
+        CHECK(LoraMessageCodec::unpack(buf, NULL, text2));
+        CHECK(memcmp(text.str, text2.str, sizeof(text.str)) == 0);
+        if (failures)
+            return;
+    }
+}
+
+/* The previous style, kept here only for comparison */
+struct LegacyPacket {
+    uint8_t id, timestamp;
+    virtual void serialize(uint8_t *buf) = 0;
+    virtual ~LegacyPacket() {}
+};
+
+struct LegacyVector : LegacyPacket {
+    static const uint8_t size = 1 + sizeof(float) * 3;
+    union {
+        float vector[3];
+        uint8_t raw[size];
+    } data;
+    virtual void serialize(uint8_t *buf)
+    {
+        buf[0] = size + 3;
+        buf[1] = id;
+        buf[2] = timestamp;
+        memcpy(buf + 3, data.raw, size);
+    }
+};
+
+static double now_s()
+{
+    return std::chrono::duration<double>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+static void bench(uint32_t count)
+{
+    static uint8_t frame[LORA_PACKET_SIZE];
+    volatile uint32_t sink = 0;
+    float x = 1.5f, y = -2.5f, z = 3.25f;
+
+    double start = now_s();
+    for (uint32_t i = 0; i < count; i++) {
+        LoraVectorCodec::pack(frame, i, x + i, y, z);
+        sink += frame[5];
+    }
+    const double codec = count / (now_s() - start);
+
+    LegacyVector legacy;
+    LegacyPacket *p = &legacy;
+    start = now_s();
+    for (uint32_t i = 0; i < count; i++) {
+        legacy.id = 1;
+        legacy.timestamp = i;
+        legacy.data.vector[0] = x + i;
+        legacy.data.vector[1] = y;
+        legacy.data.vector[2] = z;
+        p->serialize(frame);
+        sink += frame[5];
+    }
+    const double virt = count / (now_s() - start);
+
+    start = now_s();
+    for (uint32_t i = 0; i < count; i++) {
+        LoraStateCodec::pack(frame, i, 80, 9, x + i, y, z, 1, 2);
+        sink += frame[5];
+    }
+    const double state = count / (now_s() - start);
+
+    printf("  vector codec   %12.0f pkt/s\n", codec);
+    printf("  vector virtual %12.0f pkt/s\n", virt);
+    printf("  state codec    %12.0f pkt/s\n", state);
+    (void) sink;
+}
+
+int main(int argc, char **argv)
+{
+    const uint32_t count = argc > 1 ? atoi(argv[1]) : 10000000;
+    printf("sizes: vector %u, message %u, state %u (max %u)\n",
+           LoraVectorCodec::size, LoraMessageCodec::size, LoraStateCodec::size,
+           LORA_PACKET_SIZE);
+    check_layout();
+    check_roundtrip(100000);
+    printf("round-trip: %s\n", failures ? "FAIL" : "ok");
+    bench(count);
+    return failures ? 1 : 0;
+}
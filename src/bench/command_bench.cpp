@@ -0,0 +1,263 @@
+/*
+ * Host comparison of the command dispatch of System::command():
+ * 1. The old if/else chain, every branch a String compare or substring
+ * 2. CommandTable, binary search on the name and typed arguments
+ * The String below allocates like the Arduino one, a heap buffer per
+ * copy and substring, operator new counts them. Reported are the time,
+ * the compares and the allocations per command line.
+ * Exits non-zero if the table allocates, resolves a line to another
+ * command than the chain, or fails "set fairingOpened 10 100" which the
+ * chain never matched.
+ *
+ * Run: pio run -e bench_command -t exec
+ */
+#include <command_table.h>
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <new>
+
+#define ROUNDS 20000
+
+static uint64_t allocations;
+
+void *operator new(size_t size)
+{
+    allocations++;
+    void *p = malloc(size);
+    if (!p)
+        throw std::bad_alloc();
+    return p;
+}
+
+void operator delete(void *p) noexcept
+{
+    free(p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+    free(p);
+}
+
+/* Arduino String, as far as the chain uses it */
+class String
+{
+private:
+    char *buf;
+    size_t len;
+
+public:
+    String(const char *s, size_t n) : buf(new char[n + 1]), len(n)
+    {
+        memcpy(buf, s, n);
+        buf[n] = 0;
+    }
+    String(const char *s) : String(s, strlen(s)) {}
+    String(const String &s) : String(s.buf, s.len) {}
+    ~String() { delete[] buf; }
+
+    String substring(size_t from, size_t to = (size_t) -1) const
+    {
+        if (from > len)
+            from = len;
+        if (to > len)
+            to = len;
+        return String(buf + from, to - from);
+    }
+
+    bool operator==(const char *s) const { return strcmp(buf, s) == 0; }
+};
+
+/* Old chain in its order, a prefix length of 0 is a whole line compare */
+struct Branch {
+    const char *name;
+    uint8_t prefix;
+};
+
+static const Branch chain[] = {
+    {"open", 0},        {"close", 0},      {"set fairingOpened", 11},
+    {"detach", 0},      {"motor", 5},      {"count", 5},
+    {"preLaunch", 0},   {"launch", 0},     {"stop", 0},
+    {"rtime", 5},       {"stime", 5},      {"restart", 0},
+    {"list", 0},        {"read", 4},       {"delete", 6},
+    {"clear", 0},       {"info", 0},       {"space", 0},
+    {"format", 0},      {"buzz", 4},       {"rocket", 0},
+    {"wsstats", 0},     {"tasks", 0},      {"tasks reset", 0},
+    {"lorastats", 0},   {"lorastats reset", 0},
+    {"connected", 0},   {"disconnected", 0},
+    {"print", 5},       {"nostream", 0},   {"stream", 0},
+    {"init", 0},        {"config", 6},     {"kp", 2},
+    {"ki", 2},          {"kd", 2},         {"bldc_init", 9},
+    {"pid off", 0},     {"pid on", 0},     {"bldc", 4},
+    {"0", 0},
+};
+#define BRANCHES (sizeof(chain) / sizeof(chain[0]))
+
+static uint64_t compares;
+
+/* Index of the branch taken, -1 for none, the argument parsing of the *
+ * branches is left out in favour of the chain                         */
+static int old_command(String cmd)
+{
+    for (unsigned i = 0; i < BRANCHES; i++) {
+        compares++;
+        const Branch &b = chain[i];
+        if (b.prefix ? cmd.substring(0, b.prefix) == b.name : cmd == b.name)
+            return i;
+    }
+    return -1;
+}
+
+/* Fixed reply, what the handler found */
+struct Reply {
+    const char *name;
+    long a, b;
+};
+
+static bool any(int &, CmdArgs &args, Reply &r)
+{
+    r.a = r.b = 0;
+    args.integer(r.a);
+    return false;
+}
+
+static bool set(int &, CmdArgs &args, Reply &r)
+{
+    CmdToken key;
+    if (args.key(key) && key == "fairingOpened" && args.integer(r.a) &&
+        args.integer(r.b))
+        r.name = "set fairingOpened";
+    return false;
+}
+
+static bool sub(int &, CmdArgs &args, Reply &r)
+{
+    CmdToken key;
+    if (args.key(key) && args.empty()) {
+        if (key == "reset")
+            r.name = strcmp(r.name, "tasks") ? "lorastats reset"
+                                             : "tasks reset";
+        else if (key == "on")
+            r.name = "pid on";
+        else if (key == "off")
+            r.name = "pid off";
+    }
+    return false;
+}
+
+static CommandEntry<int, Reply> entries[] = {
+    {"open", CMD_EXACT, any},      {"close", CMD_EXACT, any},
+    {"set", CMD_ARGS, set},        {"detach", CMD_EXACT, any},
+    {"motor", CMD_ARGS, any},      {"count", CMD_ARGS, any},
+    {"preLaunch", CMD_EXACT, any}, {"launch", CMD_EXACT, any},
+    {"stop", CMD_EXACT, any},      {"rtime", CMD_ARGS, any},
+    {"stime", CMD_ARGS, any},      {"restart", CMD_EXACT, any},
+    {"list", CMD_EXACT, any},      {"read", CMD_ARGS, any},
+    {"delete", CMD_ARGS, any},     {"clear", CMD_EXACT, any},
+    {"info", CMD_EXACT, any},      {"space", CMD_EXACT, any},
+    {"format", CMD_EXACT, any},    {"buzz", CMD_ARGS, any},
+    {"rocket", CMD_EXACT, any},    {"wsstats", CMD_EXACT, any},
+    {"tasks", CMD_ARGS, sub},      {"lorastats", CMD_ARGS, sub},
+    {"connected", CMD_EXACT, any}, {"disconnected", CMD_EXACT, any},
+    {"print", CMD_ARGS, any},      {"nostream", CMD_EXACT, any},
+    {"stream", CMD_EXACT, any},    {"init", CMD_EXACT, any},
+    {"config", CMD_ARGS, any},     {"kp", CMD_ARGS, any},
+    {"ki", CMD_ARGS, any},         {"kd", CMD_ARGS, any},
+    {"bldc_init", CMD_ARGS, any},  {"pid", CMD_ARGS, sub},
+    {"bldc", CMD_ARGS, any},       {"0", CMD_EXACT, any},
+};
+
+/* What the ground station and the Tickers send */
+static const char *const lines[] = {
+    "stream",      "nostream",         "open",          "close",
+    "stop",        "count10",          "rtime 5000",    "buzz3",
+    "read /log.txt", "tasks",          "kp0.5",         "bldc50",
+    "bldc_init60", "pid on",           "lorastats reset", "print hello",
+    "config set kp0.5", "0",           "delete /a.txt", "launch",
+    "preLaunch",   "wsstats",          "rocket",        "bogus",
+};
+#define LINES (sizeof(lines) / sizeof(lines[0]))
+
+static double now_ns()
+{
+    return std::chrono::duration<double, std::nano>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+int main()
+{
+    // The table as core.cpp builds it, sorted once at start up
+    CommandTable<int, Reply> table(entries,
+                                   sizeof(entries) / sizeof(entries[0]));
+    int ctx = 0;
+    bool ok = true;
+
+    // Same command for every line, the chain name is the reference
+    for (unsigned i = 0; i < LINES; i++) {
+        const int branch = old_command(lines[i]);
+        CmdToken t;
+        CmdArgs args(lines[i]);
+        CmdArgs::name(lines[i], t, args);
+        Reply r = {"", 0, 0};
+        const CommandEntry<int, Reply> *e = table.find(t);
+        if (e)
+            r.name = e->name;
+        if (table.dispatch(ctx, lines[i], r) == CMD_UNKNOWN)
+            r.name = "";
+        const char *expect = branch < 0 ? "" : chain[branch].name;
+        if (strcmp(expect, r.name)) {
+            printf("  \"%s\": chain %s, table %s\n", lines[i], expect, r.name);
+            ok = false;
+        }
+    }
+
+    // The chain compares 11 chars against a 17 char literal
+    Reply r = {"", 0, 0};
+    const bool chain_set = old_command("set fairingOpened 10 100") >= 0;
+    const bool table_set =
+        table.dispatch(ctx, "set fairingOpened 10 100", r) == CMD_DONE &&
+        !strcmp(r.name, "set fairingOpened") && r.a == 10 && r.b == 100;
+    printf("set fairingOpened 10 100: chain %s, table %s\n",
+           chain_set ? "matched" : "missed", table_set ? "10 100" : "missed");
+    ok &= !chain_set && table_set;
+
+    compares = 0;
+    allocations = 0;
+    double start = now_ns();
+    int sink = 0;
+    for (unsigned n = 0; n < ROUNDS; n++) {
+        for (unsigned i = 0; i < LINES; i++)
+            sink += old_command(lines[i]);
+    }
+    const double chain_ns = (now_ns() - start) / (ROUNDS * LINES);
+    const double chain_allocs = (double) allocations / (ROUNDS * LINES);
+    const double chain_compares = (double) compares / (ROUNDS * LINES);
+
+    allocations = 0;
+    start = now_ns();
+    for (unsigned n = 0; n < ROUNDS; n++) {
+        for (unsigned i = 0; i < LINES; i++) {
+            Reply r = {"", 0, 0};
+            sink += table.dispatch(ctx, lines[i], r);
+        }
+    }
+    const double table_ns = (now_ns() - start) / (ROUNDS * LINES);
+    const uint64_t table_allocs = allocations;
+
+    printf("%u lines x %u rounds (%d)\n", (unsigned) LINES, ROUNDS, sink & 1);
+    printf("  chain  %6.1f ns/line  %5.1f compares  %5.1f allocations\n",
+           chain_ns, chain_compares, chain_allocs);
+    unsigned depth = 0;  // Compares of the binary search at most
+    for (unsigned n = sizeof(entries) / sizeof(entries[0]); n; n /= 2)
+        depth++;
+    printf("  table  %6.1f ns/line  %5u compares  %5llu allocations\n",
+           table_ns, depth, (unsigned long long) table_allocs);
+    ok &= table_allocs == 0;
+
+    if (!ok)
+        printf("FAILED\n");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,215 @@
+/*
+ * Host check of the hand-off from Tickers to the loop:
+ * 1. The old core_cmd String, one slot a Ticker overwrites, on a virtual
+ *    clock with the loop passes of the scheduler bench
+ * 2. EventQueue of SYSTEM_EVENT_QUEUE_LEN on the same clock
+ * 3. EventQueue under threads, three producers against one consumer,
+ *    a producer retries when the queue is full
+ * Reported are the events lost, the allocations in timer context and the
+ * post to handle latency.
+ * Exits non-zero if the queue loses or repeats an event, reorders the
+ * events of a producer, or its counters disagree.
+ *
+ * Run: pio run -e bench_event -t exec
+ */
+#include <event_queue.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define QUEUE_LEN 16  // SYSTEM_EVENT_QUEUE_LEN
+#define DURATION 600000000ULL  // us
+#define PRODUCERS 3
+#define PER_PRODUCER 200000
+
+static std::atomic<uint64_t> allocations(0);
+
+void *operator new(size_t size)
+{
+    allocations++;
+    void *p = malloc(size);
+    if (!p)
+        throw std::bad_alloc();
+    return p;
+}
+
+void operator delete(void *p) noexcept
+{
+    free(p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+    free(p);
+}
+
+struct Event {
+    uint8_t type;
+    int32_t arg;
+    uint32_t posted;
+};
+
+static uint32_t seed = 1;
+
+static uint32_t rnd(uint32_t n)
+{
+    seed = seed * 1103515245 + 12345;
+    return (seed >> 8) % n;
+}
+
+/* A loop pass, mostly short, a websocket flush now and then */
+static uint32_t pass_length()
+{
+    return rnd(500) == 0 ? 12000 : 300 + rnd(400);
+}
+
+static const char *const names[] = {"open", "stop", "stream", "nostream"};
+
+struct Result {
+    uint64_t fired, handled, allocations;
+    uint32_t latency_max;
+};
+
+/* Timers fire about every 20 ms, the loop checks between its passes */
+static Result simulate_string()
+{
+    Result r = {0, 0, 0, 0};
+    std::string core_cmd;
+    uint64_t next_fire = 0;
+    seed = 1;
+    for (uint64_t now = 0; now < DURATION; now += pass_length()) {
+        const uint64_t before = allocations;
+        while (next_fire <= now) {
+            // Ticker, padded past the small string buffer, 16 B
+            core_cmd = std::string(names[rnd(4)]) + "            ";
+            r.fired++;
+            next_fire += 1000 + rnd(38000);
+        }
+        r.allocations += allocations - before;
+        if (!core_cmd.empty()) {
+            r.handled++;
+            core_cmd.clear();
+        }
+    }
+    return r;
+}
+
+static Result simulate_queue()
+{
+    Result r = {0, 0, 0, 0};
+    EventQueue<Event, QUEUE_LEN> queue;
+    uint64_t next_fire = 0;
+    seed = 1;
+    for (uint64_t now = 0; now < DURATION; now += pass_length()) {
+        const uint64_t before = allocations;
+        while (next_fire <= now) {
+            const Event e = {(uint8_t) rnd(4), 0, (uint32_t) next_fire};
+            queue.post(e);
+            r.fired++;
+            next_fire += 1000 + rnd(38000);
+        }
+        r.allocations += allocations - before;
+        Event e;
+        while (queue.poll(e)) {
+            r.handled++;
+            if ((uint32_t) now - e.posted > r.latency_max)
+                r.latency_max = (uint32_t) now - e.posted;
+        }
+    }
+    return r;
+}
+
+static uint32_t now_us()
+{
+    return (uint32_t) std::chrono::duration_cast<std::chrono::microseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+int main()
+{
+    bool ok = true;
+
+    const Result slot = simulate_string();
+    const Result queue = simulate_queue();
+    printf("%llu s of Ticker events on the virtual clock\n",
+           DURATION / 1000000ULL);
+    printf("  core_cmd     fired %6llu lost %4llu  allocations %6llu\n",
+           (unsigned long long) slot.fired,
+           (unsigned long long) (slot.fired - slot.handled),
+           (unsigned long long) slot.allocations);
+    printf("  EventQueue   fired %6llu lost %4llu  allocations %6llu  "
+           "latency max %u us\n",
+           (unsigned long long) queue.fired,
+           (unsigned long long) (queue.fired - queue.handled),
+           (unsigned long long) queue.allocations, queue.latency_max);
+    ok &= queue.handled == queue.fired && queue.allocations == 0;
+
+    // Threads, every producer numbers its events
+    static EventQueue<Event, QUEUE_LEN> events;
+    std::atomic<int> running(PRODUCERS);
+    uint32_t drops[PRODUCERS] = {0};
+    std::vector<std::thread> producers;
+    for (int p = 0; p < PRODUCERS; p++) {
+        producers.push_back(std::thread([p, &running, &drops]() {
+            for (int32_t i = 0; i < PER_PRODUCER; i++) {
+                const Event e = {(uint8_t) p, i, now_us()};
+                while (!events.post(e)) {
+                    drops[p]++;  // Full, the real timer would lose it
+                    std::this_thread::yield();
+                }
+            }
+            running--;
+        }));
+    }
+
+    int32_t last[PRODUCERS] = {-1, -1, -1};
+    uint64_t received = 0, latency_total = 0;
+    uint32_t latency_max = 0;
+    for (;;) {
+        const bool done = running == 0;
+        Event e;
+        std::this_thread::yield();
+        while (events.poll(e)) {
+            const uint32_t latency = now_us() - e.posted;
+            latency_total += latency;
+            if (latency > latency_max)
+                latency_max = latency;
+            if (e.type >= PRODUCERS || e.arg != last[e.type] + 1) {
+                printf("  lost or out of order: producer %u event %d after "
+                       "%d\n",
+                       e.type, e.arg, e.type < PRODUCERS ? last[e.type] : 0);
+                ok = false;
+            } else {
+                last[e.type] = e.arg;
+            }
+            received++;
+        }
+        if (done)
+            break;
+    }
+    for (std::thread &t : producers)
+        t.join();
+
+    uint64_t dropped = 0;
+    for (int p = 0; p < PRODUCERS; p++)
+        dropped += drops[p];
+    printf("%d threads x %d events: handled %llu full %llu, latency avg "
+           "%.2f us max %u us\n",
+           PRODUCERS, PER_PRODUCER, (unsigned long long) received,
+           (unsigned long long) dropped,
+           received ? (double) latency_total / received : 0.0, latency_max);
+    ok &= received == (uint64_t) PRODUCERS * PER_PRODUCER;
+    ok &= events.posted == received && events.handled == received &&
+          events.dropped == dropped;
+
+    if (!ok)
+        printf("FAILED\n");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,209 @@
+/*
+ * Host run of the flight state machine on a simulated flight, sampled by
+ * the sensor task every 2 ms with the lateness of a busy loop:
+ * 1. The old flight() checks, lift off on one sample over the limit
+ * 2. FlightFsm, every guard held over its samples, the apogee voted by
+ *    ApogeeDetector
+ * The pad sees a knock, one sample over the lift off limit. The readings
+ * carry noise. In the coast the board restarts warm, as from a brownout:
+ * no samples for RESTART_GAP, then FlightFsm and the vote go on from the
+ * phase and time since lift off saved last, every 100 ms.
+ * Reported is each transition against the true time its condition
+ * began.
+ * Exits non-zero if a phase is missed, out of order, detected later than
+ * its samples plus one times the longest sample gap (the apogee: the
+ * fall to the inertial vote speed and the baro hold), or if the knock
+ * lifts off.
+ *
+ * Run: pio run -e bench_flight -t exec
+ */
+#include <apogee.h>
+#include <flight_fsm.h>
+
+#include <cmath>
+#include <cstdio>
+
+#define G 9.81f
+#define KNOCK_AT 1000000     // us
+#define IGNITION_AT 2000000  // us
+#define BURN 2500000         // us
+#define THRUST 60.0f         // m/s^2
+#define DRAG 0.0008f         // 1/m, of v^2
+#define CHUTE_SPEED 8.0f     // m/s
+#define END 200000000UL      // us
+#define RESTART_AT 7000000   // us, in the coast
+#define RESTART_GAP 300000   // us, a warm boot
+#define SAVE_PERIOD 100000   // us, WARM_BOOT_SAVE_PERIOD
+
+static uint32_t seed = 7;
+
+static float noise(float amplitude)
+{
+    seed = seed * 1103515245 + 12345;
+    return amplitude * (((seed >> 8) % 2001) / 1000.0f - 1);
+}
+
+static uint32_t next_gap()
+{
+    seed = seed * 1103515245 + 12345;
+    return (seed >> 8) % 500 == 0 ? 12000 : 2000 + (seed >> 8) % 300;
+}
+
+struct Truth {
+    uint32_t t[PHASE_COUNT];  // us, the condition of each phase began
+};
+
+static uint32_t detected[PHASE_COUNT];
+
+static void on_phase(void *, FLIGHT_PHASE phase, uint32_t t)
+{
+    detected[phase] = t;
+}
+
+int main()
+{
+    FlightFsm fsm(on_phase, 0);
+    ApogeeDetector apogee;
+    fsm.limits.release = 20000000;
+    fsm.limits.stop = 180000000;
+    fsm.reset(0);
+
+    Truth truth = {{0}};
+    float height = 0, speed = 0;
+    bool chute = false, old_liftoff = false;
+    uint32_t old_liftoff_at = 0, max_gap = 0;
+    uint32_t t = 0, last = 0, baro_tick = 0;
+    float baro_height = 0, baro_speed = 0;
+    bool restarted = false;
+    FLIGHT_PHASE saved_phase = PHASE_PAD, resumed = PHASE_PAD;
+    uint32_t saved_at = 0, saved_flown = 0, resumed_at = 0;
+    while (t < END) {
+        const bool restart = !restarted && t >= RESTART_AT;
+        const uint32_t gap = restart ? RESTART_GAP : next_gap();
+        // Physics between samples in steps of 1 ms at most
+        for (uint32_t step = 0; step < gap; step += 1000) {
+            const uint32_t now = t + step;
+            const float dt = (gap - step < 1000 ? gap - step : 1000) / 1e6f;
+            float acc_up = 0;
+            if (now >= IGNITION_AT && now < IGNITION_AT + BURN)
+                acc_up = THRUST;
+            if (height > 0 || acc_up > 0) {
+                acc_up -= G + DRAG * speed * fabsf(speed);
+                speed += acc_up * dt;
+                if (chute && speed < -CHUTE_SPEED)
+                    speed = -CHUTE_SPEED;
+                height += speed * dt;
+            }
+            if (height < 0) {
+                height = 0;
+                speed = 0;
+                if (!truth.t[PHASE_LANDED])
+                    truth.t[PHASE_LANDED] = now;
+            }
+        }
+        t += gap;
+        if (gap > max_gap && !restart)
+            max_gap = gap;
+
+        // What the accelerometer reads nose up, thrust and drag without
+        // gravity
+        float acc_up = 1.0f;
+        if (t >= IGNITION_AT && t < IGNITION_AT + BURN)
+            acc_up = (THRUST - DRAG * speed * fabsf(speed)) / G;
+        else if (height > 0)
+            acc_up = -DRAG * speed * fabsf(speed) / G;
+        if (t >= KNOCK_AT && last < KNOCK_AT)
+            acc_up = 3.2f;  // One sample, a hand on the rail
+        last = t;
+
+        if (!truth.t[PHASE_BOOST] && t >= IGNITION_AT)
+            truth.t[PHASE_BOOST] = IGNITION_AT;
+        if (!truth.t[PHASE_COAST] && t >= IGNITION_AT + BURN)
+            truth.t[PHASE_COAST] = IGNITION_AT + BURN;
+        if (!truth.t[PHASE_APOGEE] && truth.t[PHASE_COAST] && speed < 0)
+            truth.t[PHASE_APOGEE] = t;
+
+        acc_up += noise(0.05f);
+        // The baro gives a new height every IMU_BMP_SAMPLING_PERIOD
+        const bool baro_new = t / 8000 != baro_tick;
+        baro_tick = t / 8000;
+        if (baro_new) {
+            baro_height = height + noise(0.3f);
+            baro_speed = speed + noise(0.2f);
+        }
+        // A warm boot, what the record kept, the vote over from here
+        if (restart) {
+            restarted = true;
+            resumed_at = t;
+            resumed = saved_phase;
+            fsm = FlightFsm(on_phase, 0);
+            fsm.limits.release = 20000000;
+            fsm.limits.stop = 180000000;
+            fsm.resume(saved_phase, t, saved_flown);
+            apogee.reset(t, baro_height);
+            apogee.velocity = baro_speed;
+        }
+        if (fsm.visitedPhase(PHASE_BOOST)) {
+            const ApogeeInput in = {t, acc_up, baro_height, baro_speed,
+                                    baro_new};
+            apogee.update(in);
+        }
+        const FlightSample s = {t, fabsf(acc_up), baro_height, baro_speed,
+                                apogee.detected};
+        // Old flight(): one sample over the limit is the lift off
+        if (!old_liftoff && s.acc > FLIGHT_LIFTOFF_G) {
+            old_liftoff = true;
+            old_liftoff_at = t;
+        }
+        if (fsm.update(s) && fsm.phase == PHASE_BOOST)
+            apogee.reset(t, s.height);
+        if (fsm.phase >= PHASE_APOGEE)
+            chute = true;
+        if (t - saved_at >= SAVE_PERIOD) {
+            saved_at = t;
+            saved_phase = fsm.phase;
+            saved_flown = fsm.since(PHASE_BOOST, t);
+        }
+        if (fsm.phase == PHASE_LANDED)
+            break;
+    }
+
+    printf("sample gap max %u us, old flight() lift off at %.3f s (ignition "
+           "%.3f s)\n",
+           max_gap, old_liftoff_at / 1e6, IGNITION_AT / 1e6);
+    printf("warm restart at %.3f s, resumed in %s at %.3f s\n",
+           RESTART_AT / 1e6, FlightFsm::name(resumed), resumed_at / 1e6);
+
+    // Samples each guard holds
+    const uint32_t samples[PHASE_COUNT] = {
+        0, FLIGHT_LIFTOFF_SAMPLES, FLIGHT_BURNOUT_SAMPLES,
+        0, 1, FLIGHT_REST_SAMPLES};
+    bool ok = true;
+    for (uint8_t p = PHASE_BOOST; p < PHASE_COUNT; p++) {
+        const FLIGHT_PHASE phase = (FLIGHT_PHASE) p;
+        if (phase == PHASE_DESCENT)
+            truth.t[p] = detected[PHASE_APOGEE];
+        uint32_t bound = (samples[p] + 1) * max_gap;
+        // The vote, falling to the inertial speed then the baro hold
+        if (phase == PHASE_APOGEE)
+            bound = (uint32_t) (-APOGEE_INERTIAL_SET / G * 1e6f) +
+                    (APOGEE_BARO_HOLD + 1) * 8000 + max_gap;
+        const int32_t latency = (int32_t) (detected[p] - truth.t[p]);
+        const bool in_time = fsm.visitedPhase(phase) && detected[p] &&
+                             latency >= -(int32_t) max_gap &&
+                             latency <= (int32_t) bound;
+        printf("  %-8s true %9.3f s  detected %9.3f s  latency %7.1f ms  "
+               "bound %7.1f ms%s\n",
+               FlightFsm::name(phase), truth.t[p] / 1e6, detected[p] / 1e6,
+               latency / 1e3, bound / 1e3, in_time ? "" : "  LATE");
+        ok &= in_time;
+        if (p > PHASE_BOOST)
+            ok &= detected[p] >= detected[p - 1];
+    }
+    ok &= detected[PHASE_BOOST] >= IGNITION_AT;
+    ok &= restarted && resumed == PHASE_COAST;
+
+    if (!ok)
+        printf("FAILED\n");
+    return ok ? 0 : 1;
+}
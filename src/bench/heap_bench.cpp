@@ -0,0 +1,251 @@
+/*
+ * Host check of the heap guard and of the allocations it finds after
+ * SYSTEM_READY, malloc linked through heap_guard.cpp as in the
+ * esp07s_heap_guard env:
+ * 1. The flight log line, the old String sum against snprintf() into a
+ *    stack buffer as flight() does now
+ * 2. A soft init, the old new PID and new SimpleKalmanFilter against the
+ *    members rebuilt in place
+ * 3. The trap, a child process arms it and allocates
+ * The String below grows with realloc like the Arduino one, the numbers
+ * through a stack buffer as String(float) does.
+ * Exits non-zero if the new paths allocate, the old ones are not seen,
+ * or the trap does not abort.
+ *
+ * Run: pio run -e bench_heap -t exec
+ */
+#include <heap_guard.h>
+
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define LINES 1000
+#define INITS 100
+
+// The core links new to malloc statically, here it would be in libstdc++
+// out of reach of --wrap
+void *operator new(size_t size)
+{
+    void *p = malloc(size);
+    if (!p)
+        throw std::bad_alloc();
+    return p;
+}
+
+void operator delete(void *p) noexcept
+{
+    free(p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+    free(p);
+}
+
+/* Arduino String, as far as the flight line uses it. A sum runs on one  *
+ * StringSumHelper that grows by realloc on every term, numbers go        *
+ * through a stack buffer.                                                */
+class String
+{
+private:
+    char *buf;
+    size_t len, cap;
+
+public:
+    String() : buf(0), len(0), cap(0) {}
+    String(char c) : String() { concat(&c, 1); }
+    String(const String &s) : String() { concat(s.buf, (int) s.len); }
+    ~String() { free(buf); }
+
+    String &operator=(const String &s)
+    {
+        if (this != &s) {
+            len = 0;
+            concat(s.buf, (int) s.len);
+        }
+        return *this;
+    }
+
+    void concat(const char *s, int n)
+    {
+        if (n <= 0)
+            return;
+        if (len + n + 1 > cap) {
+            cap = len + n + 1;
+            buf = (char *) realloc(buf, cap);
+        }
+        memcpy(buf + len, s, n);
+        len += n;
+        buf[len] = 0;
+    }
+    const char *c_str() const { return buf ? buf : ""; }
+};
+
+class StringSumHelper : public String
+{
+public:
+    StringSumHelper(const String &s) : String(s) {}
+};
+
+static StringSumHelper &operator+(const StringSumHelper &lhs, char c)
+{
+    StringSumHelper &a = const_cast<StringSumHelper &>(lhs);
+    a.concat(&c, 1);
+    return a;
+}
+
+static StringSumHelper &operator+(const StringSumHelper &lhs, float f)
+{
+    StringSumHelper &a = const_cast<StringSumHelper &>(lhs);
+    char num[33];
+    a.concat(num, snprintf(num, sizeof(num), "%.2f", f));
+    return a;
+}
+
+static StringSumHelper &operator+(const StringSumHelper &lhs, unsigned long u)
+{
+    StringSumHelper &a = const_cast<StringSumHelper &>(lhs);
+    char num[22];
+    a.concat(num, snprintf(num, sizeof(num), "%lu", u));
+    return a;
+}
+
+struct Sample {
+    unsigned long t_plus;
+    float v[12];  // height, height_est, speed, acc, gyro, mag
+};
+
+static volatile size_t sink;
+
+static void old_line(const Sample &s)
+{
+    String data_str;
+    data_str = String('f') + ',' + s.t_plus + ',' + s.v[0] + ',' + s.v[1] +
+               ',' + s.v[2] + ',' + s.v[3] + ',' + s.v[4] + ',' + s.v[5] +
+               ',' + s.v[6] + ',' + s.v[7] + ',' + s.v[8] + ',' + s.v[9] +
+               ',' + s.v[10] + ',' + s.v[11] + '\n';
+    sink += strlen(data_str.c_str());
+}
+
+static void new_line(const Sample &s)
+{
+    char line[192];
+    snprintf(line, sizeof(line),
+             "%c,%lu,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f,"
+             "%.2f,%.2f\n",
+             'f', s.t_plus, s.v[0], s.v[1], s.v[2], s.v[3], s.v[4], s.v[5],
+             s.v[6], s.v[7], s.v[8], s.v[9], s.v[10], s.v[11]);
+    sink += strlen(line);
+}
+
+/* What a soft init did with PID and SimpleKalmanFilter, sizes of the  *
+ * libraries on the ESP8266                                            */
+struct Pid {
+    double state[16];
+};
+struct Kalman {
+    float state[5];
+};
+
+static Pid *old_pid;
+static Kalman *old_kalman;
+static Pid pid;
+static Kalman kalman;
+
+static void old_init()
+{
+    old_pid = new Pid();  // The one before is never freed
+    old_kalman = new Kalman();
+}
+
+static void new_init()
+{
+    pid = Pid();
+    kalman = Kalman();
+}
+
+static HeapGuardStats run(void (*pass)(int), int n)
+{
+    HeapGuard::arm(false);
+    for (int i = 0; i < n; i++)
+        pass(i);
+    const HeapGuardStats s = HeapGuard::stats();
+    HeapGuard::disarm();
+    return s;
+}
+
+static Sample sample(int i)
+{
+    Sample s = {(unsigned long) i * 10, {0}};
+    for (int j = 0; j < 12; j++)
+        s.v[j] = (i % 97) * 1.37f - j * 3.1f;
+    return s;
+}
+
+static void old_line_pass(int i)
+{
+    old_line(sample(i));
+}
+
+static void new_line_pass(int i)
+{
+    new_line(sample(i));
+}
+
+static void old_init_pass(int)
+{
+    old_init();
+}
+
+static void new_init_pass(int)
+{
+    new_init();
+}
+
+int main()
+{
+    bool ok = true;
+
+    printf("after ready, %d flight lines and %d soft inits\n", LINES, INITS);
+    HeapGuardStats s = run(old_line_pass, LINES);
+    printf("  %-24s %6.2f allocs  %8.1f bytes per pass\n", "old String line",
+           (double) s.allocs / LINES, (double) s.bytes / LINES);
+    ok &= s.allocs >= LINES;
+    s = run(new_line_pass, LINES);
+    printf("  %-24s %6.2f allocs  %8.1f bytes per pass\n", "snprintf line",
+           (double) s.allocs / LINES, (double) s.bytes / LINES);
+    ok &= s.allocs == 0;
+    s = run(old_init_pass, INITS);
+    printf("  %-24s %6.2f allocs  %8.1f bytes per pass, %u leaked\n",
+           "old new PID/Kalman", (double) s.allocs / INITS,
+           (double) s.bytes / INITS, (unsigned) (s.allocs - s.frees));
+    ok &= s.allocs == 2 * INITS;
+    s = run(new_init_pass, INITS);
+    printf("  %-24s %6.2f allocs  %8.1f bytes per pass\n", "in place init",
+           (double) s.allocs / INITS, (double) s.bytes / INITS);
+    ok &= s.allocs == 0;
+
+    // The trap, in a child, it aborts on the allocation
+    fflush(stdout);
+    const pid_t child = fork();
+    if (child == 0) {
+        HeapGuard::arm(true);
+        sink += (size_t) malloc(16);
+        _exit(0);
+    }
+    int status = 0;
+    waitpid(child, &status, 0);
+    const bool trapped = WIFSIGNALED(status) && WTERMSIG(status) == SIGABRT;
+    printf("  trap on the first allocation: %s\n",
+           trapped ? "aborted" : "not trapped");
+    ok &= trapped;
+
+    if (!ok)
+        printf("FAILED\n");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,332 @@
+/*
+ * Host simulation of the SPI heartbeat of USE_DUAL_SYSTEM_WATCHDOG, both
+ * MCUs on a virtual clock:
+ * 1. The primary, SPI master, transfers every HEARTBEAT_PERIOD. The
+ *    backup, SPI slave, polls every half period, takes the frame of a
+ *    completed transfer and queues its next answer. A transfer that
+ *    finds no answer queued reads 0xff.
+ * 2. Both heartbeat tasks start late, up to 800 us behind the other
+ *    flight core tasks, and 4 ms more in 1 of 2000 runs, a command line.
+ *    1 frame in 10000 has a bit flipped each way.
+ * 3. A flight, launch at 1 s and the apogee at 10 s on the primary,
+ *    within 300 ms of it on the backup and its own sensors.
+ * Runs a nominal hour, then trials where the primary dies during the
+ * flight, the backup dies answering 0xff, or freezes answering its last
+ * frame again. Reported are the loss detection times and the pyros
+ * fired on a takeover.
+ * Exits non-zero on a loss without a failure, a detection over 10 ms in
+ * a trial without a command line stall, a flight without the chute, or
+ * a backup firing while the primary is alive.
+ *
+ * Run: pio run -e bench_heartbeat -t exec
+ */
+#include <heartbeat.h>
+
+#include <cstdio>
+#include <cstring>
+
+#define NOMINAL 3600000000ULL  // us
+#define TRIALS 2000
+#define LAUNCH 1000000ULL  // us
+#define BURNOUT 3500000ULL
+#define APOGEE 10000000ULL
+#define SPREAD 300000  // us, apogee of the backup around the primary's
+#define DETECT 10000   // us, required
+#define LATE 800       // us, the other tasks of the flight core
+#define STALL 4000     // us, a command line
+#define STALL_EVERY 2000
+#define FLIP_EVERY 10000  // frames
+#define POLL (HEARTBEAT_PERIOD / 2)
+
+enum FAILURE { NONE, PRIMARY_DIES, BACKUP_DIES, BACKUP_FREEZES };
+
+static uint32_t seed = 7;
+
+static uint32_t rnd(uint32_t n)
+{
+    seed = seed * 1103515245 + 12345;
+    return ((seed >> 8) ^ (seed << 3)) % n;
+}
+
+#define STALLS 64
+static uint64_t stalls[STALLS];  // Due of the runs a command line delayed
+static uint32_t stallCount;
+
+static uint64_t late(uint64_t due)
+{
+    uint64_t l = rnd(LATE);
+    if (rnd(STALL_EVERY) == 0) {
+        l += STALL;
+        stalls[stallCount++ % STALLS] = due;
+    }
+    return l;
+}
+
+// A command line delayed a task from a timeout before from to until
+static bool stalled(uint64_t from, uint64_t until)
+{
+    for (uint32_t i = 0; i < stallCount && i < STALLS; i++)
+        if (stalls[i] + HEARTBEAT_TIMEOUT >= from && stalls[i] <= until)
+            return true;
+    return false;
+}
+
+static void flip(uint8_t *frame)
+{
+    if (rnd(FLIP_EVERY) == 0) {
+        const uint32_t bit = rnd(HEARTBEAT_FRAME_LEN * 8);
+        frame[bit / 8] ^= 1 << (bit % 8);
+    }
+}
+
+static uint8_t phase_at(uint64_t t, uint64_t launch, uint64_t apogee)
+{
+    if (t < launch)
+        return PHASE_PAD;
+    if (t < launch + BURNOUT - LAUNCH)
+        return PHASE_BOOST;
+    return t < apogee ? PHASE_COAST : PHASE_APOGEE;
+}
+
+/* A periodic task of the scheduler, late by late(), missed periods *
+ * skipped                                                          */
+struct Task {
+    uint64_t due, at;
+    uint32_t period;
+
+    void start(uint64_t t, uint32_t p)
+    {
+        period = p;
+        due = t;
+        at = t + late(due);
+    }
+    void next()
+    {
+        due += period * (1 + (at - due) / period);
+        at = due + late(due);
+    }
+};
+
+struct Trial {
+    FAILURE failure;
+    uint64_t failAt, end;
+    uint64_t backupApogee;  // After its launch, as the primary's
+
+    // Results
+    uint64_t detected;  // us after failAt, the other side saw LOST
+    uint64_t primaryFired, backupFired;
+    uint64_t backupApogeeAt;  // Its launch followed the primary's
+    bool falseLoss;
+    bool backupFiredEarly;  // While the primary was alive
+};
+
+static void run(Trial &r)
+{
+    Heartbeat primary(ROLE_PRIMARY), backup(ROLE_BACKUP);
+    uint8_t answer[HEARTBEAT_FRAME_LEN], received[HEARTBEAT_FRAME_LEN];
+    bool armed = false, done = false;
+    bool followed = false, takenOver = false;
+    uint64_t followedAt = 0;
+    Task m, s;
+
+    stallCount = 0;
+    r.detected = 0;
+    r.backupApogeeAt = 0;
+    r.primaryFired = r.backupFired = 0;
+    r.falseLoss = r.backupFiredEarly = false;
+    primary.reset(0);
+    backup.reset(0);
+    m.start(0, HEARTBEAT_PERIOD);
+    s.start(rnd(POLL), POLL);
+
+    for (;;) {
+        const bool master = m.at <= s.at;
+        const uint64_t t = master ? m.at : s.at;
+        if (t >= r.end)
+            break;
+        const bool failed = r.failure != NONE && t >= r.failAt;
+
+        if (master) {
+            m.next();
+            if (failed && r.failure == PRIMARY_DIES)
+                continue;
+            HeartbeatState &l = primary.local;
+            l.rocket = t >= LAUNCH ? 2 : 0;  // ROCKET_OFFGROUND, READY
+            l.phase = phase_at(t, LAUNCH, APOGEE);
+            if (t >= APOGEE && !r.primaryFired)
+                r.primaryFired = t;
+            l.fired = r.primaryFired ? PYRO_CHUTE : 0;
+            uint8_t frame[HEARTBEAT_FRAME_LEN];
+            primary.encode(frame);
+            uint8_t in[HEARTBEAT_FRAME_LEN];
+            if (armed) {
+                memcpy(in, answer, sizeof(in));
+                memcpy(received, frame, sizeof(received));
+                flip(received);
+                // A frozen backup answers its last frame again
+                armed = failed && r.failure == BACKUP_FREEZES;
+                done = !armed;
+            } else {
+                memset(in, 0xff, sizeof(in));
+            }
+            flip(in);
+            primary.receive(in, (uint32_t) t);
+            if (primary.check((uint32_t) t) == LINK_LOST) {
+                if (!failed)
+                    r.falseLoss = true;
+                else if (!r.detected)
+                    r.detected = t - r.failAt;
+            }
+            continue;
+        }
+
+        // The backup, System::beat() of DUAL_SYSTEM_BACKUP
+        s.next();
+        if (failed && r.failure != PRIMARY_DIES)
+            continue;
+        if (done) {
+            backup.receive(received, (uint32_t) t);
+            done = false;
+        }
+        const uint8_t phase =
+            followed ? phase_at(t, followedAt, r.backupApogeeAt)
+                     : (uint8_t) PHASE_PAD;
+        if (!armed) {
+            backup.local.rocket = followed ? 2 : 0;
+            backup.local.phase = phase;
+            backup.local.fired = r.backupFired ? PYRO_CHUTE : 0;
+            backup.encode(answer);
+            armed = true;
+        }
+        const HEARTBEAT_LINK link = backup.check((uint32_t) t);
+        const HeartbeatState &p = backup.partner;
+        if (link == LINK_OK && !followed && p.rocket == 2) {
+            followed = true;
+            followedAt = t;
+            r.backupApogeeAt = r.backupApogee + followedAt - LAUNCH;
+        }
+        if (link == LINK_LOST && !takenOver) {
+            if (!failed)
+                r.falseLoss = true;
+            else if (!r.detected)
+                r.detected = t - r.failAt;
+            takenOver = p.rocket == 2;
+        }
+        // phaseChanged() fires after a takeover only
+        if (takenOver && !r.backupFired &&
+            (backup.takeover(phase) & PYRO_CHUTE)) {
+            r.backupFired = t;
+            if (!failed)
+                r.backupFiredEarly = true;
+        }
+    }
+}
+
+struct Summary {
+    uint32_t trials, clean, stalledTrials;
+    uint64_t worstClean, worstStalled, total;
+};
+
+static void add(Summary &s, const Trial &r)
+{
+    s.trials++;
+    s.total += r.detected;
+    if (stalled(r.failAt, r.failAt + r.detected)) {
+        s.stalledTrials++;
+        if (r.detected > s.worstStalled)
+            s.worstStalled = r.detected;
+    } else {
+        s.clean++;
+        if (r.detected > s.worstClean)
+            s.worstClean = r.detected;
+    }
+}
+
+static void print(const char *name, const Summary &s)
+{
+    printf("  %-24s avg %5llu us  max %5llu us, %u with a stall max %5llu "
+           "us\n",
+           name, (unsigned long long) (s.trials ? s.total / s.trials : 0),
+           (unsigned long long) s.worstClean, s.stalledTrials,
+           (unsigned long long) s.worstStalled);
+}
+
+int main()
+{
+    bool ok = true;
+
+    // An hour, nothing fails
+    Trial nominal = {};
+    nominal.failure = NONE;
+    nominal.end = NOMINAL;
+    nominal.backupApogee = APOGEE;
+    run(nominal);
+    printf("nominal hour: %s, chute by the primary at %llu ms, by the "
+           "backup %s\n",
+           nominal.falseLoss ? "LOST without a failure" : "no loss",
+           (unsigned long long) nominal.primaryFired / 1000,
+           nominal.backupFired ? "TOO" : "never");
+    ok &= !nominal.falseLoss && !nominal.backupFired;
+
+    Summary primary = {}, backup = {}, frozen = {};
+    uint32_t takeovers = 0, backupFires = 0, twice = 0, noChute = 0;
+    uint32_t early = 0, missed = 0;
+    uint64_t worstOpen = 0;
+    for (uint32_t i = 0; i < TRIALS; i++) {
+        const FAILURE f = (FAILURE) (1 + i % 3);
+        Trial r = {};
+        r.failure = f;
+        r.failAt = 500000 + rnd(14000000);
+        r.end = 20000000;
+        r.backupApogee = APOGEE - SPREAD + rnd(2 * SPREAD);
+        run(r);
+        ok &= !r.falseLoss && !r.backupFiredEarly;
+        early += r.backupFiredEarly;
+        if (!r.detected) {
+            missed++;
+            continue;
+        }
+        if (!stalled(r.failAt, r.failAt + r.detected))
+            ok &= r.detected < DETECT;
+        add(f == PRIMARY_DIES ? primary : f == BACKUP_DIES ? backup : frozen,
+            r);
+        if (f != PRIMARY_DIES)
+            continue;
+
+        // The chute, by whichever was alive at its apogee
+        const bool flying = r.failAt >= LAUNCH + 2 * HEARTBEAT_PERIOD;
+        takeovers += flying;
+        backupFires += r.backupFired != 0;
+        twice += r.primaryFired && r.backupFired;
+        if (!flying)
+            continue;
+        if (!r.primaryFired && !r.backupFired) {
+            noChute++;
+            continue;
+        }
+        const uint64_t open = r.primaryFired ? r.primaryFired : r.backupFired;
+        const uint64_t due = r.failAt + r.detected > r.backupApogeeAt
+                                 ? r.failAt + r.detected
+                                 : r.backupApogeeAt;
+        if (!r.primaryFired && open > due && open - due > worstOpen)
+            worstOpen = open - due;
+    }
+    ok &= missed == 0 && noChute == 0;
+
+    printf("%u trials, loss seen by the other side (HEARTBEAT_TIMEOUT %d "
+           "us)\n",
+           TRIALS, HEARTBEAT_TIMEOUT);
+    print("primary dies", primary);
+    print("backup dies", backup);
+    print("backup freezes", frozen);
+    printf("  not seen %u, losses without a failure 0\n", missed);
+    printf("takeover in flight %u: backup fired %u, after the primary %u, "
+           "no chute %u, late %llu us, fired early %u\n",
+           takeovers, backupFires, twice, noChute,
+           (unsigned long long) worstOpen, early);
+    ok &= worstOpen <= POLL + LATE + STALL;
+
+    if (!ok)
+        printf("FAILED\n");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,300 @@
+/*
+ * Host comparison of the main loop on a virtual clock:
+ * 1. The old System::loop(), every task in sequence on every pass
+ * 2. Scheduler with the task table of core.cpp
+ * 3. The same table on two cores, USE_DUAL_CORE, a clock each
+ * The tasks only advance the clock by their cost, comms, OTA and the
+ * log file have rare slow runs (a websocket flush, a flash erase). The
+ * flight task writes a log line every 10 ms, on two cores it queues it
+ * for the output task, and the command task, every 2 ms there, skips a
+ * run while a comms pass holds ioLock. Reported are the worst gap
+ * between two sensor reads, the task statistics, the loop period and
+ * run time histograms of the stats command, and the depth and latency
+ * of the output queue.
+ * Exits non-zero if a sensor gap exceeds its period plus the tasks it
+ * may wait for, a task never ran, a histogram disagrees with the
+ * counters, or a line is dropped.
+ *
+ * Run: pio run -e bench_scheduler -t exec
+ */
+#include <event_queue.h>
+#include <scheduler.h>
+
+#include <cstdio>
+
+#define DURATION 60000000ULL  // us
+#define FLIGHT_CORE 1         // configs.h
+#define COMMS_CORE 0
+#define OUTPUT_QUEUE_LEN 16
+#define LOG_EVERY 5  // flight runs a line, EVENT_LOG at 10 ms
+#define TICK 1000    // us, vTaskDelay(1)
+#define WAKE 50      // us, esp_timer task and the notification
+
+static uint64_t now;  // Of the core running
+static uint64_t comms_pass_start, comms_pass_end;
+static bool dual = false;
+static uint32_t seed = 1;
+static uint64_t last_sensor, sensor_gap;
+
+static uint32_t clock_us()
+{
+    return (uint32_t) now;
+}
+
+static uint32_t rnd(uint32_t n)
+{
+    seed = seed * 1103515245 + 12345;
+    return (seed >> 8) % n;
+}
+
+/* Cost of a task, `slow` us once in `every` runs */
+struct Cost {
+    uint32_t usual, slow, every;
+};
+
+static void spend(void *ctx)
+{
+    const Cost &c = *(const Cost *) ctx;
+    now += c.every && rnd(c.every) == 0 ? c.slow : c.usual;
+}
+
+static void sensor(void *ctx)
+{
+    if (last_sensor && now - last_sensor > sensor_gap)
+        sensor_gap = now - last_sensor;
+    last_sensor = now;
+    spend(ctx);
+}
+
+static Cost sensor_cost = {600, 0, 0};
+static Cost flight_cost = {150, 0, 0};
+static Cost command_cost = {20, 4000, 2000};
+static Cost serial_cost = {10, 0, 0};
+static Cost comms_cost = {200, 12000, 500};
+static Cost write_cost = {250, 20000, 100};  // A log line
+static Cost ota_cost = {50, 3000, 100};
+
+struct Line {
+    uint64_t posted;  // us
+};
+
+static EventQueue<Line, OUTPUT_QUEUE_LEN> lines;
+static uint32_t flights;
+static uint16_t depth_max;
+static uint64_t latency_max;
+static bool pending;  // A command line
+static uint64_t pending_since, defer_max;
+static uint32_t lock_skips;
+
+// A log line, System::emit()
+static void flight(void *ctx)
+{
+    spend(ctx);
+    if (++flights % LOG_EVERY)
+        return;
+    if (dual) {
+        const Line l = {now};
+        lines.post(l);
+    } else {
+        spend(&write_cost);
+    }
+}
+
+// A slow run is a command line. On two cores the task takes ioLock
+// without waiting, during a comms pass it returns and the line waits.
+static void command(void *ctx)
+{
+    const Cost &c = *(const Cost *) ctx;
+    if (!pending && c.every && rnd(c.every) == 0) {
+        pending = true;
+        pending_since = now;
+    }
+    if (dual && now >= comms_pass_start && now < comms_pass_end) {
+        lock_skips++;
+        now += 1;  // Lock taken
+        return;
+    }
+    if (pending) {
+        if (now - pending_since > defer_max)
+            defer_max = now - pending_since;
+        pending = false;
+        now += c.slow;
+    } else {
+        now += c.usual;
+    }
+}
+
+static void output(void *)
+{
+    if (lines.size() > depth_max)
+        depth_max = lines.size();
+    Line l;
+    while (lines.poll(l)) {
+        if (now > l.posted && now - l.posted > latency_max)
+            latency_max = now - l.posted;
+        spend(&write_cost);
+    }
+}
+
+// name, function, period us, priority, budget us, core, cost
+static SchedulerTask tasks[] = {
+    {"sensor", sensor, 2000, 3, 1500, FLIGHT_CORE, &sensor_cost},
+    {"flight", flight, 2000, 3, 1000, FLIGHT_CORE, &flight_cost},
+    {"command", command, 0, 3, 5000, FLIGHT_CORE, &command_cost},
+    {"serial", spend, 0, 1, 500, COMMS_CORE, &serial_cost},
+    {"comms", spend, 2000, 1, 5000, COMMS_CORE, &comms_cost},
+    {"ota", spend, 100000, 0, 5000, COMMS_CORE, &ota_cost},
+    {"output", output, 0, 1, 5000, COMMS_CORE, 0},  // Idle on one core
+};
+#define TASKS (sizeof(tasks) / sizeof(tasks[0]))
+
+static void reset()
+{
+    now = 1;
+    seed = 1;
+    last_sensor = 0;
+    sensor_gap = 0;
+    flights = 0;
+}
+
+static void print_tasks(const Scheduler &scheduler)
+{
+    for (uint8_t i = 0; i < scheduler.size(); i++) {
+        const SchedulerTask &t = scheduler.task(i);
+        printf("  %-8s runs %7u  avg %5llu us  max %5u us  late max %6u us  "
+               "overrun %4u  skipped %4u\n",
+               t.name, t.runs,
+               (unsigned long long) (t.runs ? t.timeTotal / t.runs : 0),
+               t.timeMax, t.lateMax, t.overruns, t.skipped);
+    }
+}
+
+int main()
+{
+    // The old loop, everything on every pass
+    uint64_t passes = 0;
+    while (now < DURATION) {
+        for (uint8_t i = 0; i < TASKS; i++)
+            tasks[i].run(tasks[i].ctx);
+        passes++;
+    }
+    const uint64_t sequential_gap = sensor_gap;
+    printf("sequential: %llu passes, sensor runs every pass, worst gap %llu "
+           "us\n",
+           (unsigned long long) passes, (unsigned long long) sequential_gap);
+
+    reset();
+    Scheduler scheduler(tasks, TASKS, clock_us);
+    LoopTimer timer;  // The virtual clock is the cycle counter, 1 per us
+    scheduler.start();
+    while (now < DURATION) {
+        timer.pass(clock_us());
+        if (!scheduler.run())
+            now += 50;  // Idle, the real loop spins
+    }
+
+    printf("scheduled: %u passes, worst sensor gap %llu us\n",
+           scheduler.passes[0], (unsigned long long) sensor_gap);
+    print_tasks(scheduler);
+    bool ok = true;
+    uint32_t longest_lower = 0;
+    for (uint8_t i = 0; i < scheduler.size(); i++) {
+        const SchedulerTask &t = scheduler.task(i);
+        ok &= t.runs > 0;
+        ok &= t.time.count == t.runs && t.time.max == t.timeMax;
+        if (t.priority < tasks[0].priority && t.timeMax > longest_lower)
+            longest_lower = t.timeMax;
+    }
+
+    // The sensor waits for at most one lower task and the flight and
+    // command tasks of its own priority
+    uint32_t bound = tasks[0].period + longest_lower +
+                     scheduler.task(1).timeMax + scheduler.task(2).timeMax;
+    ok &= sensor_gap <= bound;
+    printf("sensor gap bound %u us\n", bound);
+
+    char line[LOOP_STATS_LINE];
+    timer.period.print(line, sizeof(line));
+    printf("stats\n  loop period: %s\n", line);
+    for (uint8_t i = 0; i < scheduler.size(); i++) {
+        scheduler.task(i).time.print(line, sizeof(line));
+        printf("  %s: %s\n", scheduler.task(i).name, line);
+    }
+    ok &= timer.period.count == scheduler.passes[0] - 1;
+    const uint64_t single_gap = sensor_gap;
+
+    // Two cores, the one behind runs next. The flight core blocks until
+    // its next task is due, plus the wake up of the timer, and passes
+    // only then. The comms core sleeps a tick every pass.
+    reset();
+    dual = true;
+    tasks[2].period = 2000;  // COMMAND_TASK_PERIOD
+    defer_max = 0;
+    uint64_t clocks[2] = {1, 1};
+    Scheduler cores(tasks, TASKS, clock_us);
+    LoopTimer flight_timer;
+    uint32_t flight_passes = 0;
+    cores.start();
+    while (clocks[FLIGHT_CORE] < DURATION || clocks[COMMS_CORE] < DURATION) {
+        const uint8_t core =
+            clocks[FLIGHT_CORE] <= clocks[COMMS_CORE] ? FLIGHT_CORE
+                                                      : COMMS_CORE;
+        now = clocks[core];
+        if (core == FLIGHT_CORE) {
+            const uint32_t wait = cores.untilDue(FLIGHT_CORE);
+            if (wait) {
+                now += wait + WAKE;
+            } else {
+                flight_timer.pass(clock_us());
+                flight_passes++;
+                cores.run(FLIGHT_CORE);
+            }
+        } else {
+            comms_pass_start = now;
+            cores.run(COMMS_CORE);
+            comms_pass_end = now;
+            now += TICK;
+        }
+        clocks[core] = now;
+    }
+    now = clocks[COMMS_CORE];
+    output(0);  // The lines posted after its last pass
+
+    printf("two cores: worst sensor gap %llu us, one core %llu us\n",
+           (unsigned long long) sensor_gap, (unsigned long long) single_gap);
+    print_tasks(cores);
+    // The sensor waits for the other tasks of the flight core, each at
+    // most once, never for one of the comms core
+    bound = tasks[0].period + WAKE;
+    for (uint8_t i = 0; i < cores.size(); i++) {
+        const SchedulerTask &t = cores.task(i);
+        ok &= t.runs > 0;
+        ok &= t.time.count == t.runs && t.time.max == t.timeMax;
+        if (i > 0 && t.core == FLIGHT_CORE)
+            bound += t.timeMax;
+    }
+    ok &= sensor_gap <= bound;
+    printf("sensor gap bound %u us\n", bound);
+    printf("command runs skipped for ioLock %u, line wait max %llu us\n",
+           lock_skips, (unsigned long long) defer_max);
+    printf("output queue: %u lines, depth max %u of %u, latency max %llu "
+           "us, dropped %u\n",
+           lines.posted, depth_max, OUTPUT_QUEUE_LEN,
+           (unsigned long long) latency_max, lines.dropped);
+    ok &= lines.dropped == 0 && lines.handled == lines.posted;
+    ok &= lines.posted == flights / LOG_EVERY;
+    flight_timer.period.print(line, sizeof(line));
+    printf("stats\n  loop period: %s\n", line);
+    ok &= flight_timer.period.count == flight_passes - 1;
+    uint32_t flight_runs = 0;  // A pass runs one task at least
+    for (uint8_t i = 0; i < cores.size(); i++)
+        if (cores.task(i).core == FLIGHT_CORE)
+            flight_runs += cores.task(i).runs;
+    ok &= flight_passes <= flight_runs;
+    printf("flight core: %u passes, %u task runs\n", flight_passes,
+           flight_runs);
+
+    if (!ok)
+        printf("FAILED\n");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,149 @@
+/*
+ * Host check of the delta-encoded LoRa state stream (state_codec.h).
+ * A simulated flight is sent at 10 Hz over a lossy link and reports
+ * 1. Reconstruction error of every field against the truth
+ * 2. Bytes and airtime per update against the legacy state packet
+ * 3. Updates lost because their keyframe was lost
+ * Exits non-zero if an error exceeds the delta resolution.
+ *
+ * Run: pio run -e bench_state -t exec
+ */
+#include <airtime.h>
+#include <state_codec.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+
+#define RATE 10       // Hz
+#define DURATION 120  // s
+#define GPS_FIX 5     // s, position jumps from 0 when the GPS gets a fix
+
+static const LoraModulation modulation = {7, 125000, 1, 8, true, true};
+
+static LoraState truth(float t)
+{
+    LoraState s;
+    // Boost for 3 s, coast to apogee, then descent on a parachute
+    const float burn = 3, accel = 80, g = 9.81f;
+    const float v0 = accel * burn, h0 = 0.5f * accel * burn * burn;
+    const float apogee_t = burn + v0 / g;
+    if (t < burn) {
+        s.speed = accel * t;
+        s.height = 0.5f * accel * t * t;
+    } else if (t < apogee_t) {
+        s.speed = v0 - g * (t - burn);
+        s.height = h0 + v0 * (t - burn) - 0.5f * g * (t - burn) * (t - burn);
+    } else {
+        const float top = h0 + v0 * v0 / (2 * g);
+        s.speed = -8;
+        s.height = fmaxf(top - 8 * (t - apogee_t), 0);
+    }
+    s.angular_velocity = 360 * sinf(t * 0.7f);
+    s.battery = 100 - (uint8_t) (t / 10);
+    s.satellite = t < GPS_FIX ? 0 : 9;
+    // Drift with the wind, about 1 m/s north east of the pad
+    s.longitude = t < GPS_FIX ? 0 : 1213456789 + (int32_t) (t * 100);
+    s.latitude = t < GPS_FIX ? 0 : 247654321 + (int32_t) (t * 90);
+    return s;
+}
+
+struct Errors {
+    float height, speed, angular;
+    int32_t position;
+};
+
+static void compare(const LoraState &a, const LoraState &b, Errors &e)
+{
+    e.height = fmaxf(e.height, fabsf(a.height - b.height));
+    e.speed = fmaxf(e.speed, fabsf(a.speed - b.speed));
+    e.angular = fmaxf(e.angular, fabsf(a.angular_velocity - b.angular_velocity));
+    e.position = std::max(e.position, std::abs(a.longitude - b.longitude));
+    e.position = std::max(e.position, std::abs(a.latitude - b.latitude));
+    if (a.battery != b.battery || a.satellite != b.satellite)
+        e.position = INT32_MAX;
+}
+
+/* Per update bytes and airtime when frames are filled with packets of size
+ * `bytes` on average, at most LORA_PACKET_SIZE per frame. */
+static void per_update(const char *name, float bytes)
+{
+    const int per_frame = (int) (LORA_PACKET_SIZE / bytes);
+    printf("  %-8s %5.1f B/update  %5u us/update alone  %5u us/update in "
+           "%d-packet frames\n",
+           name, bytes, lora_airtime(modulation, (uint8_t) (bytes + 0.5f)),
+           lora_airtime(modulation, (uint8_t) (per_frame * bytes + 0.5f)) /
+               per_frame,
+           per_frame);
+}
+
+static bool run(float loss, uint32_t seed)
+{
+    LoraStateEncoder encoder;
+    LoraStateDecoder decoder;
+    std::mt19937 rng(seed);
+    std::bernoulli_distribution lost(loss);
+    Errors e = {0, 0, 0, 0};
+    uint32_t bytes = 0, sent = 0, received = 0, dropped = 0;
+    uint32_t gap = 0, gap_max = 0;
+
+    for (uint32_t i = 0; i < DURATION * RATE; i++) {
+        const LoraState s = truth((float) i / RATE);
+        uint8_t buf[LORA_PACKET_SIZE];
+        bytes += encoder.encode(s, i & 0xFF, buf);
+        sent++;
+
+        LoraState r;
+        if (lost(rng)) {
+            dropped++;
+        } else if (decoder.decode(buf, r)) {
+            compare(s, r, e);
+            received++;
+            gap = 0;
+            continue;
+        }
+        gap_max = std::max(gap_max, ++gap);
+    }
+
+    printf("loss %2.0f%%: %u updates, %u keyframes (%u forced), %u deltas, "
+           "%.1f B/update\n",
+           loss * 100, sent, encoder.keyframes, encoder.forced,
+           encoder.deltas, (float) bytes / sent);
+    printf("  received %u, dropped %u, orphan deltas %u, longest gap %u\n",
+           received, dropped, decoder.orphans, gap_max);
+    printf("  max error: height %.3f m, speed %.3f m/s, angular %.3f deg/s, "
+           "position %d e-7 deg\n",
+           e.height, e.speed, e.angular, e.position);
+
+    // Half a unit of rounding plus the float error at these magnitudes
+    const bool ok = e.height <= LORA_DELTA_HEIGHT / 2 + 1e-3f &&
+                    e.speed <= LORA_DELTA_SPEED / 2 + 1e-3f &&
+                    e.angular <= LORA_DELTA_ANGULAR / 2 + 1e-3f &&
+                    e.position <= LORA_DELTA_POSITION / 2 &&
+                    received + dropped + decoder.orphans == sent;
+    if (!ok)
+        printf("  FAILED\n");
+    return ok;
+}
+
+int main()
+{
+    bool ok = true;
+    ok &= run(0, 1);
+    ok &= run(0.1f, 2);
+    ok &= run(0.3f, 3);
+
+    const float stream = (LoraKeyframeCodec::size +
+                          (LORA_STATE_KEYFRAME - 1) * LoraDeltaCodec::size) /
+                         (float) LORA_STATE_KEYFRAME;
+    printf("keyframe %u B, delta %u B, legacy state %u B (position cut to "
+           "its lowest byte), every %u packets:\n",
+           LoraKeyframeCodec::size, LoraDeltaCodec::size,
+           LoraStateCodec::size, LORA_STATE_KEYFRAME);
+    per_update("legacy", LoraStateCodec::size);
+    per_update("keyframe", LoraKeyframeCodec::size);
+    per_update("stream", stream);
+    return ok ? 0 : 1;
+}
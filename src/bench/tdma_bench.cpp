@@ -0,0 +1,225 @@
+/*
+ * Host simulation of the LoRa channel shared by ground and vehicle.
+ * Compares the CAD-then-send access with the TDMA schedule on
+ * 1. Downlink telemetry delivered and collided
+ * 2. Uplink command latency (p50 and worst case)
+ * The vehicle clock drifts against the ground and only follows the
+ * beacons. Airtime comes from lora_airtime() at SF7/125 kHz, CR 4/5.
+ *
+ * Run: pio run -e bench_tdma -t exec
+ */
+#include <airtime.h>
+#include <tdma.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <random>
+#include <vector>
+
+#define STEP 100  // us, simulation resolution
+#define SF 7
+#define BANDWIDTH 125000
+#define TELEMETRY_BYTES 64
+#define COMMAND_PERIOD 2000000  // us, mean
+#define COMMAND_BYTES 20
+#define BEACON_BYTES 7
+#define QUEUE_LEN 8
+
+static const LoraModulation modulation = {SF, BANDWIDTH, 1, 8, true, true};
+
+static uint32_t airtime(uint8_t bytes)
+{
+    return lora_airtime(modulation, bytes);
+}
+
+enum { GROUND, VEHICLE };
+enum { PKT_TELEMETRY, PKT_COMMAND, PKT_BEACON };
+
+struct Packet {
+    uint8_t kind;
+    uint8_t bytes;
+    uint64_t born;
+    uint16_t frame;
+    uint32_t late;
+};
+
+struct Node {
+    TdmaScheduler tdma;
+    double ppm;
+    int64_t offset;
+    std::deque<Packet> queue;
+    enum { IDLE, CAD, TX } state;
+    uint64_t until;
+    uint64_t backoff;
+    Packet air;
+    uint64_t air_start, air_end;
+
+    Node(TDMA_ROLE role, const TdmaConfig &config, double ppm, int64_t offset)
+        : tdma(role, config),
+          ppm(ppm),
+          offset(offset),
+          state(IDLE),
+          until(0),
+          backoff(0),
+          air(),
+          air_start(0),
+          air_end(0)
+    {
+    }
+
+    /* Clock of this node at the true time t */
+    uint32_t local(uint64_t t) const
+    {
+        return (uint32_t) (t + offset + (int64_t) (t * ppm / 1e6));
+    }
+
+    void push(const Packet &p)
+    {
+        if (queue.size() == QUEUE_LEN)
+            queue.pop_front();
+        queue.push_back(p);
+    }
+
+    void transmit(const Packet &p, uint64_t t)
+    {
+        air = p;
+        air_start = t;
+        air_end = until = t + airtime(p.bytes);
+        state = TX;
+    }
+};
+
+struct Result {
+    uint32_t telemetry_sent = 0, telemetry_ok = 0;
+    uint32_t commands = 0, commands_ok = 0;
+    uint32_t collisions = 0, cad_busy = 0;
+    std::vector<uint32_t> latency;
+};
+
+static uint32_t percentile(std::vector<uint32_t> v, float p)
+{
+    if (v.empty())
+        return 0;
+    std::sort(v.begin(), v.end());
+    return v[(size_t) (p * (v.size() - 1))];
+}
+
+static Result simulate(bool use_tdma,
+                       const TdmaConfig &config,
+                       uint32_t period,
+                       uint64_t length)
+{
+    Node nodes[2] = {Node(TDMA_GROUND, config, 0, 0),
+                     Node(TDMA_VEHICLE, config, 30, 123456789)};
+    std::mt19937 rng(7);
+    std::exponential_distribution<double> next_cmd(1.0 / COMMAND_PERIOD);
+    std::uniform_int_distribution<uint32_t> backoff(10000, 50000);
+    const uint32_t cad = 8 * lora_symbol_time(modulation);
+    Result r;
+
+    if (use_tdma)
+        nodes[GROUND].tdma.start(nodes[GROUND].local(0));
+    uint64_t telemetry_at = 0, command_at = next_cmd(rng);
+
+    for (uint64_t t = 0; t < length; t += STEP) {
+        if (t >= telemetry_at) {
+            nodes[VEHICLE].push({PKT_TELEMETRY, TELEMETRY_BYTES, t, 0, 0});
+            r.telemetry_sent++;
+            telemetry_at += period;
+        }
+        if (t >= command_at) {
+            nodes[GROUND].push({PKT_COMMAND, COMMAND_BYTES, t, 0, 0});
+            r.commands++;
+            command_at += next_cmd(rng);
+        }
+
+        for (int i = 0; i < 2; i++) {
+            Node &n = nodes[i], &other = nodes[1 - i];
+            const uint32_t now = n.local(t);
+
+            if (n.state == Node::TX) {
+                if (t < n.until)
+                    continue;
+                n.state = Node::IDLE;
+                // Lost if the other side was on air at any moment of it,
+                // the receiver is half duplex
+                if (other.air_end > n.air_start && other.air_start < t) {
+                    r.collisions++;
+                } else if (n.air.kind == PKT_BEACON) {
+                    other.tdma.onBeacon(other.local(t), n.air.frame,
+                                        n.air.late, airtime(n.air.bytes));
+                } else if (n.air.kind == PKT_TELEMETRY) {
+                    r.telemetry_ok++;
+                } else {
+                    r.commands_ok++;
+                    r.latency.push_back(t - n.air.born);
+                }
+                continue;
+            }
+            if (n.state == Node::CAD) {
+                if (t < n.until)
+                    continue;
+                n.state = Node::IDLE;
+                if (other.state == Node::TX) {
+                    r.cad_busy++;
+                    n.backoff = t + backoff(rng);
+                } else {
+                    n.transmit(n.queue.front(), t);
+                    n.queue.pop_front();
+                }
+                continue;
+            }
+
+            uint32_t late;
+            if (use_tdma && n.tdma.beaconDue(now, &late)) {
+                n.transmit({PKT_BEACON, BEACON_BYTES, t, n.tdma.frame(now),
+                            late},
+                           t);
+                continue;
+            }
+            if (n.queue.empty() || t < n.backoff)
+                continue;
+            if (use_tdma && n.tdma.synced(now)) {
+                if (n.tdma.canSend(now, airtime(n.queue.front().bytes))) {
+                    n.transmit(n.queue.front(), t);
+                    n.queue.pop_front();
+                }
+                continue;
+            }
+            n.state = Node::CAD;
+            n.until = t + cad;
+        }
+    }
+    return r;
+}
+
+static void report(const char *name, const Result &r)
+{
+    printf("  %-5s telemetry %5u/%-5u  commands %4u/%-4u  collisions %4u  "
+           "cad busy %5u  command p50 %4u ms max %5u ms\n",
+           name, r.telemetry_ok, r.telemetry_sent, r.commands_ok, r.commands,
+           r.collisions, r.cad_busy, percentile(r.latency, 0.5f) / 1000,
+           percentile(r.latency, 1.0f) / 1000);
+}
+
+int main(int argc, char **argv)
+{
+    const uint64_t seconds = argc > 1 ? atoi(argv[1]) : 600;
+    const uint32_t slot = 130000;
+    const TdmaConfig config = {slot / 3, slot, 5000, 4, 1, 4};
+    printf("airtime: telemetry %u us, command %u us, frame %u us\n",
+           airtime(TELEMETRY_BYTES), airtime(COMMAND_BYTES),
+           TdmaScheduler(TDMA_GROUND, config).frameLength());
+
+    // Telemetry rate below and above the downlink capacity
+    const uint32_t periods[] = {200000, 100000};
+    for (uint32_t period : periods) {
+        printf("telemetry every %u ms, %u s\n", period / 1000,
+               (uint32_t) seconds);
+        report("cad", simulate(false, config, period, seconds * 1000000ULL));
+        report("tdma", simulate(true, config, period, seconds * 1000000ULL));
+    }
+    return 0;
+}
@@ -0,0 +1,249 @@
+/*
+ * Host benchmark of the board-to-board message paths.
+ * The vehicle and the ground station run on LoopbackTransport with
+ * injected loss, reordering and delay, and the benchmark reports the
+ * throughput and p50/p99 latency of
+ * 1. Telemetry text stream (single frame and fragmented)
+ * 2. Acknowledged commands through CommandChannel
+ * 3. The same with the ground station rebooting between bursts, a
+ *    command acked as executed must have run on the vehicle
+ *
+ * Run: pio run -e bench_transport -t exec
+ */
+#include <command_channel.h>
+#include <transport.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+enum { PEER_GROUND, PEER_IGNITOR, PEER_VEHICLE };
+
+struct Scenario {
+    const char *name;
+    LoopbackTransport::Impairment imp;
+};
+
+static const Scenario scenarios[] = {
+    {"clean", {0, 0, 0, 0, 0}},
+    {"air 2ms", {0, 0, 2000, 1000, 0}},
+    {"loss 10%", {0.1f, 0, 2000, 1000, 0}},
+    {"reorder 10%", {0, 0.1f, 2000, 1000, 5000}},
+    {"loss+reorder", {0.05f, 0.05f, 2000, 1000, 5000}},
+};
+
+static uint32_t percentile(std::vector<uint32_t> &v, float p)
+{
+    if (v.empty())
+        return 0;
+    std::sort(v.begin(), v.end());
+    return v[(size_t) (p * (v.size() - 1))];
+}
+
+static void report(const char *path,
+                   uint32_t sent,
+                   uint32_t received,
+                   uint32_t elapsed,
+                   std::vector<uint32_t> &latency)
+{
+    printf("  %-12s %6u/%-6u msg  %9.0f msg/s  p50 %7u us  p99 %7u us\n",
+           path, received, sent, received * 1e6 / (elapsed ? elapsed : 1),
+           percentile(latency, 0.5f), percentile(latency, 0.99f));
+}
+
+struct Link {
+    LoopbackTransport ground;
+    LoopbackTransport vehicle;
+
+    Link(const LoopbackTransport::Impairment &imp)
+        : ground(PEER_GROUND, 1), vehicle(PEER_VEHICLE, 2)
+    {
+        ground.connect(PEER_VEHICLE, &vehicle);
+        vehicle.connect(PEER_GROUND, &ground);
+        ground.setImpairment(imp);
+        vehicle.setImpairment(imp);
+    }
+    void poll()
+    {
+        ground.poll();
+        vehicle.poll();
+    }
+    bool idle() const { return !ground.inflight() && !vehicle.inflight(); }
+};
+
+struct TextSink {
+    TextAssembler text;
+    std::vector<uint32_t> latency;
+    uint32_t corrupt = 0;
+};
+
+static void onText(void *ctx, uint8_t, const uint8_t *data, uint8_t len)
+{
+    TextSink *sink = (TextSink *) ctx;
+    sink->text.append(data, len);
+    char *msg = sink->text.fetch();
+    if (!msg)
+        return;
+    unsigned seq, t;
+    if (sscanf(msg, "t,%u,%u,", &seq, &t) == 2)
+        sink->latency.push_back(transport_micros() - t);
+    else
+        sink->corrupt++;
+    sink->text.clear();
+}
+
+/* Vehicle streams telemetry lines of `size` bytes to the ground. */
+static void bench_telemetry(const Scenario &s,
+                            const char *path,
+                            size_t size,
+                            uint32_t count)
+{
+    Link link(s.imp);
+    TextSink sink;
+    link.ground.onReceive(onText, &sink);
+
+    std::vector<char> line(size + 1);
+    const uint32_t start = transport_micros();
+    for (uint32_t i = 0; i < count; i++) {
+        int n = snprintf(line.data(), line.size(), "t,%u,%u,", i,
+                         transport_micros());
+        std::fill(line.begin() + n, line.end() - 2, '0');
+        line[size - 1] = '\n';
+        line[size] = 0;
+        link.vehicle.send_text(PEER_GROUND, line.data());
+        link.poll();
+    }
+    while (!link.idle())
+        link.poll();
+    report(path, count, sink.latency.size(), transport_micros() - start,
+           sink.latency);
+    if (sink.corrupt || sink.text.overflow)
+        printf("  %-12s %u corrupt, %u overflow\n", "", sink.corrupt,
+               sink.text.overflow);
+}
+
+struct CommandSink {
+    std::vector<uint32_t> rtt;
+    uint32_t lost = 0;
+    uint32_t done = 0;
+    uint32_t executed = 0;  // Acked as executed
+};
+
+static void onGround(void *ctx, uint8_t peer, const uint8_t *data, uint8_t len)
+{
+    ((CommandChannel *) ctx)->onFrame(peer, data, len);
+}
+
+static void onVehicle(void *ctx, uint8_t peer, const uint8_t *data, uint8_t len)
+{
+    ((CommandChannel *) ctx)->onFrame(peer, data, len);
+}
+
+static void onReport(void *ctx,
+                     uint8_t /* peer */,
+                     uint16_t /* seq */,
+                     COMMAND_STATUS status,
+                     uint32_t rtt)
+{
+    CommandSink *sink = (CommandSink *) ctx;
+    sink->done++;
+    sink->executed += status == COMMAND_EXECUTED;
+    if (status == COMMAND_LOST)
+        sink->lost++;
+    else
+        sink->rtt.push_back(rtt);
+}
+
+/* Ground sends commands with up to ESPNOW_CMD_PENDING_LEN in flight, *
+ * the vehicle executes each of them once and acks.                   */
+static void bench_command(const Scenario &s, uint32_t count)
+{
+    Link link(s.imp);
+    CommandChannel ground(&link.ground), vehicle(&link.vehicle);
+    CommandSink sink;
+    link.ground.onReceive(onGround, &ground);
+    link.vehicle.onReceive(onVehicle, &vehicle);
+    ground.onReport(onReport, &sink);
+
+    static const char *cmds[] = {"rocket", "stream", "nostream", "count 10"};
+    uint32_t sent = 0, executed = 0;
+    const uint32_t start = transport_micros();
+    while (sink.done < count) {
+        // Only move to the next sequence number once the command is out
+        if (sent < count && ground.send(PEER_VEHICLE, cmds[sent % 4])) {
+            ground.next();
+            sent++;
+        }
+        link.poll();
+        if (vehicle.fetch()) {
+            executed++;
+            vehicle.ack();
+        }
+        vehicle.update();
+        ground.update();
+    }
+    report("command", count, sink.rtt.size(), transport_micros() - start,
+           sink.rtt);
+    printf("  %-12s %u executed, %u lost, %u resent\n", "", executed,
+           sink.lost, ground.resent);
+}
+
+/* The ground reboots after every burst of commands, a new channel with *
+ * a new session, while the vehicle keeps its history. Return false if  *
+ * a command was acked as executed without running.                     */
+static bool bench_reboot(const Scenario &s, uint32_t count)
+{
+    const uint32_t burst = 20;
+    Link link(s.imp);
+    CommandChannel vehicle(&link.vehicle);
+    link.vehicle.onReceive(onVehicle, &vehicle);
+    uint32_t executed = 0, acked = 0, lost = 0, reboots = 0;
+    for (uint32_t done = 0; done < count; done += burst, reboots++) {
+        CommandChannel ground(&link.ground);
+        CommandSink sink;
+        link.ground.onReceive(onGround, &ground);
+        ground.onReport(onReport, &sink);
+        uint32_t sent = 0;
+        while (sink.done < burst) {
+            if (sent < burst && ground.send(PEER_VEHICLE, "open")) {
+                ground.next();
+                sent++;
+            }
+            link.poll();
+            if (vehicle.fetch()) {
+                executed++;
+                vehicle.ack();
+            }
+            vehicle.update();
+            ground.update();
+        }
+        // Frames still in the air reach the rebooted ground, not this one
+        while (!link.idle())
+            link.poll();
+        acked += sink.executed;
+        lost += sink.lost;
+    }
+    printf("  %-12s %u reboots, %u executed, %u acked as executed, %u "
+           "lost\n",
+           "reboot", reboots, executed, acked, lost);
+    return acked <= executed;
+}
+
+int main(int argc, char **argv)
+{
+    const uint32_t count = argc > 1 ? atoi(argv[1]) : 2000;
+    bool ok = true;
+    for (const auto &s : scenarios) {
+        printf("%s (loss %.0f%%, reorder %.0f%%, delay %u+%u us)\n", s.name,
+               s.imp.loss * 100, s.imp.reorder * 100, s.imp.delay,
+               s.imp.jitter);
+        bench_telemetry(s, "telemetry", 120, count);
+        bench_telemetry(s, "fragmented", 450, count / 4);
+        bench_command(s, count / 4);
+        ok &= bench_reboot(s, count / 4);
+    }
+    if (!ok)
+        printf("FAILED\n");
+    return ok ? 0 : 1;
+}
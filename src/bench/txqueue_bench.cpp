@@ -0,0 +1,171 @@
+/*
+ * Host comparison of the LoRa transmit queues on a link slower than the
+ * telemetry, SF9/125 kHz with one 64 B frame at a time:
+ * 1. The plain FIFO of TX_BUFFER_LEN, refusing pushes when full
+ * 2. LoraTxQueue, priorities and latest value wins (tx_queue.h)
+ * The vehicle streams state (keyframe + deltas) and vectors at 10 Hz and
+ * raises events, with a burst in the middle. Reported are the age of the
+ * newest state the ground has at each frame and the events lost.
+ * Exits non-zero if LoraTxQueue loses an event or lets the state age
+ * beyond the frame on air, its own frame and one state period, but
+ * for the burst which goes first.
+ *
+ * Run: pio run -e bench_txqueue -t exec
+ */
+#include <airtime.h>
+#include <state_codec.h>
+#include <tx_queue.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#define QUEUE_LEN 8     // TX_BUFFER_LEN
+#define PERIOD 100000   // us, state and vector
+#define DURATION 600    // s
+#define EVENT_EVERY 37  // state periods
+#define BURST_AT 3000   // state period of the burst
+#define BURST 6         // events, below QUEUE_LEN
+
+static const LoraModulation modulation = {9, 125000, 1, 8, true, true};
+
+/* cppQueue in FIFO mode without overwrite, as q_tx was */
+class FifoQueue
+{
+private:
+    LoraQueued entries[QUEUE_LEN];
+    uint8_t first, count;
+
+public:
+    FifoQueue() : first(0), count(0) {}
+
+    bool push(const LoraQueued *q)
+    {
+        if (count == QUEUE_LEN)
+            return false;
+        entries[(first + count++) % QUEUE_LEN] = *q;
+        return true;
+    }
+
+    bool peek(LoraQueued *q) const
+    {
+        if (!count)
+            return false;
+        *q = entries[first];
+        return true;
+    }
+
+    void drop()
+    {
+        first = (first + 1) % QUEUE_LEN;
+        count--;
+    }
+};
+
+struct Result {
+    uint32_t events, events_lost, frames;
+    std::vector<uint32_t> age;  // us, newest state at the ground per frame
+};
+
+template <typename Queue>
+static Result simulate()
+{
+    Queue queue;
+    LoraStateEncoder encoder;
+    Result r = {0, 0, 0, std::vector<uint32_t>()};
+    uint64_t newest = 0;  // us, production time of the newest state received
+    bool have_state = false;
+    uint64_t air_end = 0;
+    uint8_t frame_types[LORA_PACKET_SIZE];
+    uint64_t frame_born[LORA_PACKET_SIZE];
+    uint8_t frame_count = 0;
+    uint32_t tick = 0;
+
+    for (uint64_t t = 0; t < DURATION * 1000000ULL; t += 1000) {
+        if (t >= (uint64_t) tick * PERIOD) {
+            LoraQueued q;
+            q.queued = (uint32_t) t;
+            LoraState s = {90, 9, tick * 0.5f, 10, 0, 1213456789, 247654321};
+            encoder.encode(s, 0, q.packet);
+            if (!queue.push(&q) && q.packet[1] == LORA_PACKET_KEYFRAME)
+                encoder.restart();
+            LoraVectorCodec::pack(q.packet, 0, 0.0f, 0.0f, 9.8f);
+            queue.push(&q);
+            const uint32_t events =
+                tick == BURST_AT ? BURST : tick % EVENT_EVERY == 0;
+            for (uint32_t i = 0; i < events; i++) {
+                LoraMessageCodec::pack(q.packet, 0, LoraText<15>());
+                r.events++;
+                if (!queue.push(&q))
+                    r.events_lost++;
+            }
+            tick++;
+        }
+
+        if (t < air_end)
+            continue;
+        // The frame on air arrived
+        for (uint8_t i = 0; i < frame_count; i++) {
+            if (frame_types[i] == LORA_PACKET_KEYFRAME ||
+                frame_types[i] == LORA_PACKET_DELTA) {
+                newest = std::max(newest, frame_born[i]);
+                have_state = true;
+            }
+        }
+        if (frame_count && have_state)
+            r.age.push_back((uint32_t) (t - newest));
+
+        // Aggregate the next frame like LoraCommunication::aggregate()
+        LoraQueued q;
+        uint8_t length = 0;
+        frame_count = 0;
+        while (queue.peek(&q) && length + q.packet[0] <= LORA_PACKET_SIZE) {
+            queue.drop();
+            length += q.packet[0];
+            frame_types[frame_count] = q.packet[1];
+            frame_born[frame_count++] = q.queued;
+        }
+        if (length) {
+            air_end = t + lora_airtime(modulation, length);
+            r.frames++;
+        }
+    }
+    return r;
+}
+
+static uint32_t percentile(std::vector<uint32_t> v, float p)
+{
+    if (v.empty())
+        return 0;
+    std::sort(v.begin(), v.end());
+    return v[(size_t) (p * (v.size() - 1))];
+}
+
+static void report(const char *name, const Result &r)
+{
+    printf("  %-12s frames %5u  events %4u lost %3u  state age p50 %5u ms "
+           "p99 %5u ms max %5u ms\n",
+           name, r.frames, r.events, r.events_lost,
+           percentile(r.age, 0.5f) / 1000, percentile(r.age, 0.99f) / 1000,
+           percentile(r.age, 1.0f) / 1000);
+}
+
+int main()
+{
+    const uint32_t frame = lora_airtime(modulation, LORA_PACKET_SIZE);
+    printf("SF%u, full frame %u ms, state and vector every %u ms, %u s\n",
+           modulation.sf, frame / 1000, PERIOD / 1000, DURATION);
+
+    const Result fifo = simulate<FifoQueue>();
+    const Result latest = simulate<LoraTxQueue<QUEUE_LEN> >();
+    report("fifo", fifo);
+    report("LoraTxQueue", latest);
+
+    // The state may wait for the frame on air, then for its own frame
+    const bool ok = latest.events_lost == 0 &&
+                    percentile(latest.age, 0.99f) <= 2 * frame + PERIOD;
+    if (!ok)
+        printf("FAILED\n");
+    return ok ? 0 : 1;
+}
@@ -4,7 +4,13 @@ System *sys;
 
 void setup()
 {
-    delay(3000);
+#ifdef USE_WARM_BOOT
+    // A restart with the calibration kept, in flight maybe, does not wait
+    if (!WarmBoot().load())
+        delay(BOOT_WAIT);
+#else
+    delay(BOOT_WAIT);
+#endif
     Serial.begin(115200);
     // Serial.setDebugOutput(true);
 #if (!defined(USE_SERIAL_COMMS)) && (!defined(USE_SERIAL_DEBUGGER))